@@ -0,0 +1,237 @@
+#include <benchmark/benchmark.h>
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "bufferedinput.hpp"
+#include "comparator.hpp"
+#include "fastaview.hpp"
+#include "fastqview.hpp"
+#include "hash_dup_remover.hpp"
+#include "key_set.hpp"
+#include "seq_utils.hpp"
+#include "synthetic.hpp"
+
+/*
+Microbenchmarks of hot kernels on synthetic reads of several lengths.
+Results are compared with bench/baseline.json by bench/compare.py.
+*/
+
+namespace
+{
+    const size_t NUM_READS = 10000;
+
+    Synthetic::Settings settings(const benchmark::State& state, size_t reads = NUM_READS)
+    {
+        Synthetic::Settings result;
+        result.reads = reads;
+        result.length = state.range(0);
+        return result;
+    }
+
+    // sequences terminated by newline, as records keep them
+    std::vector<std::string> sequences(const benchmark::State& state)
+    {
+        std::vector<std::string> seqs = Synthetic::sequences(settings(state));
+        for (auto& seq: seqs)
+            seq += '\n';
+        return seqs;
+    }
+
+    template<class T>
+    std::string records(const benchmark::State& state)
+    {
+        if constexpr (T::LINES_PER_RECORD == 4)
+            return Synthetic::fastq(settings(state));
+        else
+            return Synthetic::fasta(settings(state));
+    }
+
+    template<class T>
+    std::vector<T> parse(std::string& data)
+    {
+        std::vector<T> objs;
+        char* pos = data.data();
+        char* end = pos + data.size();
+        T obj;
+        for (std::streamsize size; (size = obj.read_new(pos, end)) > 0; pos += size)
+            objs.push_back(obj);
+        return objs;
+    }
+
+    void set_counters(benchmark::State& state, size_t items, size_t bytes)
+    {
+        state.SetItemsProcessed(state.iterations() * items);
+        if (bytes > 0)
+            state.SetBytesProcessed(state.iterations() * bytes);
+    }
+}
+
+template<class T>
+void BM_ReadNew(benchmark::State& state)
+{
+    std::string data = records<T>(state);
+    size_t count = 0;
+    for (auto _: state)
+    {
+        char* pos = data.data();
+        char* end = pos + data.size();
+        T obj;
+        count = 0;
+        for (std::streamsize size; (size = obj.read_new(pos, end)) > 0; pos += size)
+            count++;
+        benchmark::DoNotOptimize(count);
+    }
+    set_counters(state, count, data.size());
+}
+BENCHMARK_TEMPLATE(BM_ReadNew, FastqView)->Arg(50)->Arg(150)->Arg(300);
+BENCHMARK_TEMPLATE(BM_ReadNew, FastaView)->Arg(50)->Arg(150)->Arg(300);
+
+// comparisons of neighbouring records, as made by sorting and merging
+void BM_FastqCmp(benchmark::State& state)
+{
+    std::string data = Synthetic::fastq(settings(state));
+    std::vector<FastqView> objs = parse<FastqView>(data);
+    std::sort(objs.begin(), objs.end());
+    for (auto _: state)
+    {
+        int sum = 0;
+        for (size_t i = 1; i < objs.size(); ++i)
+            sum += objs[i].cmp(objs[i - 1]);
+        benchmark::DoNotOptimize(sum);
+    }
+    set_counters(state, objs.size() - 1, 0);
+}
+BENCHMARK(BM_FastqCmp)->Arg(50)->Arg(150)->Arg(300);
+
+void BM_Seq2Hash(benchmark::State& state)
+{
+    std::vector<std::string> seqs = sequences(state);
+    std::vector<uint64_t> hash;
+    for (auto _: state)
+    {
+        for (auto& seq: seqs)
+        {
+            SeqUtils::seq2hash(hash, seq.data(), seq.size() - 1);
+            benchmark::DoNotOptimize(hash.data());
+        }
+    }
+    set_counters(state, seqs.size(), 0);
+}
+BENCHMARK(BM_Seq2Hash)->Arg(50)->Arg(150)->Arg(300);
+
+void BM_HammingDistance(benchmark::State& state)
+{
+    std::vector<std::string> seqs = sequences(state);
+    for (auto _: state)
+    {
+        uint sum = 0;
+        for (size_t i = 1; i < seqs.size(); ++i)
+            sum += SeqUtils::hammingDistance(seqs[i].data(), seqs[i - 1].data(), seqs[i].size() - 1);
+        benchmark::DoNotOptimize(sum);
+    }
+    set_counters(state, seqs.size() - 1, 0);
+}
+BENCHMARK(BM_HammingDistance)->Arg(50)->Arg(150)->Arg(300);
+
+// building of hash set keys, as done for every read in 'fast' streaming mode
+void BM_SetRecordHash(benchmark::State& state)
+{
+    std::vector<std::string> seqs = sequences(state);
+    setRecordHash hasher;
+    for (auto _: state)
+    {
+        size_t sum = 0;
+        for (auto& seq: seqs)
+            sum += hasher(setRecord(seq.data(), seq.size() - 1));
+        benchmark::DoNotOptimize(sum);
+    }
+    set_counters(state, seqs.size(), 0);
+}
+BENCHMARK(BM_SetRecordHash)->Arg(50)->Arg(150)->Arg(300);
+
+// insertion of encoded reads into an arena-backed set, as done for every read in 'fast' mode
+void BM_KeySetInsert(benchmark::State& state)
+{
+    std::vector<std::string> seqs = sequences(state);
+    std::vector<uint64_t> keys;
+    std::vector<size_t> offsets(1, 0);
+    for (auto& seq: seqs)
+    {
+        keys.push_back(seq.size() - 1);
+        SeqUtils::seq2hash(keys, seq.data(), seq.size() - 1);
+        offsets.push_back(keys.size());
+    }
+    for (auto _: state)
+    {
+        KeySet records;
+        for (size_t i = 0; i < seqs.size(); ++i)
+            records.insert(keys.data() + offsets[i], offsets[i + 1] - offsets[i]);
+        benchmark::DoNotOptimize(records.size());
+    }
+    set_counters(state, seqs.size(), 0);
+}
+BENCHMARK(BM_KeySetInsert)->Arg(50)->Arg(150)->Arg(300);
+
+// deduplication pass over sorted sequences, as made by sequence-based modes
+void BM_Comparator(benchmark::State& state, ComparatorType ctype)
+{
+    std::vector<std::string> seqs = sequences(state);
+    std::sort(seqs.begin(), seqs.end());
+    std::unique_ptr<BaseComparator> comp(makeComparator(ctype, false, 2));
+    for (auto _: state)
+    {
+        size_t dups = 0;
+        comp->set_seq(seqs[0].data(), seqs[0].size());
+        for (size_t i = 1; i < seqs.size(); ++i)
+        {
+            if (comp->compare(seqs[i].data(), seqs[i].size()))
+                dups++;
+            else
+                comp->set_seq(seqs[i].data(), seqs[i].size());
+        }
+        benchmark::DoNotOptimize(dups);
+    }
+    set_counters(state, seqs.size() - 1, 0);
+}
+BENCHMARK_CAPTURE(BM_Comparator, tight, ComparatorType::CT_TIGHT)->Arg(50)->Arg(150)->Arg(300);
+BENCHMARK_CAPTURE(BM_Comparator, loose, ComparatorType::CT_LOOSE)->Arg(50)->Arg(150)->Arg(300);
+BENCHMARK_CAPTURE(BM_Comparator, hamming, ComparatorType::CT_HAMMING)->Arg(50)->Arg(150)->Arg(300);
+
+// sequential reading of a file (from page cache) with buffers of given size in megabytes
+void BM_BufferedInputRefresh(benchmark::State& state)
+{
+    Synthetic::Settings data_settings;
+    data_settings.reads = 100000;
+    std::string data = Synthetic::fastq(data_settings);
+    std::string filename = (std::filesystem::temp_directory_path() / "fastq-dupaway-bench.fq").string();
+    {
+        std::ofstream output(filename, std::ios_base::binary);
+        output.write(data.data(), data.size());
+    }
+    size_t count = 0;
+    for (auto _: state)
+    {
+        BufferedInput<FastqView> buffer(state.range(0) * constants::ONE_MB);
+        buffer.set_file(filename.c_str());
+        count = 0;
+        while (!buffer.eof())
+        {
+            while (!buffer.block_end())
+            {
+                benchmark::DoNotOptimize(buffer.next());
+                count++;
+            }
+            buffer.refresh();
+        }
+    }
+    std::remove(filename.c_str());
+    set_counters(state, count, data.size());
+}
+BENCHMARK(BM_BufferedInputRefresh)->Arg(1)->Arg(16);
+
+BENCHMARK_MAIN();
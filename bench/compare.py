@@ -0,0 +1,61 @@
+#!/usr/bin/env python3
+"""Compares CPU time of microbenchmarks with a baseline.
+
+Usage:
+    bench/bench_kernels --benchmark_repetitions=5 --benchmark_report_aggregates_only=true \
+        --benchmark_out=current.json --benchmark_out_format=json
+    python3 bench/compare.py bench/baseline.json current.json [--threshold 10]
+
+Exits with status 1 if any benchmark is slower than baseline by more than threshold percent.
+"""
+import argparse
+import json
+import sys
+
+
+def load(path):
+    """Returns results by benchmark name, medians of repetitions are preferred to single runs."""
+    with open(path) as f:
+        data = json.load(f)
+    results = {}
+    for bench in data["benchmarks"]:
+        if bench.get("run_type") == "aggregate":
+            if bench["aggregate_name"] == "median":
+                results[bench["run_name"]] = bench
+        else:
+            results.setdefault(bench.get("run_name", bench["name"]), bench)
+    return results
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("baseline")
+    parser.add_argument("current")
+    parser.add_argument("--threshold", type=float, default=10.0, help="allowed slowdown, percent (default 10)")
+    args = parser.parse_args()
+
+    baseline, current = load(args.baseline), load(args.current)
+    regressions = 0
+    print(f"{'Benchmark':<36}{'baseline':>14}{'current':>14}{'change':>10}")
+    for name, bench in current.items():
+        if name not in baseline:
+            print(f"{name:<36}{'-':>14}{bench['cpu_time']:>11.0f} {bench['time_unit']}{'new':>10}")
+            continue
+        old = baseline[name]
+        change = (bench["cpu_time"] / old["cpu_time"] - 1.0) * 100.0
+        mark = ""
+        if change > args.threshold:
+            mark = "  SLOWER"
+            regressions += 1
+        print(f"{name:<36}{old['cpu_time']:>11.0f} {old['time_unit']}{bench['cpu_time']:>11.0f} {bench['time_unit']}"
+              f"{change:>+9.1f}%{mark}")
+    for name in baseline.keys() - current.keys():
+        print(f"{name:<36} missing from current results")
+    if regressions:
+        print(f"{regressions} benchmark(s) are slower than baseline by more than {args.threshold}%")
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,419 @@
+#include <boost/format.hpp>
+#include <boost/program_options.hpp>
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "file_utils.hpp"
+
+/*
+Generator of synthetic datasets with controlled properties for end-to-end benchmarks.
+Reads are produced from random "molecules": a molecule is sequenced once, or, at the rate
+needed to reach requested duplication rate, several times (a duplicate cluster). Copies of
+a molecule are scattered over the output and may carry a few mismatches near the end of
+the read (near-duplicates, as targeted by 'tail-hamming' mode).
+Output files are compressed if their names end with ".gz".
+*/
+
+using std::string;
+namespace po = boost::program_options;
+
+enum class ClusterDist { FIXED, GEOMETRIC, ZIPF };
+enum class HeaderStyle { ILLUMINA, SRA, PLAIN };
+
+struct GenOptions
+{
+    string output_1, output_2;
+    bool fasta          = false;
+    size_t reads        = 100000;   // reads (pairs) to generate, unless size is set
+    size_t size         = 0;        // approximate size of uncompressed outputs in bytes
+    size_t length       = 150;
+    double length_sd    = 0.0;
+    size_t min_length   = 20, max_length = 0;
+    double dup_rate     = 0.3;      // fraction of reads which are copies of earlier reads
+    ClusterDist cluster_dist = ClusterDist::GEOMETRIC;
+    double cluster_param = 3.0;
+    double near_rate    = 0.0;      // fraction of copies with mismatches in the tail
+    uint mismatches     = 2;
+    size_t tail         = 10;
+    double n_rate       = 0.001;
+    HeaderStyle header  = HeaderStyle::ILLUMINA;
+    bool unordered      = false;
+    size_t shuffle_window = 100000;
+    double orphan_rate  = 0.0;
+    uint64_t seed       = 42;
+};
+
+class ReadGenerator
+{
+public:
+    explicit ReadGenerator(const GenOptions& opts);
+    void run();
+private:
+    struct Molecule
+    {
+        string seq_1, seq_2;
+        size_t copies;  // copies left to write
+    };
+    // molecules with pending copies, copies are picked from this pool at random
+    static const size_t POOL_SIZE = 100000;
+    // zipf cluster sizes are truncated at this value
+    static const size_t MAX_CLUSTER = 10000;
+
+    bool paired()                                   const   { return !m_opts.output_2.empty(); }
+    size_t draw_length();
+    size_t draw_cluster_size();
+    string random_seq(size_t len);
+    void mutate_tail(string& seq);
+    string header(size_t idx, int mate, size_t len) const;
+    string record(size_t idx, int mate, const string& seq);
+    size_t record_size(size_t idx, size_t len_1, size_t len_2) const;
+    void write(const string& seq_1, const string& seq_2);
+    void write_mate_2(string&& rec);
+    void finish();
+private:
+    GenOptions m_opts;
+    std::mt19937_64 m_rng;
+    std::uniform_real_distribution<double> m_coin {0.0, 1.0};
+    std::vector<double> m_zipf_cdf;
+    std::unique_ptr<FileUtils::UniversalOutputFile> m_out_1, m_out_2;
+    std::vector<string> m_window;  // records of second mates waiting to be written in random order
+    size_t m_written = 0ul, m_copies = 0ul, m_near = 0ul, m_orphans = 0ul, m_bytes = 0ul;
+};
+
+ReadGenerator::ReadGenerator(const GenOptions& opts) : m_opts(opts), m_rng(opts.seed)
+{
+    if (m_opts.max_length == 0)
+        m_opts.max_length = std::max(m_opts.min_length, m_opts.length + static_cast<size_t>(std::ceil(4 * m_opts.length_sd)));
+    if (m_opts.cluster_dist == ClusterDist::ZIPF)
+    {   // P(k) ~ k^-s for cluster sizes k >= 2
+        double total = 0.0;
+        for (size_t k = 2; k <= MAX_CLUSTER; ++k)
+            m_zipf_cdf.push_back(total += std::pow(k, -m_opts.cluster_param));
+        for (auto& value: m_zipf_cdf)
+            value /= total;
+    }
+}
+
+size_t ReadGenerator::draw_length()
+{
+    if (m_opts.length_sd <= 0.0)
+        return m_opts.length;
+    std::normal_distribution<double> dist(m_opts.length, m_opts.length_sd);
+    double value = std::round(dist(m_rng));
+    return std::clamp(static_cast<size_t>(std::max(value, 0.0)), m_opts.min_length, m_opts.max_length);
+}
+
+// Size of a duplicate cluster, at least 2
+size_t ReadGenerator::draw_cluster_size()
+{
+    switch (m_opts.cluster_dist)
+    {
+        case ClusterDist::FIXED:
+            return static_cast<size_t>(m_opts.cluster_param);
+        case ClusterDist::GEOMETRIC:
+        {   // 2 + number of failures, mean size is equal to the parameter
+            std::geometric_distribution<size_t> dist(1.0 / (m_opts.cluster_param - 1.0));
+            return 2 + dist(m_rng);
+        }
+        case ClusterDist::ZIPF:
+            return 2 + (std::lower_bound(m_zipf_cdf.begin(), m_zipf_cdf.end(), m_coin(m_rng)) - m_zipf_cdf.begin());
+    }
+    return 2;
+}
+
+string ReadGenerator::random_seq(size_t len)
+{
+    static const char bases[] = "ACGT";
+    string seq(len, 'A');
+    for (auto& base: seq)
+        base = (m_coin(m_rng) < m_opts.n_rate) ? 'N' : bases[m_rng() % 4];
+    return seq;
+}
+
+// Substitutes bases at random positions among the last bases of a sequence
+void ReadGenerator::mutate_tail(string& seq)
+{
+    static const char bases[] = "ACGT";
+    size_t tail = std::min(m_opts.tail, seq.size());
+    for (uint i = 0; (i < m_opts.mismatches) && (tail > 0); ++i)
+    {
+        char& base = seq[seq.size() - 1 - m_rng() % tail];
+        const char* pos = std::find(bases, bases + 4, base);
+        base = bases[((pos - bases) + 1 + m_rng() % 3) % 4];
+    }
+}
+
+// Both mates share the ID tag (as parsed by FastqViewWithId), so pairs can be matched in unordered mode
+string ReadGenerator::header(size_t idx, int mate, size_t len) const
+{
+    char start = m_opts.fasta ? '>' : '@';
+    switch (m_opts.header)
+    {
+        case HeaderStyle::ILLUMINA:
+            return (boost::format("%1%SIM:1:FCX:1:%2%:%3%:%4% %5%:N:0:ATCACG")
+                    % start % (1101 + idx / 100000000) % (idx / 10000 % 10000) % (idx % 10000) % mate).str();
+        case HeaderStyle::SRA:
+            return (boost::format("%1%SRR000001.%2% %2% length=%3%") % start % (idx + 1) % len).str();
+        case HeaderStyle::PLAIN:
+            return (boost::format("%1%read%2%") % start % (idx + 1)).str();
+    }
+    return string();
+}
+
+string ReadGenerator::record(size_t idx, int mate, const string& seq)
+{
+    string rec = this->header(idx, mate, seq.size());
+    rec += '\n';
+    rec += seq;
+    rec += '\n';
+    if (!m_opts.fasta)
+    {
+        rec += "+\n";
+        for (size_t i = 0; i < seq.size(); ++i)
+            rec += static_cast<char>('#' + m_rng() % 39);
+        rec += '\n';
+    }
+    return rec;
+}
+
+size_t ReadGenerator::record_size(size_t idx, size_t len_1, size_t len_2) const
+{
+    size_t lines = m_opts.fasta ? 1 : 2;
+    size_t size = this->header(idx, 1, len_1).size() + 1 + lines * (len_1 + 1) + (m_opts.fasta ? 0 : 2);
+    if (this->paired())
+        size += this->header(idx, 2, len_2).size() + 1 + lines * (len_2 + 1) + (m_opts.fasta ? 0 : 2);
+    return size;
+}
+
+void ReadGenerator::write(const string& seq_1, const string& seq_2)
+{
+    size_t idx = m_written++;
+    bool orphan = this->paired() && m_opts.unordered && (m_coin(m_rng) < m_opts.orphan_rate);
+    int dropped = orphan ? 1 + m_rng() % 2 : 0;
+    m_orphans += orphan;
+    if (dropped != 1)
+    {
+        string rec = this->record(idx, 1, seq_1);
+        m_out_1->write(rec.data(), rec.size());
+        m_bytes += rec.size();
+    }
+    if (this->paired() && (dropped != 2))
+    {
+        string rec = this->record(idx, 2, seq_2);
+        m_bytes += rec.size();
+        if (m_opts.unordered)
+            this->write_mate_2(std::move(rec));
+        else
+            m_out_2->write(rec.data(), rec.size());
+    }
+}
+
+// Second mates of unordered pairs are shuffled within a window of records
+void ReadGenerator::write_mate_2(string&& rec)
+{
+    m_window.push_back(std::move(rec));
+    if (m_window.size() <= m_opts.shuffle_window)
+        return;
+    std::swap(m_window[m_rng() % m_window.size()], m_window.back());
+    m_out_2->write(m_window.back().data(), m_window.back().size());
+    m_window.pop_back();
+}
+
+void ReadGenerator::finish()
+{
+    std::shuffle(m_window.begin(), m_window.end(), m_rng);
+    for (auto& rec: m_window)
+        m_out_2->write(rec.data(), rec.size());
+    m_window.clear();
+    m_out_1.reset();
+    m_out_2.reset();
+}
+
+void ReadGenerator::run()
+{
+    m_out_1.reset(new FileUtils::UniversalOutputFile(m_opts.output_1.c_str()));
+    if (this->paired())
+        m_out_2.reset(new FileUtils::UniversalOutputFile(m_opts.output_2.c_str()));
+
+    std::vector<Molecule> pool;
+    // reads and bytes of molecules created so far, including copies not written yet
+    size_t planned_reads = 0ul, planned_copies = 0ul, planned_bytes = 0ul;
+    while (true)
+    {
+        bool create = m_opts.size ? (planned_bytes < m_opts.size) : (planned_reads < m_opts.reads);
+        if (!create && pool.empty())
+            break;
+        bool from_pool = !pool.empty() && (!create || (pool.size() >= POOL_SIZE) || (m_coin(m_rng) < 0.5));
+        if (from_pool)
+        {
+            size_t idx = m_rng() % pool.size();
+            Molecule& mol = pool[idx];
+            if (m_coin(m_rng) < m_opts.near_rate)
+            {
+                string seq_1 = mol.seq_1, seq_2 = mol.seq_2;
+                this->mutate_tail(seq_1);
+                this->mutate_tail(seq_2);
+                this->write(seq_1, seq_2);
+                m_near++;
+            }
+            else
+                this->write(mol.seq_1, mol.seq_2);
+            m_copies++;
+            if (--mol.copies == 0)
+            {
+                std::swap(mol, pool.back());
+                pool.pop_back();
+            }
+            continue;
+        }
+        Molecule mol;
+        mol.seq_1 = this->random_seq(this->draw_length());
+        if (this->paired())
+            mol.seq_2 = this->random_seq(this->draw_length());
+        // clusters are created whenever duplication rate falls behind the requested one
+        size_t size = (planned_copies < m_opts.dup_rate * planned_reads) ? this->draw_cluster_size() : 1;
+        planned_reads += size;
+        planned_copies += size - 1;
+        planned_bytes += size * this->record_size(planned_reads, mol.seq_1.size(), mol.seq_2.size());
+        this->write(mol.seq_1, mol.seq_2);
+        mol.copies = size - 1;
+        if (mol.copies)
+            pool.push_back(std::move(mol));
+    }
+    this->finish();
+
+    std::cout << boost::format("%1% %2% (%3% MB) were written, %4% (%5$.1f%%) are copies of earlier ones, %6% of copies are near-duplicates.\n")
+        % m_written % (this->paired() ? "pairs" : "reads") % (m_bytes / (1024 * 1024))
+        % m_copies % (m_written ? 100.0 * m_copies / m_written : 0.0) % m_near;
+    if (m_orphans)
+        std::cout << m_orphans << " pairs have only one mate written.\n";
+}
+
+// Parses size with optional K, M or G suffix
+size_t parse_size(const string& value)
+{
+    size_t pos = 0;
+    double number = std::stod(value, &pos);
+    string suffix = value.substr(pos);
+    double multiplier = 1.0;
+    if ((suffix == "K") || (suffix == "k"))
+        multiplier = 1024.0;
+    else if ((suffix == "M") || (suffix == "m"))
+        multiplier = 1024.0 * 1024.0;
+    else if ((suffix == "G") || (suffix == "g"))
+        multiplier = 1024.0 * 1024.0 * 1024.0;
+    else if (!suffix.empty())
+        throw std::runtime_error("Size should be a number with optional K, M or G suffix!");
+    return static_cast<size_t>(number * multiplier);
+}
+
+bool parse_args(int argc, char** argv, GenOptions& opts)
+{
+    po::options_description desc ("Generates synthetic reads for benchmarks. Supported options");
+    desc.add_options()
+    ("help,h", "Produce help message and exit")
+    ("output-1,o", po::value<string>(&opts.output_1), "First output file (required), compressed if its name ends with .gz")
+    ("output-2,p", po::value<string>(&opts.output_2), "Second output file (optional, enables paired-end output)")
+    ("format", po::value<string>(), "Output format: fastq (default) or fasta.")
+    ("reads,n", po::value<size_t>(&opts.reads), "Number of reads (pairs) to generate (default 100000).")
+    ("size,s", po::value<string>(), "Approximate total size of uncompressed outputs, e.g. 500M or 2G (overrides --reads).")
+    ("length", po::value<size_t>(&opts.length), "Mean read length (default 150).")
+    ("length-sd", po::value<double>(&opts.length_sd), "Standard deviation of read length (default 0: all reads have the same length).")
+    ("min-length", po::value<size_t>(&opts.min_length), "Minimal read length (default 20).")
+    ("max-length", po::value<size_t>(&opts.max_length), "Maximal read length (default: mean + 4 standard deviations).")
+    ("dup-rate", po::value<double>(&opts.dup_rate), "Fraction of reads that are copies of earlier reads (default 0.3).")
+    ("cluster-dist", po::value<string>(), "Distribution of sizes of duplicate clusters: fixed, geometric (default) or zipf.")
+    ("cluster-param", po::value<double>(&opts.cluster_param), "Size of clusters for 'fixed', mean size for 'geometric' (default 3),"
+                                                              " exponent for 'zipf' distribution.")
+    ("near-rate", po::value<double>(&opts.near_rate), "Fraction of copies which have mismatches near the end of reads (default 0).")
+    ("mismatches", po::value<uint>(&opts.mismatches), "Number of mismatches of near-duplicates (default 2).")
+    ("tail", po::value<size_t>(&opts.tail), "Mismatches of near-duplicates are placed among this number of last bases (default 10).")
+    ("n-rate", po::value<double>(&opts.n_rate), "Fraction of N bases (default 0.001).")
+    ("header", po::value<string>(), "Style of read headers: illumina (default), sra (@SRR000001.N, as parsed by read ID tags) or plain.")
+    ("unordered", po::bool_switch(&opts.unordered), "Write pairs of the second output in random order (within --shuffle-window records).")
+    ("shuffle-window", po::value<size_t>(&opts.shuffle_window), "Number of records the second output is shuffled within (default 100000).")
+    ("orphan-rate", po::value<double>(&opts.orphan_rate), "Fraction of unordered pairs with one of the mates missing (default 0).")
+    ("seed", po::value<uint64_t>(&opts.seed), "Seed of random number generator (default 42).")
+    ;
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    if (vm.count("help"))
+    {
+        std::cerr << desc << "\n";
+        return false;
+    }
+    po::notify(vm);
+
+    if (opts.output_1.empty())
+        throw std::runtime_error("output-1 argument is required!");
+    if (vm.count("format"))
+    {
+        string value = vm["format"].as<string>();
+        if (value == "fasta")
+            opts.fasta = true;
+        else if (value != "fastq")
+            throw std::runtime_error("Only \"fastq\" or \"fasta\" file formats are supported!");
+    }
+    if (vm.count("size"))
+        opts.size = parse_size(vm["size"].as<string>());
+    if (vm.count("cluster-dist"))
+    {
+        string value = vm["cluster-dist"].as<string>();
+        if (value == "fixed")
+            opts.cluster_dist = ClusterDist::FIXED;
+        else if (value == "geometric")
+            opts.cluster_dist = ClusterDist::GEOMETRIC;
+        else if (value == "zipf")
+            opts.cluster_dist = ClusterDist::ZIPF;
+        else
+            throw std::runtime_error("Unsupported cluster-dist type provided!");
+    }
+    if (vm.count("header"))
+    {
+        string value = vm["header"].as<string>();
+        if (value == "illumina")
+            opts.header = HeaderStyle::ILLUMINA;
+        else if (value == "sra")
+            opts.header = HeaderStyle::SRA;
+        else if (value == "plain")
+            opts.header = HeaderStyle::PLAIN;
+        else
+            throw std::runtime_error("Unsupported header style provided!");
+    }
+    if ((opts.dup_rate < 0.0) || (opts.dup_rate >= 1.0) || (opts.near_rate < 0.0) || (opts.near_rate > 1.0)
+        || (opts.n_rate < 0.0) || (opts.n_rate > 1.0) || (opts.orphan_rate < 0.0) || (opts.orphan_rate > 1.0))
+        throw std::runtime_error("Rates should be within [0, 1) for --dup-rate and [0, 1] for other options!");
+    if ((opts.cluster_dist == ClusterDist::FIXED) && (opts.cluster_param < 2.0))
+        throw std::runtime_error("Fixed cluster size should be at least 2!");
+    if ((opts.cluster_dist == ClusterDist::GEOMETRIC) && (opts.cluster_param <= 2.0))
+        throw std::runtime_error("Mean size of geometric clusters should be greater than 2!");
+    if ((opts.cluster_dist == ClusterDist::ZIPF) && (opts.cluster_param <= 1.0))
+        throw std::runtime_error("Exponent of zipf distribution should be greater than 1!");
+    if ((opts.length == 0) || (opts.min_length == 0) || (opts.max_length && (opts.max_length < opts.min_length)))
+        throw std::runtime_error("Read lengths should be positive and max-length should not be less than min-length!");
+    if ((opts.unordered || (opts.orphan_rate > 0.0)) && opts.output_2.empty())
+        throw std::runtime_error("--unordered and --orphan-rate arguments can only be used with paired-end output!");
+    if ((opts.orphan_rate > 0.0) && !opts.unordered)
+        throw std::runtime_error("--orphan-rate argument can only be used with --unordered output!");
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    try {
+        GenOptions opts;
+        if (!parse_args(argc, argv, opts))
+            return 1;
+        ReadGenerator(opts).run();
+    } catch (const std::exception& exc) {
+        std::cerr << "An error occured during generation of reads:\n";
+        std::cerr << exc.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
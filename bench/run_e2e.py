@@ -0,0 +1,134 @@
+#!/usr/bin/env python3
+"""End-to-end throughput benchmark of fastq-dupaway.
+
+Generates synthetic datasets with bench/generate_reads (built by `make generator`), runs every
+combination of input layout (single-end, paired-end, unordered paired-end), format (fastq, fasta)
+and deduplication mode under each memory limit, and reports wall time, throughput and peak memory
+taken from --stats-json output of every run.
+
+Usage:
+    python3 bench/run_e2e.py --size 200M --mem-limits 500 2048 [--filter fast] [--json results.json]
+"""
+import argparse
+import json
+import os
+import subprocess
+import sys
+import tempfile
+
+REPO = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+# input layouts: name, number of files, generator arguments
+LAYOUTS = [
+    ("single", 1, []),
+    ("paired", 2, []),
+    ("unordered", 2, ["--unordered", "--header", "sra"]),
+]
+
+# deduplication modes: name, fastq-dupaway arguments, layouts the mode applies to
+MODES = [
+    ("tight", ["--compare-seq", "tight"], ["single", "paired"]),
+    ("loose", ["--compare-seq", "loose"], ["single", "paired"]),
+    ("tail-hamming", ["--compare-seq", "tail-hamming"], ["single", "paired"]),
+    ("fast", ["--fast"], ["single", "paired"]),
+    ("fast-unordered", ["--fast", "--unordered"], ["unordered"]),
+    ("fast-unordered-hash-join", ["--fast", "--unordered", "--hash-join"], ["unordered"]),
+]
+
+
+def generate(args, workdir, layout, fmt):
+    name, num_files, extra = layout
+    ext = "fq" if fmt == "fastq" else "fa"
+    files = [os.path.join(workdir, f"{name}_{i + 1}.{ext}") for i in range(num_files)]
+    if all(os.path.exists(f) for f in files) and not args.regenerate:
+        return files
+    cmd = [args.generator, "-o", files[0], "--format", fmt, "--size", args.size, "--seed", str(args.seed),
+           "--dup-rate", str(args.dup_rate), "--near-rate", str(args.near_rate), "--length-sd", str(args.length_sd)]
+    if num_files == 2:
+        cmd += ["-p", files[1]]
+    subprocess.run(cmd + extra, check=True, stdout=subprocess.DEVNULL)
+    return files
+
+
+def run(args, workdir, inputs, fmt, mode_args, mem_limit):
+    outputs = [os.path.join(workdir, f"out_{i + 1}") for i in range(len(inputs))]
+    stats = os.path.join(workdir, "stats.json")
+    cmd = [args.binary, "-i", inputs[0], "-o", outputs[0], "--format", fmt, "-m", str(mem_limit),
+           "-t", str(args.threads), "--tmpdir", workdir, "--stats-json", stats] + mode_args
+    if len(inputs) == 2:
+        cmd += ["-u", inputs[1], "-p", outputs[1]]
+    subprocess.run(cmd, check=True, stdout=subprocess.DEVNULL)
+    with open(stats) as f:
+        result = json.load(f)
+    for path in outputs + [stats]:
+        os.remove(path)
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--binary", default=os.path.join(REPO, "fastq-dupaway"))
+    parser.add_argument("--generator", default=os.path.join(REPO, "bench", "generate_reads"))
+    parser.add_argument("--workdir", help="directory for datasets and temporary files (default: new temporary directory)")
+    parser.add_argument("--size", default="200M", help="size of every dataset (all files of a layout), e.g. 200M or 2G")
+    parser.add_argument("--mem-limits", type=int, nargs="+", default=[500, 2048], help="values of --mem-limit, megabytes")
+    parser.add_argument("--threads", type=int, default=1)
+    parser.add_argument("--formats", nargs="+", default=["fastq", "fasta"], choices=["fastq", "fasta"])
+    parser.add_argument("--filter", help="only run combinations whose name contains this substring")
+    parser.add_argument("--dup-rate", type=float, default=0.3)
+    parser.add_argument("--near-rate", type=float, default=0.1)
+    parser.add_argument("--length-sd", type=float, default=0.0)
+    parser.add_argument("--seed", type=int, default=42)
+    parser.add_argument("--regenerate", action="store_true", help="regenerate datasets existing in workdir")
+    parser.add_argument("--json", help="save results to a JSON file")
+    args = parser.parse_args()
+
+    for path in (args.binary, args.generator):
+        if not os.access(path, os.X_OK):
+            sys.exit(f"{path} is not found, build it first (make, make generator)")
+    workdir = args.workdir or tempfile.mkdtemp(prefix="dupaway_e2e_")
+    os.makedirs(workdir, exist_ok=True)
+
+    results = []
+    print(f"{'Combination':<44}{'mem, MB':>8}{'wall, s':>9}{'MB/s':>9}{'reads/s':>11}{'peak RSS, MB':>14}")
+    for fmt in args.formats:
+        for layout in LAYOUTS:
+            combos = [(mode, mode_args) for mode, mode_args, layouts in MODES if layout[0] in layouts]
+            combos = [(mode, mode_args) for mode, mode_args in combos
+                      if not args.filter or args.filter in f"{fmt}/{layout[0]}/{mode}"]
+            if not combos:
+                continue
+            inputs = generate(args, workdir, layout, fmt)
+            input_bytes = sum(os.path.getsize(f) for f in inputs)
+            lines_per_record = 4 if fmt == "fastq" else 2
+            with open(inputs[0], "rb") as f:
+                records = sum(1 for _ in f) // lines_per_record
+            for mode, mode_args in combos:
+                for mem_limit in args.mem_limits:
+                    stats = run(args, workdir, inputs, fmt, mode_args, mem_limit)
+                    wall = stats["wall_seconds"]
+                    result = {
+                        "name": f"{fmt}/{layout[0]}/{mode}",
+                        "mem_limit_mb": mem_limit,
+                        "input_bytes": input_bytes,
+                        "records": records,
+                        "wall_seconds": wall,
+                        "cpu_seconds": stats["user_seconds"] + stats["system_seconds"],
+                        "mb_per_second": input_bytes / 2**20 / wall if wall else 0.0,
+                        "records_per_second": records / wall if wall else 0.0,
+                        "peak_rss_bytes": stats["peak_rss_bytes"],
+                        "temp_written_bytes": stats["bytes"]["temp_written"],
+                    }
+                    results.append(result)
+                    print(f"{result['name']:<44}{mem_limit:>8}{wall:>9.2f}{result['mb_per_second']:>9.1f}"
+                          f"{result['records_per_second']:>11.0f}{result['peak_rss_bytes'] / 2**20:>14.1f}", flush=True)
+
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump({"size": args.size, "threads": args.threads, "results": results}, f, indent=2)
+    if not args.workdir:
+        subprocess.run(["rm", "-rf", workdir], check=True)
+
+
+if __name__ == "__main__":
+    main()
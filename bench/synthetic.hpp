@@ -0,0 +1,80 @@
+#pragma once
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+/*
+Deterministic synthetic reads for benchmarks: Illumina-like ids, random bases with rare Ns,
+Phred+33 qualities, and a share of exact duplicates and near-duplicates (reads that differ
+from an earlier read by a few mismatches near the end), as found in real libraries.
+*/
+namespace Synthetic
+{
+    struct Settings
+    {
+        size_t reads = 10000;
+        size_t length = 150;
+        double dup_fraction = 0.3;      // exact copies of earlier reads
+        double near_fraction = 0.1;     // earlier reads with mismatches in the tail
+        uint64_t seed = 42;
+    };
+
+    inline std::vector<std::string> sequences(const Settings& settings)
+    {
+        const char bases[] = "ACGT";
+        std::mt19937_64 rng(settings.seed);
+        std::uniform_real_distribution<double> coin(0.0, 1.0);
+        std::vector<std::string> seqs;
+        seqs.reserve(settings.reads);
+        for (size_t i = 0; i < settings.reads; ++i)
+        {
+            double kind = coin(rng);
+            if (!seqs.empty() && (kind < settings.dup_fraction))
+            {
+                seqs.push_back(seqs[rng() % seqs.size()]);
+                continue;
+            }
+            if (!seqs.empty() && (kind < settings.dup_fraction + settings.near_fraction))
+            {
+                std::string seq = seqs[rng() % seqs.size()];
+                for (int m = 0; m < 2; ++m)
+                    seq[seq.size() - 1 - rng() % 10] = bases[rng() % 4];
+                seqs.push_back(std::move(seq));
+                continue;
+            }
+            std::string seq(settings.length, 'A');
+            for (auto& base: seq)
+                base = (rng() % 1000 == 0) ? 'N' : bases[rng() % 4];
+            seqs.push_back(std::move(seq));
+        }
+        return seqs;
+    }
+
+    inline std::string fastq(const Settings& settings)
+    {
+        std::mt19937_64 rng(settings.seed + 1);
+        std::string data;
+        size_t idx = 0;
+        for (auto& seq: sequences(settings))
+        {
+            data += "@SIM:1:FCX:1:" + std::to_string(1101 + idx / 100000) + ":" + std::to_string(idx % 30000)
+                    + ":" + std::to_string(rng() % 30000) + " 1:N:0:ATCACG\n";
+            data += seq + "\n+\n";
+            for (size_t i = 0; i < seq.size(); ++i)
+                data += static_cast<char>('#' + rng() % 40);
+            data += '\n';
+            idx++;
+        }
+        return data;
+    }
+
+    inline std::string fasta(const Settings& settings)
+    {
+        std::string data;
+        size_t idx = 0;
+        for (auto& seq: sequences(settings))
+            data += ">read_" + std::to_string(idx++) + "\n" + seq + "\n";
+        return data;
+    }
+}
@@ -0,0 +1,111 @@
+#include "buffer_pool.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+#include "memory_budget.hpp"
+
+BufferPool& BufferPool::instance()
+{
+    static BufferPool pool;
+    return pool;
+}
+
+// budget is constructed first, so that it outlives the pool
+BufferPool::BufferPool()
+{
+    MemoryBudget::instance().set_reclaimer([]() { BufferPool::instance().drop_idle(); });
+}
+
+BufferPool::~BufferPool()
+{
+    MemoryBudget::instance().set_reclaimer(nullptr);
+    this->set_capacity(0);
+}
+
+void BufferPool::set_capacity(size_t capacity)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_capacity = capacity;
+    this->drop_idle(m_capacity);
+}
+
+void BufferPool::set_max_buffer(size_t size)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_max_buffer = size;
+}
+
+size_t BufferPool::max_buffer()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_max_buffer;
+}
+
+void BufferPool::drop_idle()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    this->drop_idle(0);
+}
+
+// Frees largest idle buffers until their total size does not exceed the given one, mutex should be locked
+void BufferPool::drop_idle(size_t max_idle_size)
+{
+    while ((m_idle_size > max_idle_size) && !m_idle.empty())
+    {
+        auto it = std::prev(m_idle.end());
+        m_idle_size -= it->first;
+        free(it->second);
+        MemoryBudget::instance().release(it->first);
+        m_idle.erase(it);
+    }
+}
+
+// Returns an idle buffer of exactly the requested size if there is one, allocates a new buffer otherwise.
+// Size of a new buffer is reduced (down to minimum) if memory budget does not allow the requested one.
+char* BufferPool::acquire(size_t& size, size_t minimum)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        size = std::min(size, m_max_buffer);
+        minimum = std::min(minimum, size);
+        auto it = m_idle.find(size);
+        if (it != m_idle.end())
+        {
+            char* buffer = it->second;
+            m_idle_size -= size;
+            m_idle.erase(it);
+            return buffer;
+        }
+        // idle buffers of other sizes give way to the new one
+        if (MemoryBudget::instance().available() < size)
+            this->drop_idle(0);
+    }
+    size = MemoryBudget::instance().acquire(size, minimum);
+    char* buffer = static_cast<char*>(malloc(size));
+    if (buffer == nullptr)
+    {
+        MemoryBudget::instance().release(size);
+        throw std::bad_alloc();
+    }
+    return buffer;
+}
+
+// Keeps buffer for reuse if pool capacity allows it, frees it and returns its memory to the budget otherwise
+void BufferPool::release(char* buffer, size_t size)
+{
+    if (buffer == nullptr)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_idle_size + size <= m_capacity)
+        {
+            m_idle.emplace(size, buffer);
+            m_idle_size += size;
+            return;
+        }
+    }
+    free(buffer);
+    MemoryBudget::instance().release(size);
+}
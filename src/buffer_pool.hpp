@@ -0,0 +1,36 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+
+/*
+Cache of released input buffers.
+Pooling is disabled by default; in batch mode many short-lived BufferedInput objects of the same size
+are created one after another, and reusing their buffers saves mapping and faulting in fresh memory for every sample.
+Memory of new buffers is drawn from MemoryBudget, idle buffers keep their share of the budget
+until any request of the budget can not be granted otherwise.
+*/
+class BufferPool
+{
+public:
+    static BufferPool& instance();
+    // maximum total size of idle buffers kept for reuse, 0 disables pooling
+    void set_capacity(size_t);
+    // upper bound of buffer size, tests lower it to split small inputs into many blocks
+    void set_max_buffer(size_t);
+    size_t max_buffer();
+    char* acquire(size_t&, size_t);
+    void release(char*, size_t);
+    // frees all idle buffers
+    void drop_idle();
+    ~BufferPool();
+private:
+    BufferPool();
+    void drop_idle(size_t);
+private:
+    std::mutex m_mutex;
+    std::multimap<size_t, char*> m_idle;
+    size_t m_capacity = 0, m_idle_size = 0;
+    size_t m_max_buffer = SIZE_MAX;
+};
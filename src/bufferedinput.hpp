@@ -1,7 +1,16 @@
 #pragma once
+#include <cstdint>
 #include <fstream>
+#include <memory>
+#include <queue>
+#include <vector>
+#include "buffer_pool.hpp"
 #include "constants.hpp"
 #include "file_utils.hpp"
+#include "line_index.hpp"
+#include "parallel_parse.hpp"
+#include "record_index.hpp"
+#include "run_stats.hpp"
 
 using FileUtils::I_InputFile;
 
@@ -10,34 +19,77 @@ class BufferedInput
 {
 public:
     BufferedInput(std::streamsize);
-    ~BufferedInput()                    { free(m_buffer); this->unset_file(); }
+    ~BufferedInput()                    { BufferPool::instance().release(m_buffer, m_maxsize); this->unset_file(); }
     bool eof()                          { return m_infile->eof() && m_block_end; }
     bool block_end()                    { return m_block_end; }
     void set_file(const char* infilename);
+    // part of an indexed input file
+    void set_range(const char* infilename, const RecordIndex::Range&);
     void unset_file();
     void refresh();
     T next();
+    void unread(T&&);
+    void next_block(std::vector<T>&, uint, size_t max_records = SIZE_MAX);
+    // low-latency input: refresh returns as soon as min_records complete records (or the whole input) are available,
+    // rather than once buffer is full; 0 turns it off
+    void set_partial(uint min_records)  { m_min_records = min_records; }
+    // size of buffer, may be less than requested if memory budget did not allow it
+    inline std::streamsize capacity()   const   { return m_maxsize; }
+    // number of (decompressed) bytes read from current file so far
+    inline uint64_t bytes_read()        const   { return m_bytes_read; }
 
+private:
+    std::streamsize fill(char* dst, std::streamsize n);
+    bool has_records(uint) const;
+    // (decompressed) offset of a record of buffer in input file
+    inline uint64_t offset(const T& obj) const  { return m_base + m_bytes_read - m_cursize + (obj.start() - m_buffer); }
+    std::vector<char*> indexed_starts(char*, char*) const;
+    void index_record(const T&);
 private:
     T m_curobj;
+    RecordReader<T> m_reader;
     std::streamsize m_maxsize, m_cursize, m_curpos = 0;
+    uint64_t m_bytes_read = 0ul;
+    uint64_t m_base = 0ul;  // offset of input range in file
     I_InputFile* m_infile = nullptr;
+    // index of input file, either loaded or being built from records read
+    std::shared_ptr<const RecordIndex> m_index;
+    std::shared_ptr<RecordIndex::Builder> m_builder;
+    RunStats::Counter m_read_counter = RunStats::INPUT_READ;
     char* m_buffer = nullptr;
     bool m_block_end = false;
+    uint m_min_records = 0;
 };
 
+// Buffer is drawn from memory budget and gets smaller (down to 1 Mb) if the requested size is not available
 template <class T>
 BufferedInput<T>::BufferedInput(std::streamsize size)
 {
-    m_maxsize = size;
-    m_cursize = size;
-    m_buffer = (char*)malloc(sizeof(char) * size);
+    size_t granted = size;
+    m_buffer = BufferPool::instance().acquire(granted, std::min(granted, static_cast<size_t>(constants::ONE_MB)));
+    m_maxsize = granted;
+    m_cursize = granted;
 }
 
 template <class T>
 void BufferedInput<T>::set_file(const char* infilename)
 {
     m_infile = FileUtils::openInputFile(infilename);
+    bool temp = RunStats::instance().enabled() && RunStats::instance().is_temp(infilename);
+    m_read_counter = temp ? RunStats::TEMP_READ : RunStats::INPUT_READ;
+    m_index = RecordIndex::find(infilename);
+    m_builder = RecordIndex::claim(infilename);
+    this->refresh();
+}
+
+// Reads given range of input file, its records are split between threads by offsets of input index
+template <class T>
+void BufferedInput<T>::set_range(const char* infilename, const RecordIndex::Range& range)
+{
+    m_infile = FileUtils::openInputRange(infilename, range.seek, range.bytes);
+    m_read_counter = RunStats::INPUT_READ;
+    m_base = range.offset;
+    m_index = RecordIndex::find(infilename);
     this->refresh();
 }
 
@@ -49,50 +101,94 @@ void BufferedInput<T>::unset_file()
         delete m_infile;
         m_infile = nullptr;
     }
+    if (m_builder)
+        m_builder->release();
+    m_builder.reset();
+    m_index.reset();
+    m_base = 0;
     m_block_end = false;
     m_cursize = m_maxsize;
     m_curpos = 0;
+    m_bytes_read = 0;
 }
 
 template <class T>
 void BufferedInput<T>::refresh()
 {
     if (m_infile->eof())
-    {
-        m_block_end = true;
+    {   // records left unread in the last block (if any) are still available
         return;
     }
     m_block_end = false;
+    std::streamsize num_trailing = 0;
     if (m_curpos > 0)
     {
         if (!m_curobj.isEmpty())
             m_curpos -= m_curobj.size();
-        std::streamsize num_trailing = m_cursize - m_curpos;
+        num_trailing = m_cursize - m_curpos;
         memmove(m_buffer, m_buffer+m_curpos, num_trailing);
-        //memcpy(m_buffer, m_buffer+m_curpos, num_trailing);
-        m_infile->read(m_buffer+num_trailing, m_curpos);
-        m_cursize = m_infile->gcount() + num_trailing;
-    } else {
-        m_infile->read(m_buffer, m_cursize);
-        m_cursize = m_infile->gcount();
     }
-    
+    m_cursize = num_trailing + this->fill(m_buffer+num_trailing, m_maxsize - num_trailing);
+    // a partial read may end within the first records
+    while ((m_min_records > 0) && (m_cursize < m_maxsize) && !m_infile->eof() && !this->has_records(m_min_records))
+        m_cursize += this->fill(m_buffer+m_cursize, m_maxsize - m_cursize);
+    if (m_builder && m_infile->eof())
+        m_builder->finish(m_base + m_bytes_read);
+
     m_curpos = 0;
-    std::streamsize new_size = m_curobj.read_new(m_buffer, m_buffer+m_cursize);
+    m_reader.reset(m_buffer, m_buffer+m_cursize);
+    std::streamsize new_size = m_reader.read(m_curobj);
     if (new_size < 0)
-    { // could not read object from block start -> not enough memory in buffer
+    {
+        if ((m_cursize == 0) && m_infile->eof())
+        { // empty input has no records at all
+            m_block_end = true;
+            return;
+        }
+        // could not read object from block start -> not enough memory in buffer
         throw std::runtime_error("Not enough memory to read a single object!");
     } else {
         m_curpos += new_size;
     }
 }
 
+// Reads up to n bytes of input into dst, a partial read returns whatever input has available
+template <class T>
+std::streamsize BufferedInput<T>::fill(char* dst, std::streamsize n)
+{
+    std::streamsize num_read;
+    if (m_min_records > 0)
+    {
+        num_read = m_infile->read_some(dst, n);
+    } else {
+        m_infile->read(dst, n);
+        num_read = m_infile->gcount();
+    }
+    RunStats::instance().add(m_read_counter, num_read);
+    m_bytes_read += num_read;
+    return num_read;
+}
+
+template <class T>
+bool BufferedInput<T>::has_records(uint n) const
+{
+    RecordReader<T> reader;
+    reader.reset(m_buffer, m_buffer+m_cursize);
+    T obj;
+    for (uint i = 0; i < n; ++i)
+        if (reader.read(obj) < 0)
+            return false;
+    return true;
+}
+
 template <class T>
 T BufferedInput<T>::next()
 {
     T to_return = std::move(m_curobj);
+    if (m_builder && !to_return.isEmpty())
+        this->index_record(to_return);
     //if (!m_curobj.isEmpty()) { throw std::runtime_error("object not cleared"); } // TODO remove
-    std::streamsize new_size = m_curobj.read_new(m_buffer+m_curpos, m_buffer+m_cursize);
+    std::streamsize new_size = m_reader.read(m_curobj);
     if (new_size < 0)
     { // could not read another object
         m_block_end = true;
@@ -101,3 +197,123 @@ T BufferedInput<T>::next()
     }
     return to_return;
 }
+
+// Gives back the last record returned by next(): it is returned by next() again, and kept by refresh
+template <class T>
+void BufferedInput<T>::unread(T&& obj)
+{
+    m_curpos = (obj.start() - m_buffer) + obj.size();
+    m_reader.reset(m_buffer + m_curpos, m_buffer + m_cursize);
+    m_curobj = std::move(obj);
+    m_block_end = false;
+}
+
+// Appends remaining records of current block to records, until there are max_records of them;
+// text records are parsed by several threads
+template <class T>
+void BufferedInput<T>::next_block(std::vector<T>& records, uint threads, size_t max_records)
+{
+    if constexpr (T::LINES_PER_RECORD > 0)
+    {
+        if ((threads > 1) && !m_block_end && (records.size() < max_records))
+        {   // current object is parsed again along with the rest of block
+            char* start = m_buffer + m_curpos - m_curobj.size();
+            char* stop = m_buffer + m_cursize;
+            m_curobj.clear();
+            size_t first = records.size();
+            m_curpos = (start - m_buffer) + parseParallel<T>(start, stop, threads, records, max_records,
+                                                               this->indexed_starts(start, stop));
+            if (m_builder)
+                for (size_t i = first; i < records.size(); ++i)
+                    this->index_record(records[i]);
+            // the next object (if any) is read as next() does
+            m_reader.reset(m_buffer + m_curpos, m_buffer + m_cursize);
+            std::streamsize new_size = m_reader.read(m_curobj);
+            if (new_size < 0)
+                m_block_end = true;
+            else
+                m_curpos += new_size;
+            return;
+        }
+    }
+    while (!m_block_end && (records.size() < max_records))
+        records.push_back(this->next());
+}
+
+// Only sequence files (not key files) are indexed
+template <class T>
+void BufferedInput<T>::index_record(const T& obj)
+{
+    if constexpr (T::LINES_PER_RECORD > 0)
+        m_builder->add(obj, this->offset(obj));
+}
+
+// Records of buffer range whose offsets are stored by input index
+template <class T>
+std::vector<char*> BufferedInput<T>::indexed_starts(char* start, char* stop) const
+{
+    std::vector<char*> starts;
+    if (!m_index)
+        return starts;
+    uint64_t base = m_base + m_bytes_read - m_cursize;  // offset of buffer start
+    const std::vector<uint64_t>& offsets = m_index->offsets();
+    auto it = std::lower_bound(offsets.begin(), offsets.end(), base + (start - m_buffer));
+    for (; (it != offsets.end()) && (*it < base + (stop - m_buffer)); ++it)
+        starts.push_back(m_buffer + (*it - base));
+    return starts;
+}
+
+// Sequential input over records that are already stored in memory,
+// mimics BufferedInput interface
+template <class T>
+class InMemoryInput
+{
+public:
+    InMemoryInput(std::vector<T>& items) : m_items(items) {}
+    bool eof()          { return m_curpos >= m_items.size(); }
+    bool block_end()    { return this->eof(); }
+    void refresh()      { }
+    T next()            { return std::move(m_items[m_curpos++]); }
+
+private:
+    std::vector<T>& m_items;
+    size_t m_curpos = 0;
+};
+
+// K-way merge of sorted inputs: calls process(input_idx, record) for all records in sorted order,
+// equal records are ordered by index of their input
+template <class Input, class F>
+void mergeSortedInputs(std::vector<std::unique_ptr<Input>>& inputs, F&& process)
+{
+    using Record = decltype(inputs[0]->next());
+    struct Node
+    {
+        size_t input;
+        Record record;
+    };
+    // priority queue keeps the greatest element on top -> invert the order
+    auto later = [](const Node& a, const Node& b)
+    {
+        if (a.record > b.record)
+            return true;
+        if (b.record > a.record)
+            return false;
+        return a.input > b.input;
+    };
+    std::priority_queue<Node, std::vector<Node>, decltype(later)> queue(later);
+    for (size_t idx = 0; idx < inputs.size(); ++idx)
+        if (!inputs[idx]->eof())
+            queue.push({idx, inputs[idx]->next()});
+
+    while (!queue.empty())
+    {
+        // record is processed before its input is refreshed, which would invalidate it
+        size_t idx = queue.top().input;
+        process(idx, queue.top().record);
+        queue.pop();
+        if (inputs[idx]->block_end())
+            inputs[idx]->refresh();
+        if (!inputs[idx]->eof())
+            queue.push({idx, inputs[idx]->next()});
+    }
+}
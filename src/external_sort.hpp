@@ -1,16 +1,29 @@
 #pragma once
 #include "boost/format.hpp"
+#include <algorithm>
+#include <atomic>
 #include <cstdio>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <queue>
 #include <vector>
 
 #include "constants.hpp"
+#include "buffer_pool.hpp"
 #include "bufferedinput.hpp"
 #include "file_utils.hpp"
+#include "memory_budget.hpp"
+#include "run_stats.hpp"
 
 
+enum SortResult
+{
+    SR_SAVED,       // sorted data was saved to output file
+    SR_IN_MEMORY,   // whole input fits in memory, sorted records are kept by sorter
+    SR_PRESORTED    // input is already sorted, nothing was written
+};
+
 template<class T>
 struct QueueNode
 {
@@ -28,46 +41,77 @@ template <class T>
 class ExternalSorter
 {
 public:
-    ExternalSorter(ssize_t, const char*);
+    ExternalSorter(ssize_t, FileUtils::TemporaryDirectory*, uint threads = 1);
     ~ExternalSorter();
-    void sort(const char*, const char*);
+    SortResult sort(const char*, const char*, bool in_memory = false);
+    inline std::vector<T>& records() { return m_records; }
 private:
-    void sort_buckets(const char*);
+    void sort_buckets(const char*, bool);
+    void sort_ranges(const char*, const RecordIndex&);
+    bool check_sorted(BufferedInput<T>&, const T&);
     void mergeHelper(ssize_t, ssize_t, ssize_t);
     void merge(const char*);
     void reserve(ssize_t);
     void saveOutput(ssize_t, const char*);
+    std::string chunk_name(ssize_t) const;
 private:
-    const char* m_tempdir = "chunks";
-    const char* m_workdir;
+    std::vector<std::string> m_chunkdirs;
     ssize_t m_memlimit, m_filesNum;
+    size_t m_num_records = 0ul;  // number of records in sorted runs
+    uint m_threads;
+    bool m_presorted = false;
+    bool m_compressed;  // sorted runs are written compressed
     std::priority_queue<QueueNode<T>, std::vector<QueueNode<T>>> m_queue;
     std::vector<BufferedInput<T>> m_buffers;
+    // keeps data of a single sorted chunk alive for in-memory processing
+    std::unique_ptr<BufferedInput<T>> m_input;
+    std::vector<T> m_records;
+    MemoryBudget::Reservation m_views;
 };
 
 template <class T>
 ExternalSorter<T>::ExternalSorter(ssize_t memlimit,
-                                  const char* workdir) : m_workdir(workdir), m_memlimit(memlimit)
+                                  FileUtils::TemporaryDirectory* tempdir,
+                                  uint threads) : m_memlimit(memlimit), m_threads(threads),
+                                                  m_compressed(tempdir->compressed())
 {
-    std::ignore = chdir(m_workdir);
-    FS::create_directory(m_tempdir);
-    std::ignore = chdir("..");
+    m_chunkdirs = tempdir->create_subdirs("chunks");
 }
 
 template <class T>
 ExternalSorter<T>::~ExternalSorter() 
 {
-    std::ignore = chdir(m_workdir);
-    FS::remove_all(m_tempdir);
-    std::ignore = chdir("..");
+    for (auto& dirname: m_chunkdirs)
+        FS::remove_all(dirname);
+}
+
+template <class T>
+std::string ExternalSorter<T>::chunk_name(ssize_t idx) const
+{   // chunks are striped across all scratch directories
+    return (boost::format("%1%/%2%.tmp") % m_chunkdirs[idx % m_chunkdirs.size()] % idx).str();
 }
 
+// If in_memory flag is set and whole input fits in a single chunk, no files are written:
+// sorted records are kept in memory and can be accessed via records() method.
+// If input is already sorted, nothing is written either and input file should be used as is.
 template <class T>
-void ExternalSorter<T>::sort(const char* infilename,  
-                             const char* outfilename)
+SortResult ExternalSorter<T>::sort(const char* infilename,
+                                   const char* outfilename,
+                                   bool in_memory)
 {
-    this->sort_buckets(infilename);
+    RunStats::Phase phase("sort: run generation");
+    this->sort_buckets(infilename, in_memory);
+    phase.set("runs", m_filesNum);
+    phase.set("records", m_num_records);
+    phase.finish();
+    if (m_filesNum == 0)  // empty input is sorted as is
+        m_presorted = true;
+    if (m_input)
+        return SortResult::SR_IN_MEMORY;
+    if (m_presorted)
+        return SortResult::SR_PRESORTED;
     this->merge(outfilename);
+    return SortResult::SR_SAVED;
 }
 
 template <class T>
@@ -78,35 +122,76 @@ void ExternalSorter<T>::reserve(ssize_t count)
     container.reserve(count);
     m_queue = std::priority_queue<QueueNode<T>, std::vector<QueueNode<T>>>
         (std::less<QueueNode<T>>(), std::move(container));
-    // input buffers
-    ssize_t mem = std::max(this->m_memlimit / count, constants::ONE_MB);
+    // input buffers, decompressors of compressed runs take their share of memory as well
+    ssize_t decompressor = FileUtils::RunOutputFile::read_memory(m_compressed);
+    ssize_t mem = std::max(this->m_memlimit / count - decompressor, constants::ONE_MB);
     this->m_buffers.reserve(count);
     for (ssize_t i = 0; i < count; ++i)
         this->m_buffers.emplace_back(mem);
 }
 
 template <class T>
-void ExternalSorter<T>::sort_buckets(const char* infilename)
+void ExternalSorter<T>::sort_buckets(const char* infilename,
+                                    bool in_memory)
 {
-    std::ofstream output;
     m_filesNum = 0;
+    // threads read parts of indexed input on their own, unless it fits in a single chunk anyway
+    std::shared_ptr<const RecordIndex> index = RecordIndex::find(infilename);
+    uint64_t chunk = std::min<uint64_t>((m_memlimit / 3) * 2, BufferPool::instance().max_buffer());
+    if (index && index->seekable() && (m_threads > 1)
+        && ((index->bytes() > chunk) || (index->records() > (m_memlimit / 3) / sizeof(T))))
+        return this->sort_ranges(infilename, *index);
+
+    // "view" objects take up to 1/3 of corresponding memory chunk,
+    // a chunk ends early if its records do not fit there
+    m_views = MemoryBudget::Reservation(m_memlimit / 3, constants::ONE_MB);
     std::vector<T> arr;
-    // "view" objects take up to 1/3 of corresponding memory chunk
-    BufferedInput<T> buffer((m_memlimit / 3) * 2);
+    arr.reserve(m_views.size() / sizeof(T));
+    auto input = std::make_unique<BufferedInput<T>>((m_memlimit / 3) * 2);
+    BufferedInput<T>& buffer = *input;
     buffer.set_file(infilename);
+    bool check_order = true;
     
     while(!buffer.eof())
     {
         m_filesNum++;
         // read chunk of "view" objects from file
-        while (!buffer.block_end())
-            arr.push_back(buffer.next());
+        buffer.next_block(arr, m_threads, arr.capacity());
+        if (check_order && std::is_sorted(arr.begin(), arr.end()))
+        {   // first chunk is already sorted -> the whole input may need no sorting
+            if (in_memory && buffer.eof())
+            {
+                m_input = std::move(input);
+                m_records = std::move(arr);
+                return;
+            }
+            if (buffer.eof() || this->check_sorted(buffer, arr.back()))
+            {
+                m_presorted = true;
+                m_views.reset();
+                return;
+            }
+            // order is broken further in input -> start over
+            m_filesNum = 0;
+            arr.clear();
+            buffer.unset_file();
+            buffer.set_file(infilename);
+            check_order = false;
+            continue;
+        }
+        check_order = false;
+        m_num_records += arr.size();
         // sort objects
         std::sort(arr.begin(), arr.end());
+        if (in_memory && (m_filesNum == 1) && buffer.eof())
+        {   // whole input fits in memory, no need to save it
+            m_input = std::move(input);
+            m_records = std::move(arr);
+            return;
+        }
         // save sorted chunk to file in tmp dir
-        boost::format fmt = boost::format("%1%/%2%/%3%.tmp") % m_workdir % m_tempdir % (m_filesNum - 1);
-        output.open(fmt.str());
-        check_fstream_ok<std::ofstream>(output, fmt.str().c_str());
+        std::string outname = this->chunk_name(m_filesNum - 1);
+        FileUtils::RunOutputFile output(outname.c_str(), m_compressed);
         for (auto& item: arr)
             output << item;
         output.close();
@@ -114,6 +199,92 @@ void ExternalSorter<T>::sort_buckets(const char* infilename)
         arr.clear();
         buffer.refresh();
     }
+    // memory of views is only kept by in-memory result
+    m_views.reset();
+}
+
+// Run generation over ranges of indexed input: every thread seeks to its own range,
+// then parses, sorts and saves runs of it independently within its share of memory
+template <class T>
+void ExternalSorter<T>::sort_ranges(const char* infilename,
+                                    const RecordIndex& index)
+{
+    std::vector<RecordIndex::Range> ranges = index.split(m_threads);
+    uint n = ranges.size();
+    std::atomic<ssize_t> num_runs = 0;
+    std::atomic<size_t> num_records = 0;
+    // input is sorted if every range is, and ranges follow each other in order;
+    // first and last records of ranges are copied since buffer contents are shifted on refresh
+    std::vector<std::string> firsts(n), lasts(n);
+    std::vector<char> sorted(n, true);
+    auto view = [](std::string& data)
+    {
+        T obj;
+        obj.read_new(data.data(), data.data() + data.size());
+        return obj;
+    };
+
+    runParallel(n, [&](uint idx)
+    {
+        MemoryBudget::Reservation views(m_memlimit / 3 / n, constants::ONE_MB);
+        std::vector<T> arr;
+        arr.reserve(views.size() / sizeof(T));
+        BufferedInput<T> buffer((m_memlimit / 3) * 2 / n);
+        buffer.set_range(infilename, ranges[idx]);
+        while (!buffer.eof())
+        {
+            buffer.next_block(arr, 1, arr.capacity());
+            if (sorted[idx] && !arr.empty())
+            {
+                sorted[idx] = std::is_sorted(arr.begin(), arr.end())
+                              && (lasts[idx].empty() || !(arr.front() < view(lasts[idx])));
+                if (firsts[idx].empty())
+                    firsts[idx].assign(arr.front().start(), arr.front().size());
+                lasts[idx].assign(arr.back().start(), arr.back().size());
+            }
+            num_records += arr.size();
+            std::sort(arr.begin(), arr.end());
+            std::string outname = this->chunk_name(num_runs++);
+            FileUtils::RunOutputFile output(outname.c_str(), m_compressed);
+            for (auto& item: arr)
+                output << item;
+            output.close();
+            arr.clear();
+            buffer.refresh();
+        }
+    });
+    m_filesNum = num_runs;
+    m_num_records = num_records;
+    m_presorted = std::all_of(sorted.begin(), sorted.end(), [](char range_sorted) { return range_sorted; });
+    for (uint i = 1; m_presorted && (i < n); ++i)
+        m_presorted = !(view(firsts[i]) < view(lasts[i-1]));
+}
+
+// Checks whether the rest of input follows the given record in sorted order
+template <class T>
+bool ExternalSorter<T>::check_sorted(BufferedInput<T>& buffer,
+                                     const T& last)
+{
+    // previous record is copied since buffer contents are shifted on refresh
+    std::string boundary(last.start(), last.size());
+    T prev;
+    prev.read_new(boundary.data(), boundary.data() + boundary.size());
+    buffer.refresh();
+
+    while (!buffer.eof())
+    {
+        while (!buffer.block_end())
+        {
+            T obj = buffer.next();
+            if (obj < prev)
+                return false;
+            prev = std::move(obj);
+        }
+        boundary.assign(prev.start(), prev.size());
+        prev.read_new(boundary.data(), boundary.data() + boundary.size());
+        buffer.refresh();
+    }
+    return true;
 }
 
 template <class T>
@@ -122,12 +293,14 @@ void ExternalSorter<T>::mergeHelper(ssize_t start,
                                     ssize_t location)
 {
     ssize_t filesCount = end - start;
+    RunStats::Phase phase("sort: merge pass");
+    phase.set("fan_in", filesCount);
+    size_t num_records = 0ul;
     std::vector<std::string> filenames;
     filenames.reserve(filesCount);
     // set up files
     for (ssize_t i = 0; i < filesCount; ++i) {
-        boost::format fmt = boost::format("%1%/%2%/%3%.tmp") % m_workdir % m_tempdir % (start+i);
-        filenames.push_back(fmt.str());
+        filenames.push_back(this->chunk_name(start+i));
         m_buffers[i].set_file(filenames[i].c_str());
     }
     // initially fill up queue
@@ -139,16 +312,15 @@ void ExternalSorter<T>::mergeHelper(ssize_t start,
         }
     }
     // output file
-    std::ofstream output;
-    boost::format fmt = boost::format("%1%/%2%/%3%.tmp") % m_workdir % m_tempdir % location;
-    output.open(fmt.str());
-    check_fstream_ok<std::ofstream>(output, fmt.str().c_str());
+    std::string outname = this->chunk_name(location);
+    FileUtils::RunOutputFile output(outname.c_str(), m_compressed);
     // merge files iteratively
     while (!m_queue.empty())
     {
         ssize_t index = m_queue.top().m_index;
         output << m_queue.top().data();
         m_queue.pop();
+        num_records++;
         // push new item from file to queue if possible
         if (m_buffers[index].block_end())
             m_buffers[index].refresh();
@@ -160,6 +332,7 @@ void ExternalSorter<T>::mergeHelper(ssize_t start,
     {
         m_buffers[i].unset_file();
     }
+    phase.set("records", num_records);
     output.close();
     for (auto& name: filenames)
         FS::remove(name.c_str());
@@ -175,6 +348,9 @@ void ExternalSorter<T>::merge(const char* outfilename)
     }
 
     ssize_t start = 0, end = m_filesNum, step = 100L;
+    // decompressors of merged runs take at most half of memory
+    if (m_compressed)
+        step = std::clamp<ssize_t>(m_memlimit / (2 * FileUtils::RunOutputFile::read_memory(true)), 2L, step);
 
     if (step > end-start)
     {// can merge all files in one cycle
@@ -210,6 +386,5 @@ template <class T>
 void ExternalSorter<T>::saveOutput(ssize_t idx,
                                    const char* outfilename)
 {
-    boost::format fmt = boost::format("%1%/%2%/%3%.tmp") % m_workdir % m_tempdir % idx;
-    std::rename(fmt.str().c_str(), outfilename);
+    FileUtils::move_file(this->chunk_name(idx), outfilename);
 }
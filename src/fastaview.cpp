@@ -76,20 +76,38 @@ std::streamsize FastaView::read_new(char* start, char* stop)
 {   // try to map char* buffer to self, return -1 if buffer end is encountered prematurely
     if (start >= stop) { return -1; }
     if (*start != '>') { this->err_invalid_start(start); }
-    char* ptr;
-    // search ID
+    char* line_ends[LINES_PER_RECORD];
+    char* ptr = start;
+    for (int i = 0; i < LINES_PER_RECORD; ++i, ++ptr)
+    {
+        ptr = std::find(ptr, stop, '\n');
+        if (ptr == stop) { this->clear(); return -1; }
+        line_ends[i] = ptr;
+    }
+    return this->read_lines(start, line_ends);
+}
+
+std::streamsize FastaView::read_lines(char* start, char* const* line_ends)
+{   // map record to self given positions of its newline characters, return record size
+    if (*start != '>') { this->err_invalid_start(start); }
     m_id = start;
-    ptr = std::find(start, stop, '\n');
-    if (ptr == stop) { this->clear(); return -1; }
-    m_idlen = ptr - start + 1;
-    ssize_t len_so_far = m_idlen;
-    // search SEQ
-    ++ptr;
+    m_idlen = line_ends[0] - start + 1;
+    m_seqlen = line_ends[1] - line_ends[0];
+    return line_ends[1] - start + 1;
+}
+
+char* FastaView::find_record_start(char* ptr, char* stop)
+{   // find first record that starts on a line after ptr, return stop if there is none
+    // records are two lines long and sequence never starts with ">"
     ptr = std::find(ptr, stop, '\n');
-    if (ptr == stop) { this->clear(); return -1; }
-    m_seqlen = ptr - (start+len_so_far) + 1;
-    len_so_far += m_seqlen;
-    return len_so_far;
+    while (ptr != stop)
+    {
+        char* line = ptr + 1;
+        if ((line < stop) && (*line == '>'))
+            return line;
+        ptr = std::find(line, stop, '\n');
+    }
+    return stop;
 }
 
 void FastaView::err_invalid_start(char* ptr)
@@ -155,6 +173,19 @@ std::streamsize FastaViewWithId::read_new(char* start, char* stop)
     std::streamsize size = FastaView::read_new(start, stop);
     if (size <= 0)
         return -1;
+    this->find_idtag();
+    return size;
+}
+
+std::streamsize FastaViewWithId::read_lines(char* start, char* const* line_ends)
+{
+    std::streamsize size = FastaView::read_lines(start, line_ends);
+    this->find_idtag();
+    return size;
+}
+
+void FastaViewWithId::find_idtag()
+{
     char* ptr;
     ptr = std::find(m_id, m_id+m_idlen, '.');
     if (ptr == m_id+m_idlen)  // id in a form of "@XXXXX some_text"
@@ -163,5 +194,4 @@ std::streamsize FastaViewWithId::read_new(char* start, char* stop)
         m_idtag = ptr + 1; // we need NNNNN part
     ptr = std::find(m_idtag, m_id+m_idlen, ' ');
     m_idtag_len = ptr - m_idtag;
-    return size;
 }
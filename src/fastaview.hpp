@@ -2,10 +2,14 @@
 #include <algorithm>
 #include <cstring>
 #include <iostream>
+#include <string_view>
 
 class FastaView
 {
 public:
+    // number of lines in a single record
+    static const int LINES_PER_RECORD = 2;
+
     FastaView() {}
     FastaView(const FastaView&);
     FastaView(FastaView&&);
@@ -22,6 +26,8 @@ public:
     friend bool operator<(const FastaView& left, const FastaView& right);
     friend std::ostream& operator<<(std::ostream& os, const FastaView& fq);
     std::streamsize read_new(char*, char*);
+    std::streamsize read_lines(char*, char* const*);
+    static char* find_record_start(char*, char*);
 private:
     void err_invalid_start(char*);
 protected:
@@ -37,9 +43,14 @@ public:
     FastaViewWithId(FastaViewWithId&&);
     FastaViewWithId& operator=(FastaViewWithId&&);
     int cmp(const FastaViewWithId& other) const;
+    // part of id that identifies mates of a pair
+    inline std::string_view id_tag() const  { return {m_idtag, static_cast<size_t>(m_idtag_len)}; }
     friend bool operator>(const FastaViewWithId& left, const FastaViewWithId& right);
     friend bool operator<(const FastaViewWithId& left, const FastaViewWithId& right);
     std::streamsize read_new(char*, char*);
+    std::streamsize read_lines(char*, char* const*);
+private:
+    void find_idtag();
 private:
     char* m_idtag = nullptr;
     std::streamsize m_idtag_len = 0;
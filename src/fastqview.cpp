@@ -90,32 +90,49 @@ std::streamsize FastqView::read_new(char* start, char* stop)
 {   // try to map char* buffer to self, return -1 if buffer end is encountered prematurely
     if (start >= stop) { return -1; }
     if (*start != '@') { this->err_invalid_start(start); }
-    char* ptr;
-    // search ID
+    char* line_ends[LINES_PER_RECORD];
+    char* ptr = start;
+    for (int i = 0; i < LINES_PER_RECORD; ++i, ++ptr)
+    {
+        ptr = std::find(ptr, stop, '\n');
+        if (ptr == stop) { this->clear(); return -1; }
+        line_ends[i] = ptr;
+    }
+    return this->read_lines(start, line_ends);
+}
+
+std::streamsize FastqView::read_lines(char* start, char* const* line_ends)
+{   // map record to self given positions of its newline characters, return record size
+    if (*start != '@') { this->err_invalid_start(start); }
     m_id = start;
-    ptr = std::find(start, stop, '\n');
-    if (ptr == stop) { this->clear(); return -1; }
-    m_idlen = ptr - start + 1;
-    ssize_t len_so_far = m_idlen;
-    // search SEQ
-    ++ptr;
-    ptr = std::find(ptr, stop, '\n');
-    if (ptr == stop) { this->clear(); return -1; }
-    m_seqlen = ptr - (start+len_so_far) + 1;
-    len_so_far += m_seqlen;
-    // junk third string
-    ++ptr;
-    ptr = std::find(ptr, stop, '\n');
-    if (ptr == stop) { this->clear(); return -1; }
-    m_field3len = ptr - (start+len_so_far) + 1;
-    len_so_far += m_field3len;
-    // quality
-    ++ptr;
-    ptr = std::find(ptr, stop, '\n');
-    if (ptr == stop) { this->clear(); return -1; }
-    m_quallen = ptr - (start+len_so_far) + 1;
+    m_idlen = line_ends[0] - start + 1;
+    m_seqlen = line_ends[1] - line_ends[0];
+    m_field3len = line_ends[2] - line_ends[1];
+    m_quallen = line_ends[3] - line_ends[2];
     if (m_quallen != m_seqlen) { this->err_len_not_match(); }
-    return len_so_far + m_quallen;
+    return line_ends[3] - start + 1;
+}
+
+char* FastqView::find_record_start(char* ptr, char* stop)
+{   // find first record that starts on a line after ptr, return stop if there is none
+    // quality line may start with @ as well, but then the line after next one is a sequence and not a "+" line
+    char* line_starts[3];
+    char* line = std::find(ptr, stop, '\n');
+    while (line != stop)
+    {
+        ++line;
+        char* next = line;
+        for (int i = 0; i < 3; ++i)
+        {
+            next = std::find(next, stop, '\n');
+            if (next == stop) { return stop; }
+            line_starts[i] = ++next;
+        }
+        if ((*line == '@') && (*line_starts[1] == '+'))
+            return line;
+        line = line_starts[0] - 1;
+    }
+    return stop;
 }
 
 void FastqView::err_invalid_start(char* ptr)
@@ -192,6 +209,19 @@ std::streamsize FastqViewWithId::read_new(char* start, char* stop)
     std::streamsize size = FastqView::read_new(start, stop);
     if (size <= 0)
         return -1;
+    this->find_idtag();
+    return size;
+}
+
+std::streamsize FastqViewWithId::read_lines(char* start, char* const* line_ends)
+{
+    std::streamsize size = FastqView::read_lines(start, line_ends);
+    this->find_idtag();
+    return size;
+}
+
+void FastqViewWithId::find_idtag()
+{
     char* ptr;
     ptr = std::find(m_id, m_id+m_idlen, '.');
     if (ptr == m_id+m_idlen)  // id in a form of "@XXXXX some_text"
@@ -200,5 +230,4 @@ std::streamsize FastqViewWithId::read_new(char* start, char* stop)
         m_idtag = ptr + 1; // we need NNNNN part
     ptr = std::find(m_idtag, m_id+m_idlen, ' ');
     m_idtag_len = ptr - m_idtag;
-    return size;
 }
@@ -2,10 +2,14 @@
 #include <algorithm>
 #include <cstring>
 #include <iostream>
+#include <string_view>
 
 class FastqView
 {
 public:
+    // number of lines in a single record
+    static const int LINES_PER_RECORD = 4;
+
     FastqView() {};
     FastqView(const FastqView&);
     FastqView(FastqView&&);
@@ -22,6 +26,8 @@ public:
     friend bool operator<(const FastqView& left, const FastqView& right);
     friend std::ostream& operator<<(std::ostream& os, const FastqView& fq);
     std::streamsize read_new(char*, char*);
+    std::streamsize read_lines(char*, char* const*);
+    static char* find_record_start(char*, char*);
 private:
     void err_invalid_start(char*);
     void err_len_not_match();
@@ -38,9 +44,14 @@ public:
     FastqViewWithId(FastqViewWithId&&);
     FastqViewWithId& operator=(FastqViewWithId&&);
     int cmp(const FastqViewWithId& other) const;
+    // part of id that identifies mates of a pair
+    inline std::string_view id_tag() const  { return {m_idtag, static_cast<size_t>(m_idtag_len)}; }
     friend bool operator>(const FastqViewWithId& left, const FastqViewWithId& right);
     friend bool operator<(const FastqViewWithId& left, const FastqViewWithId& right);
     std::streamsize read_new(char*, char*);
+    std::streamsize read_lines(char*, char* const*);
+private:
+    void find_idtag();
 private:
     char* m_idtag = nullptr;
     std::streamsize m_idtag_len = 0;
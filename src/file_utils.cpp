@@ -4,8 +4,141 @@
 #include <boost/format.hpp>
 #include <boost/iostreams/filtering_streambuf.hpp>
 #include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/filter/zstd.hpp>
 #include <boost/iostreams/device/file.hpp>
+#include <boost/iostreams/device/file_descriptor.hpp>
 #include <boost/iostreams/copy.hpp>
+#include <boost/iostreams/operations.hpp>
+#include <boost/iostreams/stream.hpp>
+#include <cerrno>
+#include <chrono>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <zstd.h>
+
+namespace
+{
+    // number of zstd worker threads of compressed outputs
+    std::atomic<uint> zstd_threads = 1;
+
+    // Output filter compressing by zstd with several worker threads (zstd_compressor of boost is single-threaded).
+    // Filters are copied by streams, so compression context is shared between copies.
+    class ZstdMTCompressor
+    {
+    public:
+        typedef char char_type;
+        struct category : boost::iostreams::multichar_output_filter_tag, boost::iostreams::closable_tag {};
+
+        ZstdMTCompressor(int level, uint threads) : m_ctx(ZSTD_createCCtx(), ZSTD_freeCCtx), m_out(ZSTD_CStreamOutSize())
+        {
+            if (!m_ctx)
+                throw std::bad_alloc();
+            check(ZSTD_CCtx_setParameter(m_ctx.get(), ZSTD_c_compressionLevel, level));
+            // library built without multithreading support compresses in the calling thread
+            if (threads > 1)
+                ZSTD_CCtx_setParameter(m_ctx.get(), ZSTD_c_nbWorkers, threads);
+        }
+
+        template<typename Sink>
+        std::streamsize write(Sink& sink, const char* s, std::streamsize n)
+        {
+            ZSTD_inBuffer input = {s, static_cast<size_t>(n), 0};
+            while (input.pos < input.size)
+                this->compress(sink, input, ZSTD_e_continue);
+            return n;
+        }
+
+        template<typename Sink>
+        void close(Sink& sink)
+        {   // the rest of input is compressed and the frame is finished
+            ZSTD_inBuffer input = {nullptr, 0, 0};
+            while (this->compress(sink, input, ZSTD_e_end) > 0) {}
+            ZSTD_CCtx_reset(m_ctx.get(), ZSTD_reset_session_only);
+        }
+    private:
+        // returns number of bytes left to flush
+        template<typename Sink>
+        size_t compress(Sink& sink, ZSTD_inBuffer& input, ZSTD_EndDirective mode)
+        {
+            ZSTD_outBuffer output = {m_out.data(), m_out.size(), 0};
+            size_t remaining = check(ZSTD_compressStream2(m_ctx.get(), &output, &input, mode));
+            boost::iostreams::write(sink, m_out.data(), output.pos);
+            return remaining;
+        }
+
+        static size_t check(size_t code)
+        {
+            if (ZSTD_isError(code))
+            {
+                std::cerr << "Error: zstd compression failed: " << ZSTD_getErrorName(code) << '\n';
+                throw std::runtime_error("Could not compress output file!");
+            }
+            return code;
+        }
+    private:
+        std::shared_ptr<ZSTD_CCtx> m_ctx;
+        std::vector<char> m_out;
+    };
+
+    // Source device reading standard input from its descriptor: unlike std::cin (which waits until the whole
+    // request is read), a read returns as soon as some input is available. The byte peeked at is returned first.
+    class StandardInput
+    {
+    public:
+        typedef char char_type;
+        typedef boost::iostreams::source_tag category;
+
+        static int peek()
+        {
+            if (!m_peeked)
+            {
+                char first;
+                m_first = (read_fd(&first, 1) > 0) ? static_cast<unsigned char>(first) : EOF;
+                m_peeked = true;
+            }
+            return m_first;
+        }
+
+        std::streamsize read(char* s, std::streamsize n)
+        {
+            if (m_peeked)
+            {
+                m_peeked = false;
+                if (m_first == EOF)
+                    return -1;
+                *s = static_cast<char>(m_first);
+                return 1;
+            }
+            std::streamsize num_read = read_fd(s, n);
+            return (num_read > 0) ? num_read : -1;
+        }
+    private:
+        static std::streamsize read_fd(char* s, std::streamsize n)
+        {
+            ssize_t num_read;
+            while ((num_read = ::read(STDIN_FILENO, s, n)) < 0)
+            {
+                if (errno != EINTR)
+                {
+                    std::cerr << "Error: " << strerror(errno) << '\n';
+                    throw std::runtime_error("Could not read standard input!");
+                }
+            }
+            return num_read;
+        }
+    private:
+        static inline bool m_peeked = false;
+        static inline int m_first = EOF;
+    };
+
+    // Reads what stream has buffered, and waits for more input only if nothing is buffered
+    std::streamsize read_available(std::istream& input, char* arr, std::streamsize n)
+    {
+        if (input.rdbuf()->in_avail() <= 0)
+            input.peek();
+        return input.readsome(arr, n);
+    }
+}
 
 namespace FileUtils
 {
@@ -23,15 +156,19 @@ namespace FileUtils
         std::generate_n( buf, len, randchar );
     }
 
-    void create_random_dir(char* buf, int len, uint n_tries)
+    string create_random_dir(const FS::path& parent, uint n_tries)
     {
+        char buf[constants::DIRNAME_LEN + 1];
+        buf[constants::DIRNAME_LEN] = '\0';
+        uint tries_left = n_tries;
         while (true)
         {
-            _generate_random_name(buf, len);
-            if (FS::create_directory(buf)) 
-                break;
-            n_tries--;
-            if (!n_tries)
+            _generate_random_name(buf, constants::DIRNAME_LEN);
+            FS::path dirpath = parent / buf;
+            if (FS::create_directory(dirpath))
+                return dirpath.string();
+            tries_left--;
+            if (!tries_left)
             {
                 std::cerr << "Could not create directory with randomly-generated name in " << n_tries << " tries!" << std::endl;
                 throw std::runtime_error("Number of tries exhausted.");
@@ -39,6 +176,17 @@ namespace FileUtils
         }
     }
 
+    void move_file(const string& infilename, const string& outfilename)
+    {
+        std::error_code ec;
+        FS::rename(infilename, outfilename, ec);
+        if (!ec)
+            return;
+        // rename does not work across different mounts -> copy and remove instead
+        FS::copy_file(infilename, outfilename, FS::copy_options::overwrite_existing);
+        FS::remove(infilename);
+    }
+
     bool _fileHasExt(const char* filename, const char* ext)
     {
         FS::path filePath = filename;
@@ -47,48 +195,277 @@ namespace FileUtils
         return false;
     }
 
+    // Compression is detected by magic bytes rather than by file extension,
+    // standard input is only peeked at, so that nothing is consumed
+    Compression detectCompression(const char* filename)
+    {
+        const unsigned char GZIP_MAGIC[2] = {0x1f, 0x8b};
+        const unsigned char ZSTD_MAGIC[4] = {0x28, 0xb5, 0x2f, 0xfd};
+        if (isStdStream(filename))
+        {   // text records never start with these bytes
+            int first = StandardInput::peek();
+            if (first == GZIP_MAGIC[0])
+                return Compression::GZIP;
+            return (first == ZSTD_MAGIC[0]) ? Compression::ZSTD : Compression::NONE;
+        }
+        std::ifstream input(filename, std::ios_base::binary);
+        unsigned char magic[4] = {0, 0, 0, 0};
+        input.read(reinterpret_cast<char*>(magic), sizeof(magic));
+        if ((input.gcount() >= 2) && std::equal(GZIP_MAGIC, GZIP_MAGIC + 2, magic))
+            return Compression::GZIP;
+        if (input && std::equal(ZSTD_MAGIC, ZSTD_MAGIC + 4, magic))
+            return Compression::ZSTD;
+        return Compression::NONE;
+    }
+
+    // BGZF file is a series of gzip members (blocks) that store their compressed sizes in "BC" extra subfield,
+    // decompressed sizes are stored by gzip at the end of every member
+    std::vector<std::pair<uint64_t, uint64_t>> bgzfBlocks(const char* filename)
+    {
+        std::vector<std::pair<uint64_t, uint64_t>> blocks;
+        std::ifstream input;
+        input.rdbuf()->pubsetbuf(nullptr, 0);  // only headers and trailers are read
+        input.open(filename, std::ios_base::binary);
+        check_fstream_ok<std::ifstream>(input, filename);
+        uint64_t size = FS::file_size(filename), start = 0;
+        while (start < size)
+        {
+            unsigned char header[12];
+            input.seekg(start);
+            input.read(reinterpret_cast<char*>(header), sizeof(header));
+            if (!input || (header[0] != 0x1f) || (header[1] != 0x8b) || !(header[3] & 0x04))
+                return {};
+            std::vector<unsigned char> extra(header[10] | (header[11] << 8));
+            input.read(reinterpret_cast<char*>(extra.data()), extra.size());
+            if (!input)
+                return {};
+            uint64_t block_size = 0;
+            for (size_t pos = 0; pos + 4 <= extra.size(); pos += 4 + (extra[pos+2] | (extra[pos+3] << 8)))
+            {
+                if ((extra[pos] == 'B') && (extra[pos+1] == 'C') && (pos + 6 <= extra.size()))
+                    block_size = (extra[pos+4] | (extra[pos+5] << 8)) + 1;
+            }
+            if ((block_size == 0) || (start + block_size > size))
+                return {};
+            unsigned char trailer[4];
+            input.seekg(start + block_size - sizeof(trailer));
+            input.read(reinterpret_cast<char*>(trailer), sizeof(trailer));
+            if (!input)
+                return {};
+            uint64_t decompressed = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) | (uint64_t(trailer[3]) << 24);
+            blocks.emplace_back(start, decompressed);
+            start += block_size;
+        }
+        return blocks;
+    }
+
 
 // InputFile classes //
 
-    InputFileTXT::InputFileTXT(const char* infilename)
+    InputFileTXT::InputFileTXT(const char* infilename, uint64_t offset) : m_input(&m_infile)
     {
+        if (isStdStream(infilename))
+        {
+            m_stdin = std::make_unique<boost::iostreams::stream<StandardInput>>(StandardInput(), STDIN_BUFFER_SIZE);
+            m_input = m_stdin.get();
+            return;
+        }
         m_infile.open(infilename);
         check_fstream_ok<std::ifstream>(m_infile, infilename);
+        if (offset > 0)
+            m_infile.seekg(offset);
+    }
+
+    std::streamsize InputFileTXT::read_some(char* arr, std::streamsize n)
+    {
+        return read_available(*m_input, arr, n);
     }
 
-    InputFileGZ::InputFileGZ(const char* infilename)
+    InputFileGZ::InputFileGZ(const char* infilename, uint64_t voffset) : m_memory(MemoryBudget::Reservation::fixed(MEMORY_SIZE))
     {
+        m_instream.push(boost::iostreams::gzip_decompressor());
+        if (isStdStream(infilename))
+        {
+            m_instream.push(StandardInput());
+            return;
+        }
         m_infile.open(infilename, std::ios_base::in | std::ios_base::binary);
         check_fstream_ok<std::ifstream>(m_infile, infilename);
+        // decompression starts at a BGZF block, which is a complete gzip member
+        if (voffset > 0)
+            m_infile.seekg(voffset >> 16);
+        m_instream.push(m_infile);
+        if ((voffset & 0xffff) > 0)
+            m_instream.ignore(voffset & 0xffff);
+    }
 
-        m_instream.push(boost::iostreams::gzip_decompressor());
+    std::streamsize InputFileGZ::read_some(char* arr, std::streamsize n)
+    {
+        return read_available(m_instream, arr, n);
+    }
+
+
+    InputFileZST::InputFileZST(const char* infilename) : m_memory(MemoryBudget::Reservation::fixed(MEMORY_SIZE))
+    {
+        m_instream.push(boost::iostreams::zstd_decompressor());
+        if (isStdStream(infilename))
+        {
+            m_instream.push(StandardInput());
+            return;
+        }
+        m_infile.open(infilename, std::ios_base::in | std::ios_base::binary);
+        check_fstream_ok<std::ifstream>(m_infile, infilename);
         m_instream.push(m_infile);
     }
 
+    std::streamsize InputFileZST::read_some(char* arr, std::streamsize n)
+    {
+        return read_available(m_instream, arr, n);
+    }
+
 
 // InputFile factory //
 
     I_InputFile* openInputFile(const char* infilename)
     {
-        if (_fileHasExt(infilename, ".gz"))
+        switch (detectCompression(infilename))
         {
-            return new InputFileGZ(infilename);
-        } else {
-            return new InputFileTXT(infilename);
+            case Compression::GZIP:
+                return new InputFileGZ(infilename);
+            case Compression::ZSTD:
+                return new InputFileZST(infilename);
+            default:
+                return new InputFileTXT(infilename);
         }
     }
 
+    I_InputFile* openInputRange(const char* infilename, uint64_t seek, uint64_t length)
+    {
+        if (detectCompression(infilename) == Compression::GZIP)
+            return new InputRange(new InputFileGZ(infilename, seek), length);
+        return new InputRange(new InputFileTXT(infilename, seek), length);
+    }
+
+
+// MappedInputFile class
+    void MappedInputFile::open(const string& filename, size_t window)
+    {
+        if (FS::file_size(filename) == 0)  // empty file can not be mapped
+            return;
+        m_source.open(filename);
+        m_window = MemoryBudget::Reservation(window, constants::ONE_MB);
+        // records are read in order of their sequences, read-ahead would only bring in more pages
+        madvise(const_cast<char*>(m_source.data()), m_source.size(), MADV_RANDOM);  // only a hint, failure is harmless
+    }
+
+    const char* MappedInputFile::data(uint64_t offset, size_t n)
+    {
+        // a fault maps cached pages around the faulting one as well (up to 64 Kb by default)
+        static const size_t FAULT_SIZE = 64 * 1024;
+        size_t resident = (offset % FAULT_SIZE + n + FAULT_SIZE - 1) / FAULT_SIZE * FAULT_SIZE;
+        if (m_resident + resident > m_window.size())
+        {   // pages of a read-only file mapping are dropped from memory of the process, but not from page cache
+            madvise(const_cast<char*>(m_source.data()), m_source.size(), MADV_DONTNEED);
+            m_resident = 0;
+        }
+        m_resident += resident;
+        return m_source.data() + offset;
+    }
+
 
 // UniversalOutputFile class
     UniversalOutputFile::UniversalOutputFile(const char* outfilename)
     {
-        if (_fileHasExt(outfilename, ".gz"))
+        if (isStdStream(outfilename))
+        {   // standard output is written uncompressed
+            m_memory = MemoryBudget::Reservation::fixed(BUFFER_SIZE);
+            m_outstream.push(boost::iostreams::file_descriptor_sink(STDOUT_FILENO, boost::iostreams::never_close_handle), BUFFER_SIZE);
+        } else if (_fileHasExt(outfilename, ".gz"))
+        {
+            m_memory = MemoryBudget::Reservation::fixed(2 * GZIP_BUFFER_SIZE + GZIP_STATE_SIZE);
+            m_outstream.push(boost::iostreams::gzip_compressor(), GZIP_BUFFER_SIZE);
+            m_outstream.push(boost::iostreams::file_sink(outfilename, std::ofstream::binary), GZIP_BUFFER_SIZE);
+        } else if (_fileHasExt(outfilename, ".zst"))
         {
-            m_outstream.push(boost::iostreams::gzip_compressor(), static_cast<std::streamsize>(64 * 1024));
-            m_outstream.push(boost::iostreams::file_sink(outfilename, std::ofstream::binary), static_cast<std::streamsize>(64 * 1024));
+            uint threads = zstd_threads;
+            m_memory = MemoryBudget::Reservation::fixed(2 * GZIP_BUFFER_SIZE + ZSTD_STATE_SIZE
+                                                        + ((threads > 1) ? threads * ZSTD_WORKER_SIZE : 0ul));
+            m_outstream.push(ZstdMTCompressor(ZSTD_CLEVEL_DEFAULT, threads), GZIP_BUFFER_SIZE);
+            m_outstream.push(boost::iostreams::file_sink(outfilename, std::ofstream::binary), GZIP_BUFFER_SIZE);
         } else {
-            m_outstream.push(boost::iostreams::file_sink(outfilename), static_cast<std::streamsize>(256 * 1024));
+            m_memory = MemoryBudget::Reservation::fixed(BUFFER_SIZE);
+            m_outstream.push(boost::iostreams::file_sink(outfilename), BUFFER_SIZE);
         }
+        m_measured = RunStats::instance().enabled();
+        m_compressed = !isStdStream(outfilename) && (_fileHasExt(outfilename, ".gz") || _fileHasExt(outfilename, ".zst"));
+        if (m_measured && RunStats::instance().is_temp(outfilename))
+            m_counter = RunStats::TEMP_WRITTEN;
+    }
+
+    void UniversalOutputFile::set_threads(uint threads)
+    {
+        zstd_threads = threads;
+    }
+
+    UniversalOutputFile::~UniversalOutputFile()
+    {
+        if (!m_measured || !m_compressed)
+            return;
+        // the last compressed block is written on close
+        auto start = std::chrono::steady_clock::now();
+        m_outstream.reset();
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        RunStats::instance().add(RunStats::COMPRESS_NS, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+
+    void UniversalOutputFile::measured_write(const char* start, std::streamsize n)
+    {
+        RunStats::instance().add(m_counter, n);
+        if (!m_compressed)
+        {
+            m_outstream.write(start, n);
+            return;
+        }
+        auto begin = std::chrono::steady_clock::now();
+        m_outstream.write(start, n);
+        auto elapsed = std::chrono::steady_clock::now() - begin;
+        RunStats::instance().add(RunStats::COMPRESS_NS, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+
+    PairedOutputFile::PairedOutputFile(const char* outfilename1, const char* outfilename2)
+        : m_left(std::make_unique<UniversalOutputFile>(outfilename1))
+    {
+        if (*outfilename2 != '\0')
+            m_right = std::make_unique<UniversalOutputFile>(outfilename2);
+    }
+
+
+// RunOutputFile class
+
+    RunOutputFile::RunOutputFile(const char* outfilename, bool compressed) : m_name(outfilename)
+    {
+        if (compressed)
+        {
+            m_memory = MemoryBudget::Reservation::fixed(BUFFER_SIZE + ZSTD_STATE_SIZE);
+            m_outstream.push(boost::iostreams::zstd_compressor(boost::iostreams::zstd::best_speed), BUFFER_SIZE);
+        } else {
+            m_memory = MemoryBudget::Reservation::fixed(BUFFER_SIZE);
+        }
+        boost::iostreams::file_sink sink(outfilename, std::ofstream::binary);
+        if (!sink.is_open())
+        {
+            std::cerr << "Cannot open file " << outfilename << std::endl;
+            throw std::runtime_error("File does not exist or cannot be opened!");
+        }
+        m_outstream.push(sink, BUFFER_SIZE);
+    }
+
+    void RunOutputFile::close()
+    {
+        if (m_outstream.empty())
+            return;
+        m_outstream.reset();
+        RunStats::instance().add(RunStats::TEMP_WRITTEN, FS::file_size(m_name));
     }
 
 
@@ -111,22 +488,60 @@ namespace FileUtils
         m_file.write(start, n);
     }
 
+    void ClusterFile::write_raw(const char* start, ssize_t n)
+    {
+        m_file.write(start, n);
+    }
+
 // TemporaryDirectory class //
 
-    TemporaryDirectory::TemporaryDirectory()
+    TemporaryDirectory::TemporaryDirectory(const std::vector<string>& roots)
     {
-        m_name = (char*)malloc(sizeof(char)*(constants::DIRNAME_LEN + 1));
-        m_name[constants::DIRNAME_LEN] = '\0';
-        create_random_dir(m_name, constants::DIRNAME_LEN);
+        std::vector<string> parents = roots;
+        if (parents.empty())  // current working directory by default
+            parents.push_back(".");
+
+        for (auto& parent: parents)
+        {
+            if (!FS::is_directory(parent))
+            {
+                std::cerr << "Temporary directory root " << parent << " does not exist!" << std::endl;
+                throw std::runtime_error("Invalid temporary directory provided!");
+            }
+        }
 
-        m_sorted1 = (boost::format("%1%/data.sorted1") % m_name).str();
-        m_sorted2 = (boost::format("%1%/data.sorted2") % m_name).str();
+        m_dirs.reserve(parents.size());
+        for (auto& parent: parents)
+            m_dirs.push_back(create_random_dir(FS::absolute(parent).lexically_normal()));
     }
 
     TemporaryDirectory::~TemporaryDirectory()
     {
-        FS::remove_all(m_name);
-        free(m_name);
+        for (auto& dirname: m_dirs)
+            FS::remove_all(dirname);
+        m_dirs.clear();
+    }
+
+    // generates a unique path for a temporary file in one of scratch roots
+    string TemporaryDirectory::unique_name(const char* prefix)
+    {
+        uint idx = m_names_count++;
+        return (boost::format("%1%/%2%_%3%") % this->dir(idx) % prefix % idx).str();
+    }
+
+    // creates a uniquely-named subdirectory in every scratch root
+    std::vector<string> TemporaryDirectory::create_subdirs(const char* prefix)
+    {
+        std::vector<string> result;
+        result.reserve(m_dirs.size());
+        uint idx = m_names_count++;
+        for (auto& dirname: m_dirs)
+        {
+            string subdir = (boost::format("%1%/%2%_%3%") % dirname % prefix % idx).str();
+            FS::create_directory(subdir);
+            result.push_back(std::move(subdir));
+        }
+        return result;
     }
 
 }
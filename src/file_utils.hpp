@@ -1,22 +1,38 @@
 #pragma once
 #include <algorithm>
+#include <atomic>
 #include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <iterator>
+#include <memory>
 #include <random>
+#include <vector>
 
+#include <boost/iostreams/device/mapped_file.hpp>
 #include <boost/iostreams/filtering_stream.hpp>
 
+#include "memory_budget.hpp"
+#include "run_stats.hpp"
+
 using std::string;
 namespace FS = std::filesystem;
 
 namespace FileUtils
 {
     void _generate_random_name(char* buf, int len);
-    void create_random_dir(char* buf, int len, uint n_tries = 100);
+    string create_random_dir(const FS::path& parent, uint n_tries = 100);
+    void move_file(const string& infilename, const string& outfilename);
     bool _fileHasExt(const char* filename, const char* ext=".gz");
+    // "-" stands for standard input or output
+    inline bool isStdStream(const char* filename)   { return strcmp(filename, "-") == 0; }
+    enum class Compression { NONE, GZIP, ZSTD };
+    Compression detectCompression(const char* filename);
+    inline bool isGzipped(const char* filename)     { return detectCompression(filename) == Compression::GZIP; }
+    inline bool isCompressed(const char* filename)  { return detectCompression(filename) != Compression::NONE; }
+    // compressed offsets and decompressed sizes of all blocks of BGZF file, none if file is not one
+    std::vector<std::pair<uint64_t, uint64_t>> bgzfBlocks(const char* filename);
     [[deprecated]] void _decompress_gz(const char* infilename, const char* outfilename);
     [[deprecated]] void _compress_gz(const char* infilename, const char* outfilename);
     [[deprecated]] void _move_file_smart(const char* infilename, const char* outfilename);
@@ -29,35 +45,108 @@ namespace FileUtils
         virtual bool eof() const = 0;
         virtual std::streamsize gcount() const = 0;
         virtual void read(char* arr, std::streamsize n) = 0;
+        // reads up to n bytes, waits only until some input is available; returns 0 at the end of input
+        virtual std::streamsize read_some(char* arr, std::streamsize n) = 0;
     };
 
     class InputFileTXT : public I_InputFile
     {
     public:
-        InputFileTXT(const char* infilename);
+        InputFileTXT(const char* infilename, uint64_t offset = 0);
         ~InputFileTXT()                             { m_infile.close();         }
-        bool eof() const                            { return m_infile.eof();    }
-        std::streamsize gcount() const              { return m_infile.gcount(); }
-        void read(char* arr, std::streamsize n)     { m_infile.read(arr, n);    }
+        bool eof() const                            { return m_input->eof();    }
+        std::streamsize gcount() const              { return m_input->gcount(); }
+        void read(char* arr, std::streamsize n)     { m_input->read(arr, n);    }
+        std::streamsize read_some(char* arr, std::streamsize n);
     private:
         std::ifstream m_infile;
+        // standard input is read from its descriptor rather than by std::cin, see StandardInput
+        std::unique_ptr<std::istream> m_stdin;
+        std::istream* m_input;  // either m_infile or m_stdin
+        // capacity of a pipe, so that a partial read takes all of its contents
+        static const std::streamsize STDIN_BUFFER_SIZE = 64 * 1024;
     };
 
     class InputFileGZ : public I_InputFile
     {
     public:
-        InputFileGZ(const char* infilename);
+        // BGZF file may be read from a virtual offset
+        InputFileGZ(const char* infilename, uint64_t voffset = 0);
         ~InputFileGZ()                             { m_infile.close();           }
         bool eof() const                           { return m_instream.eof();    }
         std::streamsize gcount() const             { return m_instream.gcount(); }
         void read(char* arr, std::streamsize n)    { m_instream.read(arr, n);    }
+        std::streamsize read_some(char* arr, std::streamsize n);
     private:
+        // buffers and state of decompressor
+        static const size_t MEMORY_SIZE = 64 * 1024;
+        MemoryBudget::Reservation m_memory;
         std::ifstream m_infile;
         boost::iostreams::filtering_istream m_instream;
     };
 
+    class InputFileZST : public I_InputFile
+    {
+    public:
+        InputFileZST(const char* infilename);
+        ~InputFileZST()                            { m_infile.close();           }
+        bool eof() const                           { return m_instream.eof();    }
+        std::streamsize gcount() const             { return m_instream.gcount(); }
+        void read(char* arr, std::streamsize n)    { m_instream.read(arr, n);    }
+        std::streamsize read_some(char* arr, std::streamsize n);
+        // window of default compression levels (2 MB), block buffers and state of decompressor
+        static const size_t MEMORY_SIZE = 2560 * 1024;
+    private:
+        MemoryBudget::Reservation m_memory;
+        std::ifstream m_infile;
+        boost::iostreams::filtering_istream m_instream;
+    };
+
+    // Reads at most given number of bytes of another input file
+    class InputRange : public I_InputFile
+    {
+    public:
+        InputRange(I_InputFile* input, uint64_t length) : m_input(input), m_left(length) {}
+        bool eof() const                            { return (m_left == 0) || m_input->eof(); }
+        std::streamsize gcount() const              { return m_gcount; }
+        void read(char* arr, std::streamsize n)
+        {
+            m_input->read(arr, std::min<uint64_t>(n, m_left));
+            m_gcount = m_input->gcount();
+            m_left -= m_gcount;
+        }
+        std::streamsize read_some(char* arr, std::streamsize n)
+        {
+            m_gcount = m_input->read_some(arr, std::min<uint64_t>(n, m_left));
+            m_left -= m_gcount;
+            return m_gcount;
+        }
+    private:
+        std::unique_ptr<I_InputFile> m_input;
+        uint64_t m_left;
+        std::streamsize m_gcount = 0;
+    };
+
     // InputFile factory
     I_InputFile* openInputFile(const char* infilename);
+    // part of input file that starts at seek position (byte offset, or virtual offset of BGZF file), see RecordIndex
+    I_InputFile* openInputRange(const char* infilename, uint64_t seek, uint64_t length);
+
+    // Memory-mapped input file for random access to its records.
+    // Resident pages of the mapping are bounded by a window drawn from memory budget:
+    // once records read since the last release may exceed it, pages are released (and faulted in again on access)
+    class MappedInputFile
+    {
+    public:
+        MappedInputFile() {}
+        void open(const string& filename, size_t window);
+        // pointer to n bytes at given offset of the file
+        const char* data(uint64_t offset, size_t n);
+    private:
+        boost::iostreams::mapped_file_source m_source;
+        MemoryBudget::Reservation m_window;
+        size_t m_resident = 0;
+    };
 
     // OutputFile abstraction
     class I_OutputFile
@@ -72,10 +161,64 @@ namespace FileUtils
     {
     public:
         UniversalOutputFile(const char* outfilename);
-        ~UniversalOutputFile()                              { }
-        void write(const char* start, std::streamsize n)    { m_outstream.write(start, n); }
+        ~UniversalOutputFile();
+        void write(const char* start, std::streamsize n)
+        {
+            if (m_measured)
+                this->measured_write(start, n);
+            else
+                m_outstream.write(start, n);
+        }
+        void flush()                                        { m_outstream.flush(); }
+        // number of threads compressing ".zst" outputs opened afterwards
+        static void set_threads(uint);
+    private:
+        // written bytes and compression time are only counted when run statistics are collected
+        void measured_write(const char* start, std::streamsize n);
+    private:
+        static const std::streamsize BUFFER_SIZE = 256 * 1024, GZIP_BUFFER_SIZE = 64 * 1024;
+        // compressor keeps its own buffers and window besides stream buffers
+        static const size_t GZIP_STATE_SIZE = 256 * 1024, ZSTD_STATE_SIZE = 3 * 1024 * 1024;
+        // input and output buffers of a job of a zstd worker thread
+        static const size_t ZSTD_WORKER_SIZE = 16 * 1024 * 1024;
+        // buffer memory is drawn from memory budget, so it is released after the stream is destroyed
+        MemoryBudget::Reservation m_memory;
+        boost::iostreams::filtering_ostream m_outstream;
+        bool m_measured = false, m_compressed = false;
+        RunStats::Counter m_counter = RunStats::OUTPUT_WRITTEN;
+    };
+
+    // Outputs of read pairs: mates are written to two files, or one after another to the first file
+    // (interleaved output) if the second file name is empty
+    class PairedOutputFile
+    {
+    public:
+        PairedOutputFile(const char* outfilename1, const char* outfilename2);
+        inline UniversalOutputFile& left()                  { return *m_left; }
+        inline UniversalOutputFile& right()                 { return m_right ? *m_right : *m_left; }
+    private:
+        std::unique_ptr<UniversalOutputFile> m_left, m_right;
+    };
+
+    // Temporary file of a sorted run, compressed by zstd at its fastest level if requested:
+    // runs are read back by BufferedInput, which recognizes compression by contents
+    class RunOutputFile
+    {
+    public:
+        RunOutputFile(const char* outfilename, bool compressed);
+        ~RunOutputFile()                                    { this->close(); }
+        template<class T>
+        RunOutputFile& operator<<(const T& item)            { m_outstream << item; return *this; }
+        // flushes the file, its size is counted as written temporary bytes
+        void close();
+        // decompressor memory of a compressed run read back
+        static inline size_t read_memory(bool compressed)   { return compressed ? InputFileZST::MEMORY_SIZE : 0ul; }
     private:
+        static const std::streamsize BUFFER_SIZE = 256 * 1024;
+        static const size_t ZSTD_STATE_SIZE = 1024 * 1024;
+        MemoryBudget::Reservation m_memory;
         boost::iostreams::filtering_ostream m_outstream;
+        string m_name;
     };
 
     // File for storing clusters of duplicated reads
@@ -87,24 +230,32 @@ namespace FileUtils
         void open(const char* base_filename);
         void write_cluster_head(const char* start, ssize_t n);
         void write_cluster_item(const char* start, ssize_t n);
+        // appends text already formatted as cluster heads and items
+        void write_raw(const char* start, ssize_t n);
     private:
         std::ofstream m_file;
     };
 
 
-    // Directory with randomly-generated name
+    // Directories with randomly-generated names, one under each scratch root.
+    // All paths are absolute; temporary files are striped across roots round-robin.
     class TemporaryDirectory
     {
     public:
-        TemporaryDirectory();
+        TemporaryDirectory(const std::vector<string>& roots = {});
         ~TemporaryDirectory();
-        inline const char* name()           const   { return m_name;    }
-        inline const string& sorted_left()  const   { return m_sorted1; }
-        inline const string& sorted_right() const   { return m_sorted2; }
+        inline const char* name()               const   { return m_dirs[0].c_str();         }
+        inline size_t size()                    const   { return m_dirs.size();             }
+        inline const string& dir(size_t idx)    const   { return m_dirs[idx % m_dirs.size()]; }
+        // whether sorted runs are written compressed
+        inline bool compressed()                const   { return m_compressed; }
+        inline void set_compressed(bool value)          { m_compressed = value; }
+        std::vector<string> create_subdirs(const char* prefix);
+        string unique_name(const char* prefix);
     private:
-        char* m_name;
-        string m_sorted1;
-        string m_sorted2;
+        std::vector<string> m_dirs;
+        std::atomic<uint> m_names_count = 0;
+        bool m_compressed = false;
     };
 }
 
@@ -1,14 +1,28 @@
 #pragma once
+#include <algorithm>
+#include <fstream>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 #include <unordered_set>
 #include <boost/functional/hash.hpp>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 // TODO maybe change hash_combine to https://stackoverflow.com/a/72073933
 // or https://www.biostars.org/p/184993/#185003
 
 #include "bufferedinput.hpp"
 #include "external_sort.hpp"
 #include "file_utils.hpp"
+#include "key_set.hpp"
+#include "memory_budget.hpp"
+#include "paired_external_sort.hpp"
+#include "parallel_parse.hpp"
+#include "recent_set.hpp"
+#include "seq_utils.hpp"
 
 using std::string;
 using FileUtils::TemporaryDirectory;
@@ -67,30 +81,105 @@ struct setRecordPairHash
     }
 };
 
-using hashed_set = std::unordered_set<setRecord, setRecordHash>;
-using paired_hashed_set = std::unordered_set<setRecordPair, setRecordPairHash>;
-
+/*
+Keys of reads (read pairs) are sequence lengths followed by hashes of sequence chunks (of each mate), kept in a KeySet;
+setRecord and setRecordPair objects are only used as keys of streaming mode, which evicts them.
+Hash sets draw their memory from MemoryBudget. If a set does not fit into the budget, deduplication
+is started over with spilling: keys of all records (with record numbers) are split into partition files
+by their hashes, partitions are deduplicated one by one (and split further if they still do not fit),
+first occurrences of keys are marked in a bitmap, and marked records are written out in a second pass over input.
+Output is the same as of in-memory deduplication.
+*/
 template<class T>
 class HashDupRemover
 {
 public:
-    HashDupRemover(ssize_t memlimit, TemporaryDirectory* tempdir, bool verbose)
-        : m_memlimit(memlimit), m_tempdir(tempdir), m_verbose(verbose) {}
+    HashDupRemover(ssize_t memlimit, TemporaryDirectory* tempdir, bool verbose, uint threads = 1)
+        : m_memlimit(memlimit), m_tempdir(tempdir), m_verbose(verbose), m_threads(threads) {}
     ~HashDupRemover() {}
+    // exact number of input records (e.g. from an index) allows to size hash tables upfront
+    void set_expected_records(size_t count) { m_expected_records = count; }
+    // streaming mode: only a window of recently seen distinct reads (pairs) is remembered
+    void set_stream_window(size_t reads)    { m_window = reads; }
+    // unordered pairs are matched by a hash join instead of sorting both inputs by read IDs
+    void set_hash_join(bool flag)           { m_hash_join = flag; }
     void filterSE(const string&, const string&);
     void filterPE(const string&, const string&,
                   const string&, const string&,
                   bool);
+    // Expected memory of a hash set of distinct reads (read pairs), seq_len is mean length of sequences (of both mates)
+    static size_t set_memory(size_t distinct, double seq_len, bool paired);
+    // Part of memory limit left for hash set by input buffers
+    static size_t set_budget(ssize_t memlimit, bool paired);
 private:
-    void impl_filterSE(const char*, const char*);
-    void impl_filterPE(const char*, const char*,
+    struct DedupCounts
+    {
+        size_t records = 0ul, duplicates = 0ul, unmatched = 0ul;
+    };
+    bool impl_filterSE(const char*, const char*);
+    bool impl_filterSE_parallel(const char*, const char*);
+    bool impl_filterPE(const char*, const char*,
                        const char*, const char*);
-    void impl_filterPE_unordered(const char*, const char*,
+    bool impl_filterPE_unordered(const char*, const char*,
+                                 const char*, const char*);
+    void impl_filterSE_stream(const char*, const char*);
+    void impl_filterPE_stream(const char*, const char*,
+                              const char*, const char*);
+    bool impl_filterPE_hash_join(const char*, const char*,
                                  const char*, const char*);
+    std::vector<string> partition_by_id(const char*, size_t, const char*);
+    struct JoinCounts
+    {
+        size_t pairs = 0ul, duplicates = 0ul, unmatched = 0ul;
+    };
+    bool join_mates(const char*, const char*,
+                    FileUtils::UniversalOutputFile&, FileUtils::UniversalOutputFile&,
+                    KeySet&, JoinCounts&);
+    // sequential passes over records (single reads, pairs, or matching pairs of inputs sorted by read IDs);
+    // process(records...) returns false to stop, number of unmatched records is returned
+    template<class F> size_t scanSE(const char*, F&&);
+    template<class F> size_t scanPE(const char*, const char*, F&&);
+    template<class F> size_t scanPE_unordered(const char*, const char*, F&&);
+    static void encode(std::vector<uint64_t>& key, const T& obj)                    { key.clear(); append_key(key, obj); }
+    static void encode(std::vector<uint64_t>& key, const T& left, const T& right)   { key.clear(); append_key(key, left); append_key(key, right); }
+    static void append_key(std::vector<uint64_t>& key, const T& obj)
+    {
+        ssize_t len = obj.seq_len() - 1;
+        key.push_back(len);
+        SeqUtils::seq2hash(key, obj.seq(), len);
+    }
+    static size_t key_words(const T& obj)   { return 1 + (obj.seq_len() - 1 + SeqUtils::CHUNKSIZE - 1) / SeqUtils::CHUNKSIZE; }
+    void presize(KeySet&) const;
+    void start_spill(const char*, uint64_t);
+    static void trim_heap();
+    void check_spill(const string&) const;
+    template<class Scan, class Write> DedupCounts dedup_spilled(Scan&&, Write&&);
+    void dedup_partition(const string&, std::vector<bool>&, uint);
+    static size_t partition(size_t, uint, size_t);
+    // keys of partition files are preceded by record numbers and sizes
+    static void write_key(std::ostream&, uint64_t, const std::vector<uint64_t>&);
+    static bool read_key(std::istream&, uint64_t&, std::vector<uint64_t>&);
+    static size_t record_bytes(ssize_t len) { return (len + SeqUtils::CHUNKSIZE - 1) / SeqUtils::CHUNKSIZE * sizeof(uint64_t); }
+    void report_stream(size_t, size_t, size_t, const char*) const;
+    // input buffers take a small share of memory limit, the rest is left for hash set
+    static ssize_t buffer_size(ssize_t memlimit)    { return std::min(5L * constants::HUNDRED_MB, memlimit / 8); }
+    ssize_t buffer_size()                   const   { return buffer_size(m_memlimit); }
 private:
     ssize_t             m_memlimit;
     TemporaryDirectory* m_tempdir;
     bool                m_verbose;
+    uint                m_threads;
+    size_t              m_expected_records = 0ul;
+    size_t              m_window = 0ul;
+    bool                m_hash_join = false;
+    size_t              m_spill_parts = 0ul;  // number of partitions of spilled deduplication
+    // small input blocks keep latency low: reads are written out as soon as their block is processed
+    static const ssize_t STREAM_BLOCK_SIZE = 4L * constants::ONE_MB;
+    // records of the first input are copied to blocks of this size by hash join
+    static constexpr ssize_t ARENA_BLOCK_SIZE = 64L * constants::ONE_MB;
+    // partitions of spilled deduplication, partitions that do not fit are split into SPILL_SPLIT ones up to SPILL_DEPTH times
+    static constexpr size_t MAX_SPILL_PARTS = 256ul, SPILL_SPLIT = 16ul;
+    static const uint SPILL_DEPTH = 4;
 };
 
 
@@ -99,52 +188,171 @@ void HashDupRemover<T>::filterSE(const string& infile,
                                  const string& outfile)
 {
     // deduplicate file
-    this->impl_filterSE(infile.c_str(), outfile.c_str());
+    if (m_window > 0)
+    {
+        this->impl_filterSE_stream(infile.c_str(), outfile.c_str());
+        return;
+    }
+    bool done = (m_threads > 1) ? this->impl_filterSE_parallel(infile.c_str(), outfile.c_str())
+                                : this->impl_filterSE(infile.c_str(), outfile.c_str());
+    if (done)
+        return;
+    // hash set does not fit into memory budget
+    this->check_spill(infile);
+    FileUtils::UniversalOutputFile output_file{outfile.c_str()};
+    DedupCounts counts = this->dedup_spilled(
+        [&](auto&& process) { return this->scanSE(infile.c_str(), process); },
+        [&](const T& obj) { output_file.write(obj.start(), obj.size()); });
+    if (m_verbose)
+        std::cout << counts.records << " reads processed, out of which " << counts.duplicates << " duplicates were removed.\n";
+}
+
+template<class T>
+size_t HashDupRemover<T>::set_memory(size_t distinct, double seq_len, bool paired)
+{
+    // length and hashes of chunks of every sequence, the last chunk is partially filled
+    return KeySet::expected_memory(distinct, seq_len / SeqUtils::CHUNKSIZE + (paired ? 3.0 : 1.5));
+}
+
+template<class T>
+size_t HashDupRemover<T>::set_budget(ssize_t memlimit, bool paired)
+{
+    size_t buffers = (paired ? 2 : 1) * buffer_size(memlimit);
+    size_t available = std::min(MemoryBudget::instance().available(), static_cast<size_t>(memlimit));
+    return available - std::min(available, buffers);
 }
 
+// Initial size of hash table: expected number of records, as far as memory budget allows
 template<class T>
-void HashDupRemover<T>::impl_filterSE(const char* infilename,
+void HashDupRemover<T>::presize(KeySet& records) const
+{
+    size_t count = m_expected_records ? m_expected_records : ONE_MIL;  // TODO optimize default value?
+    // slots of the table take two words, up to a quarter of the budget is taken upfront
+    count = std::min(count, MemoryBudget::instance().available() / 4 / (2 * sizeof(uint64_t)));
+    records.reserve(count);
+}
+
+template<class T>
+bool HashDupRemover<T>::impl_filterSE(const char* infilename,
                                       const char* outfilename)
 {
+    RunStats::Phase phase("hash dedup");
     // std::unique_ptr<FileUtils::I_OutputFile> output_file{FileUtils::openOutputFile(outfilename)};
     FileUtils::UniversalOutputFile output_file{outfilename};
 
     T obj;
-    hashed_set records;
-    records.reserve(ONE_MIL);  // TODO optimize this value?
-    BufferedInput<T> buffer(5L * constants::HUNDRED_MB);
+    KeySet records;
+    this->presize(records);
+    std::vector<uint64_t> key;
+    BufferedInput<T> buffer(this->buffer_size());
     size_t tot_reads = 0ul, dup_reads = 0ul;
+    uint64_t processed = 0ul;
 
     buffer.set_file(infilename);
-    obj = buffer.next();
-    tot_reads++;
-
-    // output_file->write(obj.start(), obj.size());
-    output_file.write(obj.start(), obj.size());
-    records.insert(std::move(setRecord(obj.seq(), obj.seq_len()-1)));
-
     while (!buffer.eof())
     {
         while (!buffer.block_end())
         {
             obj = buffer.next();
-            setRecord record(obj.seq(), obj.seq_len()-1);
+            encode(key, obj);
             tot_reads++;
-            auto it = records.find(record);
-            if (it == records.end())
-            {   
+            KeySet::Result result = records.insert(key.data(), key.size());
+            if (result == KeySet::Result::FULL)
+            {
+                this->start_spill(infilename, processed);
+                return false;
+            }
+            if (result == KeySet::Result::INSERTED)
                 // output_file->write(obj.start(), obj.size());
                 output_file.write(obj.start(), obj.size());
-                records.insert(std::move(record));
-            } else {
+            else
                 dup_reads++;
+            processed += obj.size();
+        }
+        buffer.refresh();
+    }
+
+    phase.set("records", tot_reads);
+    phase.set("duplicates", dup_reads);
+    if (m_verbose)
+        std::cout << tot_reads << " reads processed, out of which " << dup_reads << " duplicates were removed.\n";
+    return true;
+}
+
+// Records of each block are parsed and hashed by several threads,
+// then looked up in the set in order of appearance
+template<class T>
+bool HashDupRemover<T>::impl_filterSE_parallel(const char* infilename,
+                                               const char* outfilename)
+{
+    RunStats::Phase phase("hash dedup");
+    FileUtils::UniversalOutputFile output_file{outfilename};
+
+    std::vector<T> objs;
+    // keys of a block follow each other, their positions are given by offsets
+    std::vector<uint64_t> keys, hashes;
+    std::vector<size_t> offsets;
+    KeySet records;
+    MemoryBudget::Tracker block_memory;
+    this->presize(records);
+    BufferedInput<T> buffer(this->buffer_size());
+    size_t tot_reads = 0ul, dup_reads = 0ul;
+    uint64_t processed = 0ul;
+
+    buffer.set_file(infilename);
+    while (!buffer.eof())
+    {
+        objs.clear();
+        buffer.next_block(objs, m_threads);
+        offsets.resize(objs.size() + 1);
+        offsets[0] = 0;
+        for (size_t i = 0; i < objs.size(); ++i)
+            offsets[i + 1] = offsets[i] + key_words(objs[i]);
+        keys.resize(offsets.back());
+        hashes.resize(objs.size());
+        // arrays of a block are accounted as they grow
+        size_t block_size = objs.capacity() * sizeof(T) + (keys.capacity() + hashes.capacity()) * sizeof(uint64_t)
+                          + offsets.capacity() * sizeof(size_t);
+        if ((block_size > block_memory.used()) && !block_memory.add(block_size - block_memory.used()))
+        {
+            this->start_spill(infilename, processed);
+            return false;
+        }
+        runParallel(m_threads, [&](uint idx)
+        {
+            size_t from = objs.size() * idx / m_threads, to = objs.size() * (idx + 1) / m_threads;
+            std::vector<uint64_t> key;
+            for (size_t i = from; i < to; ++i)
+            {
+                encode(key, objs[i]);
+                std::copy(key.begin(), key.end(), keys.begin() + offsets[i]);
+                hashes[i] = KeySet::hash(key.data(), key.size());
+            }
+        });
+
+        for (size_t i = 0; i < objs.size(); ++i)
+        {
+            tot_reads++;
+            KeySet::Result result = records.insert(keys.data() + offsets[i], offsets[i + 1] - offsets[i], hashes[i]);
+            if (result == KeySet::Result::FULL)
+            {
+                this->start_spill(infilename, processed);
+                return false;
             }
+            if (result == KeySet::Result::INSERTED)
+                output_file.write(objs[i].start(), objs[i].size());
+            else
+                dup_reads++;
+            processed += objs[i].size();
         }
         buffer.refresh();
     }
 
+    phase.set("records", tot_reads);
+    phase.set("duplicates", dup_reads);
     if (m_verbose)
         std::cout << tot_reads << " reads processed, out of which " << dup_reads << " duplicates were removed.\n";
+    return true;
 }
 
 template<class T>
@@ -158,123 +366,258 @@ void HashDupRemover<T>::filterPE(const string& infile1,
     string infilename2 = infile2;
 
     // sort both files by ID if needed
+    if (unordered_flag && m_hash_join)
+    {
+        if (this->impl_filterPE_hash_join(infilename1.c_str(),
+                                          infilename2.c_str(),
+                                          outfile1.c_str(),
+                                          outfile2.c_str()))
+            return;
+        trim_heap();
+        if (m_verbose)
+            std::cout << "Hash join does not fit into memory limit, inputs are sorted by read IDs instead.\n";
+    }
     if (unordered_flag)
     {
         // sort first file
         {
-            ExternalSorter<T> sorter(m_memlimit, m_tempdir->name());
-            sorter.sort(infilename1.c_str(), m_tempdir->sorted_left().c_str());
+            string sorted_file = m_tempdir->unique_name("data.sorted1");
+            ExternalSorter<T> sorter(m_memlimit, m_tempdir, m_threads);
+            if (sorter.sort(infilename1.c_str(), sorted_file.c_str()) == SortResult::SR_SAVED)
+                infilename1 = sorted_file;
+            else if (m_verbose)
+                std::cout << "First input is already sorted by read IDs, sorting step was skipped.\n";
         }
 
         // sort second file
         {
-            ExternalSorter<T> sorter(m_memlimit, m_tempdir->name());
-            sorter.sort(infilename2.c_str(), m_tempdir->sorted_right().c_str());
+            string sorted_file = m_tempdir->unique_name("data.sorted2");
+            ExternalSorter<T> sorter(m_memlimit, m_tempdir, m_threads);
+            if (sorter.sort(infilename2.c_str(), sorted_file.c_str()) == SortResult::SR_SAVED)
+                infilename2 = sorted_file;
+            else if (m_verbose)
+                std::cout << "Second input is already sorted by read IDs, sorting step was skipped.\n";
         }
-
-        infilename1 = m_tempdir->sorted_left();
-        infilename2 = m_tempdir->sorted_right();
     }
 
     // deduplicate 2 files
+    if (m_window > 0)
+    {
+        this->impl_filterPE_stream(infilename1.c_str(),
+                                   infilename2.c_str(),
+                                   outfile1.c_str(),
+                                   outfile2.c_str());
+        return;
+    }
+    bool done = unordered_flag ? this->impl_filterPE_unordered(infilename1.c_str(),
+                                                               infilename2.c_str(),
+                                                               outfile1.c_str(),
+                                                               outfile2.c_str())
+                               : this->impl_filterPE(infilename1.c_str(),
+                                                     infilename2.c_str(),
+                                                     outfile1.c_str(),
+                                                     outfile2.c_str());
+    if (done)
+        return;
+    // hash set does not fit into memory budget
+    this->check_spill(infilename1);
+    this->check_spill(infilename2);
+    FileUtils::PairedOutputFile outputs{outfile1.c_str(), outfile2.c_str()};
+    FileUtils::UniversalOutputFile& output_file1 = outputs.left();
+    FileUtils::UniversalOutputFile& output_file2 = outputs.right();
+    auto write = [&](const T& left, const T& right)
+    {
+        output_file1.write(left.start(), left.size());
+        output_file2.write(right.start(), right.size());
+    };
+    DedupCounts counts;
     if (unordered_flag)
+        counts = this->dedup_spilled(
+            [&](auto&& process) { return this->scanPE_unordered(infilename1.c_str(), infilename2.c_str(), process); }, write);
+    else
+        counts = this->dedup_spilled(
+            [&](auto&& process) { return this->scanPE(infilename1.c_str(), infilename2.c_str(), process); }, write);
+    if (m_verbose)
     {
-        this->impl_filterPE_unordered(infilename1.c_str(),
-                                      infilename2.c_str(),
-                                      outfile1.c_str(),
-                                      outfile2.c_str());
-    } else {
-        this->impl_filterPE(infilename1.c_str(),
-                            infilename2.c_str(),
-                            outfile1.c_str(),
-                            outfile2.c_str());
+        std::cout << counts.records << (unordered_flag ? " valid" : "") << " read pairs processed, out of which "
+                  << counts.duplicates << " duplicates were removed.\n";
+        if (unordered_flag)
+            std::cout << counts.unmatched << " Non-matching entries from both files were skipped.\n";
     }
 }
 
 template<class T>
-void HashDupRemover<T>::impl_filterPE(const char* infile1,
+bool HashDupRemover<T>::impl_filterPE(const char* infile1,
                                       const char* infile2,
                                       const char* outfile1,
                                       const char* outfile2)
 {
+    RunStats::Phase phase("hash dedup");
     // std::unique_ptr<FileUtils::I_OutputFile> output_file1{FileUtils::openOutputFile(outfile1)};
     // std::unique_ptr<FileUtils::I_OutputFile> output_file2{FileUtils::openOutputFile(outfile2)};
-    FileUtils::UniversalOutputFile output_file1{outfile1};
-    FileUtils::UniversalOutputFile output_file2{outfile2};
+    FileUtils::PairedOutputFile outputs{outfile1, outfile2};
+    FileUtils::UniversalOutputFile& output_file1 = outputs.left();
+    FileUtils::UniversalOutputFile& output_file2 = outputs.right();
 
-    T left, right;
-    paired_hashed_set records;
-    records.reserve(ONE_MIL);  // TODO optimize this value?
-    BufferedInput<T> left_buffer(5L * constants::HUNDRED_MB), right_buffer(5L * constants::HUNDRED_MB);
+    KeySet records;
+    this->presize(records);
+    std::vector<uint64_t> key;
     size_t tot_reads = 0ul, dup_reads = 0ul;
+    uint64_t processed = 0ul;
+    bool exhausted = false;
 
-    left_buffer.set_file(infile1);
-    right_buffer.set_file(infile2);
-    left = left_buffer.next();
-    right = right_buffer.next();
-    tot_reads++;
-
-    // output_file1->write(left.start(), left.size());
-    // output_file2->write(right.start(), right.size());
-    output_file1.write(left.start(), left.size());
-    output_file2.write(right.start(), right.size());
-    records.insert(
-        std::move(
-            setRecordPair(left.seq(), left.seq_len()-1,
-                          right.seq(), right.seq_len()-1)
-        )
-    );
-
-    while (!left_buffer.eof() && !right_buffer.eof())
+    this->scanPE(infile1, infile2, [&](const T& left, const T& right)
     {
-        while (!left_buffer.block_end() && !right_buffer.block_end())
+        encode(key, left, right);
+        tot_reads++;
+        KeySet::Result result = records.insert(key.data(), key.size());
+        if (result == KeySet::Result::FULL)
         {
-            left = left_buffer.next();
-            right = right_buffer.next();
-            setRecordPair record(left.seq(), left.seq_len()-1,
-                                 right.seq(), right.seq_len()-1);
-            tot_reads++;
-            auto it = records.find(record);
-            if (it == records.end())
-            {
-                // output_file1->write(left.start(), left.size());
-                // output_file2->write(right.start(), right.size());
-                output_file1.write(left.start(), left.size());
-                output_file2.write(right.start(), right.size());
-                records.insert(std::move(record));
-            } else {
-                dup_reads++;
-            }
+            exhausted = true;
+            return false;
         }
-        left_buffer.refresh();
-        right_buffer.refresh();
+        if (result == KeySet::Result::INSERTED)
+        {
+            // output_file1->write(left.start(), left.size());
+            // output_file2->write(right.start(), right.size());
+            output_file1.write(left.start(), left.size());
+            output_file2.write(right.start(), right.size());
+        } else {
+            dup_reads++;
+        }
+        processed += left.size();
+        return true;
+    });
+    if (exhausted)
+    {
+        this->start_spill(infile1, processed);
+        return false;
     }
 
+    phase.set("records", tot_reads);
+    phase.set("duplicates", dup_reads);
     if (m_verbose)
         std::cout << tot_reads << " read pairs processed, out of which " << dup_reads << " duplicates were removed.\n";
+    return true;
 }
 
 template<class T>
-void HashDupRemover<T>::impl_filterPE_unordered(const char* infile1,
+bool HashDupRemover<T>::impl_filterPE_unordered(const char* infile1,
                                                 const char* infile2,
                                                 const char* outfile1,
                                                 const char* outfile2)
 {
+    RunStats::Phase phase("hash dedup");
     // std::unique_ptr<FileUtils::I_OutputFile> output_file1{FileUtils::openOutputFile(outfile1)};
     // std::unique_ptr<FileUtils::I_OutputFile> output_file2{FileUtils::openOutputFile(outfile2)};
-    FileUtils::UniversalOutputFile output_file1{outfile1};
-    FileUtils::UniversalOutputFile output_file2{outfile2};
+    FileUtils::PairedOutputFile outputs{outfile1, outfile2};
+    FileUtils::UniversalOutputFile& output_file1 = outputs.left();
+    FileUtils::UniversalOutputFile& output_file2 = outputs.right();
 
-    T left, right;
-    paired_hashed_set records;
-    records.reserve(ONE_MIL);  // TODO optimize this value?
-    BufferedInput<T> left_buffer(5L * constants::HUNDRED_MB), right_buffer(5L * constants::HUNDRED_MB);
-    size_t tot_reads = 0ul, dup_reads = 0ul, unmatch_reads = 0ul;
+    KeySet records;
+    this->presize(records);
+    std::vector<uint64_t> key;
+    size_t tot_reads = 0ul, dup_reads = 0ul;
+    uint64_t processed = 0ul;
+    bool exhausted = false;
 
+    size_t unmatch_reads = this->scanPE_unordered(infile1, infile2, [&](const T& left, const T& right)
+    {
+        // tags are equal, we can proceed
+        encode(key, left, right);
+        tot_reads++;
+        KeySet::Result result = records.insert(key.data(), key.size());
+        if (result == KeySet::Result::FULL)
+        {
+            exhausted = true;
+            return false;
+        }
+        if (result == KeySet::Result::INSERTED)
+        {
+            // output_file1->write(left.start(), left.size());
+            // output_file2->write(right.start(), right.size());
+            output_file1.write(left.start(), left.size());
+            output_file2.write(right.start(), right.size());
+        } else {
+            dup_reads++;
+        }
+        processed += left.size();
+        return true;
+    });
+    if (exhausted)
+    {
+        this->start_spill(infile1, processed);
+        return false;
+    }
+
+    phase.set("records", tot_reads);
+    phase.set("duplicates", dup_reads);
+    if (m_verbose)
+    {
+        std::cout << tot_reads << " valid read pairs processed, out of which " << dup_reads << " duplicates were removed.\n";
+        std::cout << unmatch_reads << " Non-matching entries from both files were skipped.\n";
+    }
+    return true;
+}
+
+template<class T>
+template<class F>
+size_t HashDupRemover<T>::scanSE(const char* infile, F&& process)
+{
+    BufferedInput<T> buffer(this->buffer_size());
+    buffer.set_file(infile);
+    while (!buffer.eof())
+    {
+        while (!buffer.block_end())
+        {
+            T obj = buffer.next();
+            if (!process(obj))
+                return 0;
+        }
+        buffer.refresh();
+    }
+    return 0;
+}
+
+template<class T>
+template<class F>
+size_t HashDupRemover<T>::scanPE(const char* infile1, const char* infile2, F&& process)
+{
+    PairedBufferedInput<T> buffer(this->buffer_size());
+    buffer.set_files(infile1, infile2);
+    while (!buffer.eof())
+    {
+        while (!buffer.block_end())
+        {
+            RecordPair<T> pair = buffer.next();
+            if (!process(pair.left, pair.right))
+                return 0;
+        }
+        buffer.refresh();
+    }
+    return 0;
+}
+
+// Matches records of inputs sorted by read IDs, records without a mate are skipped
+template<class T>
+template<class F>
+size_t HashDupRemover<T>::scanPE_unordered(const char* infile1, const char* infile2, F&& process)
+{
+    BufferedInput<T> left_buffer(this->buffer_size()), right_buffer(this->buffer_size());
+    size_t unmatch_reads = 0ul;
     left_buffer.set_file(infile1);
     right_buffer.set_file(infile2);
-    left = left_buffer.next();
-    right = right_buffer.next();
+    if (left_buffer.eof() || right_buffer.eof())  // empty input
+        return 0;
+    T left = left_buffer.next();
+    T right = right_buffer.next();
+    // a record kept over refresh of its buffer is copied, since buffer contents are shifted
+    string left_copy, right_copy;
+    auto keep = [](T& obj, string& copy)
+    {
+        copy.assign(obj.start(), obj.size());
+        obj.read_new(copy.data(), copy.data() + copy.size());
+    };
 
     while (!left_buffer.eof() && !right_buffer.eof())
     {
@@ -289,59 +632,479 @@ void HashDupRemover<T>::impl_filterPE_unordered(const char* infile1,
                 right = right_buffer.next();
                 unmatch_reads++;
             } else {
-                // tags are equal, we can proceed
-                setRecordPair record(left.seq(), left.seq_len()-1,
-                                 right.seq(), right.seq_len()-1);
-                tot_reads++;
-                auto it = records.find(record);
-                if (it == records.end())
-                {
-                    // output_file1->write(left.start(), left.size());
-                    // output_file2->write(right.start(), right.size());
-                    output_file1.write(left.start(), left.size());
-                    output_file2.write(right.start(), right.size());
-                    records.insert(std::move(record));
-                } else {
-                    dup_reads++;
-                }
+                if (!process(left, right))
+                    return unmatch_reads;
                 left = left_buffer.next();
                 right = right_buffer.next();
             }
         }
         if (left_buffer.block_end())
+        {
+            keep(left, left_copy);
             left_buffer.refresh();
+        }
         if (right_buffer.block_end())
+        {
+            keep(right, right_copy);
             right_buffer.refresh();
+        }
     }
 
     // check 2 last records
     int cmp = left.cmp(right);
-    if (cmp < 0)
-    {
-        left = left_buffer.next();
-        unmatch_reads++;
-    } else if (cmp > 0) {
-        right = right_buffer.next();
+    if (cmp != 0)
         unmatch_reads++;
+    else
+        process(left, right);
+    return unmatch_reads;
+}
+
+// Prepares spilled deduplication: number of partitions is estimated from the share of input
+// processed before memory budget was exhausted
+template<class T>
+void HashDupRemover<T>::start_spill(const char* infile, uint64_t processed)
+{
+    uintmax_t expected_size = 0;
+    if (!FileUtils::isStdStream(infile))
+        expected_size = FS::file_size(infile) * (FileUtils::isCompressed(infile) ? 4 : 1);
+    m_spill_parts = std::clamp<size_t>(2 * expected_size / std::max<uint64_t>(processed, 1ul) + 1, 2ul, MAX_SPILL_PARTS);
+    if (m_verbose)
+        std::cout << boost::format("Hash table does not fit into memory limit, deduplication is started over with %1% partitions.\n")
+            % m_spill_parts;
+}
+
+// Memory of a discarded hash table is returned to the system, otherwise it stays in the heap as freed small blocks
+template<class T>
+void HashDupRemover<T>::trim_heap()
+{
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+}
+
+// Spilled deduplication reads input twice
+template<class T>
+void HashDupRemover<T>::check_spill(const string& infile) const
+{
+    trim_heap();
+    if (FileUtils::isStdStream(infile.c_str()))
+    {
+        std::cerr << "Unique reads of standard input do not fit into memory limit.\n";
+        throw std::runtime_error("Memory limit is too low for standard input, please use --stream mode or increase --mem-limit value!");
+    }
+}
+
+// Mixes hash with partitioning level, so that partitions of each level are independent of each other and of hash table buckets
+template<class T>
+size_t HashDupRemover<T>::partition(size_t hash, uint level, size_t num_parts)
+{
+    uint64_t value = hash + (level + 1) * 0x9e3779b97f4a7c15ul;
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ul;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111ebul;
+    return (value ^ (value >> 31)) % num_parts;
+}
+
+template<class T>
+void HashDupRemover<T>::write_key(std::ostream& output, uint64_t idx, const std::vector<uint64_t>& key)
+{
+    uint64_t header[2] = {idx, key.size()};
+    output.write(reinterpret_cast<const char*>(header), sizeof(header));
+    output.write(reinterpret_cast<const char*>(key.data()), key.size() * sizeof(uint64_t));
+}
+
+template<class T>
+bool HashDupRemover<T>::read_key(std::istream& input, uint64_t& idx, std::vector<uint64_t>& key)
+{
+    uint64_t header[2];
+    if (!input.read(reinterpret_cast<char*>(header), sizeof(header)))
+        return false;
+    idx = header[0];
+    key.resize(header[1]);
+    return static_cast<bool>(input.read(reinterpret_cast<char*>(key.data()), key.size() * sizeof(uint64_t)));
+}
+
+template<class T>
+template<class Scan, class Write>
+typename HashDupRemover<T>::DedupCounts HashDupRemover<T>::dedup_spilled(Scan&& scan, Write&& write)
+{
+    DedupCounts counts;
+    std::vector<string> names;
+    {
+        RunStats::Phase phase("hash dedup: partition");
+        std::vector<std::unique_ptr<std::ofstream>> parts;
+        for (size_t i = 0; i < m_spill_parts; ++i)
+        {
+            names.push_back(m_tempdir->unique_name("keys"));
+            parts.push_back(std::make_unique<std::ofstream>(names.back(), std::ios_base::binary));
+            check_fstream_ok<std::ofstream>(*parts.back(), names.back().c_str());
+        }
+        std::vector<uint64_t> key;
+        // keys are stored with record numbers
+        scan([&](const auto&... objs)
+        {
+            encode(key, objs...);
+            write_key(*parts[partition(KeySet::hash(key.data(), key.size()), 0, m_spill_parts)], counts.records++, key);
+            return true;
+        });
+        for (auto& output: parts)
+        {
+            RunStats::instance().add(RunStats::TEMP_WRITTEN, static_cast<std::streamoff>(output->tellp()));
+            output->close();
+            if (!*output)
+                throw std::runtime_error("Could not write temporary file!");
+        }
+        phase.set("partitions", m_spill_parts);
+        phase.set("records", counts.records);
+    }
+
+    // first occurrences of keys are marked
+    MemoryBudget::Reservation bitmap_memory(counts.records / 8 + 1, counts.records / 8 + 1);
+    std::vector<bool> first(counts.records);
+    for (auto& name: names)
+        this->dedup_partition(name, first, 1);
+
+    RunStats::Phase phase("hash dedup: output");
+    uint64_t idx = 0;
+    counts.unmatched = scan([&](const auto&... objs)
+    {
+        if (first[idx++])
+            write(objs...);
+        else
+            counts.duplicates++;
+        return true;
+    });
+    phase.set("records", counts.records);
+    phase.set("duplicates", counts.duplicates);
+    return counts;
+}
+
+// Marks first occurrences of keys of a partition file, which is split further if it does not fit into memory budget
+template<class T>
+void HashDupRemover<T>::dedup_partition(const string& name, std::vector<bool>& first, uint level)
+{
+    {
+        RunStats::Phase phase("hash dedup");
+        KeySet keys;
+        std::ifstream input(name, std::ios_base::binary);
+        check_fstream_ok<std::ifstream>(input, name.c_str());
+        uint64_t idx;
+        std::vector<uint64_t> key;
+        bool fits = true;
+        while (fits && read_key(input, idx, key))
+        {
+            KeySet::Result result = keys.insert(key.data(), key.size());
+            fits = (result != KeySet::Result::FULL);
+            if (result == KeySet::Result::INSERTED)
+                first[idx] = true;
+        }
+        phase.set("records", keys.size());
+        if (fits)
+        {
+            RunStats::instance().add(RunStats::TEMP_READ, FS::file_size(name));
+            FS::remove(name);
+            return;
+        }
+    }
+    if (level >= SPILL_DEPTH)
+    {
+        std::cerr << "Partition of " << FS::file_size(name) << " bytes does not fit into memory limit.\n";
+        throw std::runtime_error("Memory limit is too low, please increase --mem-limit value!");
+    }
+
+    // keys are split into smaller partitions, first occurrences marked so far stay valid
+    std::vector<string> names;
+    {
+        RunStats::Phase phase("hash dedup: partition");
+        std::vector<std::unique_ptr<std::ofstream>> parts;
+        for (size_t i = 0; i < SPILL_SPLIT; ++i)
+        {
+            names.push_back(m_tempdir->unique_name("keys"));
+            parts.push_back(std::make_unique<std::ofstream>(names.back(), std::ios_base::binary));
+            check_fstream_ok<std::ofstream>(*parts.back(), names.back().c_str());
+        }
+        std::ifstream input(name, std::ios_base::binary);
+        check_fstream_ok<std::ifstream>(input, name.c_str());
+        uint64_t idx;
+        std::vector<uint64_t> key;
+        while (read_key(input, idx, key))
+            write_key(*parts[partition(KeySet::hash(key.data(), key.size()), level, SPILL_SPLIT)], idx, key);
+        RunStats::instance().add(RunStats::TEMP_READ, FS::file_size(name));
+        for (auto& output: parts)
+        {
+            RunStats::instance().add(RunStats::TEMP_WRITTEN, static_cast<std::streamoff>(output->tellp()));
+            output->close();
+            if (!*output)
+                throw std::runtime_error("Could not write temporary file!");
+        }
+        phase.set("partitions", SPILL_SPLIT);
+    }
+    FS::remove(name);
+    for (auto& part: names)
+        this->dedup_partition(part, first, level + 1);
+}
+
+/*
+Hash join of unordered paired inputs: records of the first input are kept in memory, indexed by their ID tags,
+and the second input is streamed through, matching mates and deduplicating pairs on the fly.
+If the first input is not expected to fit into memory limit, both inputs are split into partitions by a hash
+of ID tags first (mates always meet in the same partition), and partitions are joined one by one.
+Output pairs follow the order of the second input (within each partition).
+Returns false if a partition does not fit into memory budget after all.
+*/
+template<class T>
+bool HashDupRemover<T>::impl_filterPE_hash_join(const char* infile1,
+                                                const char* infile2,
+                                                const char* outfile1,
+                                                const char* outfile2)
+{
+    FileUtils::PairedOutputFile outputs{outfile1, outfile2};
+    FileUtils::UniversalOutputFile& output_file1 = outputs.left();
+    FileUtils::UniversalOutputFile& output_file2 = outputs.right();
+    KeySet records;
+    this->presize(records);
+    JoinCounts counts;
+
+    // in-memory records take about twice the size of the file, decompressed data is assumed to be 4 times larger
+    uintmax_t expected_size = FS::file_size(infile1) * (FileUtils::isCompressed(infile1) ? 4 : 1);
+    size_t num_parts = 2 * expected_size / m_memlimit + 1;
+    if (num_parts == 1)
+    {
+        if (!this->join_mates(infile1, infile2, output_file1, output_file2, records, counts))
+            return false;
     } else {
-        setRecordPair record(left.seq(), left.seq_len()-1,
-                            right.seq(), right.seq_len()-1);
-        tot_reads++;
-        auto it = records.find(record);
-        if (it == records.end())
+        std::vector<string> parts1 = this->partition_by_id(infile1, num_parts, "join1");
+        std::vector<string> parts2 = this->partition_by_id(infile2, num_parts, "join2");
+        for (size_t i = 0; i < num_parts; ++i)
         {
-            // output_file1->write(left.start(), left.size());
-            // output_file2->write(right.start(), right.size());
-            output_file1.write(left.start(), left.size());
-            output_file2.write(right.start(), right.size());
-        } else {
-            dup_reads++;
+            bool joined = this->join_mates(parts1[i].c_str(), parts2[i].c_str(), output_file1, output_file2, records, counts);
+            FS::remove(parts1[i]);
+            FS::remove(parts2[i]);
+            if (!joined)
+            {
+                for (size_t j = i + 1; j < num_parts; ++j)
+                {
+                    FS::remove(parts1[j]);
+                    FS::remove(parts2[j]);
+                }
+                return false;
+            }
         }
     }
 
     if (m_verbose)
     {
-        std::cout << tot_reads << " valid read pairs processed, out of which " << dup_reads << " duplicates were removed.\n";
-        std::cout << unmatch_reads << " Non-matching entries from both files were skipped.\n";
+        if (num_parts > 1)
+            std::cout << "Inputs were split into " << num_parts << " partitions by read IDs.\n";
+        std::cout << counts.pairs << " valid read pairs processed, out of which " << counts.duplicates << " duplicates were removed.\n";
+        std::cout << counts.unmatched << " Non-matching entries from both files were skipped.\n";
+    }
+    return true;
+}
+
+// Splits input into files of num_parts partitions by a hash of ID tags
+template<class T>
+std::vector<string> HashDupRemover<T>::partition_by_id(const char* infile, size_t num_parts, const char* prefix)
+{
+    RunStats::Phase phase("hash join: partition");
+    std::vector<string> names;
+    std::vector<std::unique_ptr<FileUtils::UniversalOutputFile>> outputs;
+    for (size_t i = 0; i < num_parts; ++i)
+    {
+        names.push_back(m_tempdir->unique_name(prefix));
+        outputs.push_back(std::make_unique<FileUtils::UniversalOutputFile>(names.back().c_str()));
+    }
+    std::hash<std::string_view> id_hash;
+    BufferedInput<T> buffer(this->buffer_size());
+    buffer.set_file(infile);
+    while (!buffer.eof())
+    {
+        while (!buffer.block_end())
+        {
+            T obj = buffer.next();
+            outputs[id_hash(obj.id_tag()) % num_parts]->write(obj.start(), obj.size());
+        }
+        buffer.refresh();
+    }
+    phase.set("partitions", num_parts);
+    return names;
+}
+
+// Joins mates of two (partition) files, surviving pairs are added to records and written to outputs;
+// returns false if records do not fit into memory budget
+template<class T>
+bool HashDupRemover<T>::join_mates(const char* infile1,
+                                   const char* infile2,
+                                   FileUtils::UniversalOutputFile& output_file1,
+                                   FileUtils::UniversalOutputFile& output_file2,
+                                   KeySet& records,
+                                   JoinCounts& counts)
+{
+    RunStats::Phase phase("hash join");
+    JoinCounts start = counts;
+    // mates and arena are released after each partition, unlike records
+    MemoryBudget::Tracker mates_memory;
+    // records are copied out of input buffer, which is overwritten by refresh
+    std::vector<LargeBuffer> arena;
+    char* arena_pos = nullptr;
+    char* arena_end = nullptr;
+    std::unordered_map<std::string_view, T> mates;
+    {
+        BufferedInput<T> buffer(this->buffer_size());
+        buffer.set_file(infile1);
+        while (!buffer.eof())
+        {
+            while (!buffer.block_end())
+            {
+                T obj = buffer.next();
+                if (arena_end - arena_pos < obj.size())
+                {
+                    ssize_t block_size = std::max(ARENA_BLOCK_SIZE, obj.size());
+                    if (!mates_memory.add(block_size))
+                        return false;
+                    arena.emplace_back(block_size);
+                    arena_pos = static_cast<char*>(arena.back().data());
+                    arena_end = arena_pos + block_size;
+                }
+                memcpy(arena_pos, obj.start(), obj.size());
+                T copy;
+                copy.read_new(arena_pos, arena_pos + obj.size());
+                arena_pos += obj.size();
+                // only the first of records with equal IDs can be matched
+                if (!mates_memory.add(sizeof(T) + 6 * sizeof(void*)))
+                    return false;
+                if (!mates.emplace(copy.id_tag(), std::move(copy)).second)
+                    counts.unmatched++;
+            }
+            buffer.refresh();
+        }
     }
+
+    std::vector<uint64_t> key;
+    BufferedInput<T> buffer(this->buffer_size());
+    buffer.set_file(infile2);
+    while (!buffer.eof())
+    {
+        while (!buffer.block_end())
+        {
+            T right = buffer.next();
+            auto it = mates.find(right.id_tag());
+            if (it == mates.end())
+            {
+                counts.unmatched++;
+                continue;
+            }
+            const T& left = it->second;
+            counts.pairs++;
+            encode(key, left, right);
+            KeySet::Result result = records.insert(key.data(), key.size());
+            if (result == KeySet::Result::FULL)
+                return false;
+            if (result == KeySet::Result::INSERTED)
+            {
+                output_file1.write(left.start(), left.size());
+                output_file2.write(right.start(), right.size());
+            } else {
+                counts.duplicates++;
+            }
+            mates.erase(it);
+        }
+        buffer.refresh();
+    }
+    counts.unmatched += mates.size();
+    phase.set("records", counts.pairs - start.pairs);
+    phase.set("duplicates", counts.duplicates - start.duplicates);
+    return true;
+}
+
+/*
+Streaming deduplication: every read is written out as soon as the input available so far is processed,
+unless an identical read was seen among the most recent m_window distinct ones.
+Unlike other modes, memory usage is bounded (by both window size and memory limit),
+but duplicates that are further apart than the window are kept.
+*/
+
+template<class T>
+void HashDupRemover<T>::impl_filterSE_stream(const char* infilename,
+                                             const char* outfilename)
+{
+    RunStats::Phase phase("stream dedup");
+    FileUtils::UniversalOutputFile output_file{outfilename};
+    BufferedInput<T> buffer(STREAM_BLOCK_SIZE);
+    // the window grows within the rest of memory budget
+    RecentSet<setRecord, setRecordHash> recent(m_window);
+    size_t tot_reads = 0ul, dup_reads = 0ul;
+
+    // records are processed as soon as they arrive, blocks are not waited for
+    buffer.set_partial(1);
+    buffer.set_file(infilename);
+    while (!buffer.eof())
+    {
+        while (!buffer.block_end())
+        {
+            T obj = buffer.next();
+            tot_reads++;
+            if (recent.insert(setRecord(obj.seq(), obj.seq_len()-1), record_bytes(obj.seq_len()-1)))
+                output_file.write(obj.start(), obj.size());
+            else
+                dup_reads++;
+        }
+        output_file.flush();
+        buffer.refresh();
+    }
+    phase.set("records", tot_reads);
+    phase.set("duplicates", dup_reads);
+    this->report_stream(tot_reads, dup_reads, recent.evicted(), "reads");
+}
+
+template<class T>
+void HashDupRemover<T>::impl_filterPE_stream(const char* infile1,
+                                             const char* infile2,
+                                             const char* outfile1,
+                                             const char* outfile2)
+{
+    RunStats::Phase phase("stream dedup");
+    FileUtils::PairedOutputFile outputs{outfile1, outfile2};
+    FileUtils::UniversalOutputFile& output_file1 = outputs.left();
+    FileUtils::UniversalOutputFile& output_file2 = outputs.right();
+    PairedBufferedInput<T> buffer(STREAM_BLOCK_SIZE);
+    buffer.set_partial(true);
+    buffer.set_files(infile1, infile2);
+    // the window grows within the rest of memory budget
+    RecentSet<setRecordPair, setRecordPairHash> recent(m_window);
+    size_t tot_reads = 0ul, dup_reads = 0ul;
+
+    while (!buffer.eof())
+    {
+        while (!buffer.block_end())
+        {
+            RecordPair<T> pair = buffer.next();
+            const T& left = pair.left;
+            const T& right = pair.right;
+            tot_reads++;
+            setRecordPair record(left.seq(), left.seq_len()-1,
+                                 right.seq(), right.seq_len()-1);
+            if (recent.insert(std::move(record), record_bytes(left.seq_len()-1) + record_bytes(right.seq_len()-1)))
+            {
+                output_file1.write(left.start(), left.size());
+                output_file2.write(right.start(), right.size());
+            } else {
+                dup_reads++;
+            }
+        }
+        output_file1.flush();
+        output_file2.flush();
+        buffer.refresh();
+    }
+    phase.set("records", tot_reads);
+    phase.set("duplicates", dup_reads);
+    this->report_stream(tot_reads, dup_reads, recent.evicted(), "read pairs");
+}
+
+template<class T>
+void HashDupRemover<T>::report_stream(size_t tot_reads, size_t dup_reads, size_t evicted, const char* unit) const
+{
+    if (!m_verbose)
+        return;
+    std::cout << tot_reads << " " << unit << " processed, out of which " << dup_reads << " duplicates were removed.\n";
+    std::cout << evicted << " distinct " << unit << " were evicted from the window of recent ones.\n";
 }
@@ -0,0 +1,186 @@
+#pragma once
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "bufferedinput.hpp"
+#include "file_utils.hpp"
+#include "paired_external_sort.hpp"
+#include "sketch.hpp"
+
+/*
+Profile of input reads (read pairs) built from a sample of their first bytes: number of records,
+distinct sequences (counted by HyperLogLog) and mean sequence length.
+Values of a partial sample are extrapolated to the whole input by its size; compressed inputs are assumed
+to be 4 times smaller than their contents. The share of distinct reads is assumed to stay the same,
+which overestimates distinct reads of larger inputs, since duplicates become more frequent as input grows.
+*/
+struct InputProfile
+{
+    size_t records = 0ul;
+    size_t distinct = 0ul;
+    double seq_len = 0.0;           // mean sequence length (of both mates for pairs)
+    size_t sampled_records = 0ul;
+    uint64_t sampled_bytes = 0ul;
+    bool complete = true;           // the whole input was sampled
+};
+
+/*
+Sketches of duplication of reads (read pairs) in a single pass with fixed memory: HyperLogLog counts distinct
+sequences, while K minimum values sketch keeps a uniform sample of distinct sequences with their multiplicities.
+Values describe the sampled part of input, they are not extrapolated.
+*/
+struct DuplicationEstimate
+{
+    size_t records = 0ul;
+    uint64_t bytes = 0ul;
+    bool complete = true;           // all inputs were read to the end
+    HyperLogLog distinct;
+    KMinValues clusters;
+};
+
+namespace InputProfiler
+{
+    template<class T>
+    uint64_t seq_hash(const T& obj)
+    {
+        return std::hash<std::string_view>()(std::string_view(obj.seq(), obj.seq_len() - 1));
+    }
+
+    inline uint64_t pair_hash(uint64_t left, uint64_t right)
+    {
+        return left ^ Sketch::mix(right);
+    }
+
+    // second input of interleaved pairs is empty
+    inline uint64_t expected_size(const std::string& filename)
+    {
+        if (filename.empty())
+            return 0;
+        return FS::file_size(filename) * (FileUtils::isCompressed(filename.c_str()) ? 4 : 1);
+    }
+
+    // Calls process(record) for records of up to max_bytes (rounded up to input blocks) of input,
+    // returns false if reading stopped before the end of input
+    template<class T, class F>
+    bool scan(const std::string& infile, uint64_t max_bytes, F&& process)
+    {
+        uint64_t bytes = 0ul;
+        BufferedInput<T> buffer(std::min<uint64_t>(max_bytes, 64L * constants::ONE_MB));
+        buffer.set_file(infile.c_str());
+        while (!buffer.eof())
+        {
+            if (bytes >= max_bytes)
+                return false;
+            while (!buffer.block_end())
+            {
+                T obj = buffer.next();
+                bytes += obj.size();
+                process(obj);
+            }
+            buffer.refresh();
+        }
+        return true;
+    }
+
+    // Calls process(left, right) for read pairs of synchronized (or interleaved) inputs,
+    // up to max_bytes of the first input are read
+    template<class T, class F>
+    bool scan(const std::string& infile1, const std::string& infile2, uint64_t max_bytes, F&& process)
+    {
+        uint64_t bytes = 0ul;
+        PairedBufferedInput<T> buffer(std::min<uint64_t>(max_bytes, 64L * constants::ONE_MB));
+        buffer.set_files(infile1.c_str(), infile2.c_str());
+        while (!buffer.eof())
+        {
+            if (bytes >= max_bytes)
+                return false;
+            while (!buffer.block_end())
+            {
+                RecordPair<T> pair = buffer.next();
+                bytes += pair.left.size() + (infile2.empty() ? pair.right.size() : 0);
+                process(pair.left, pair.right);
+            }
+            buffer.refresh();
+        }
+        return true;
+    }
+
+    inline void extrapolate(InputProfile& profile, const HyperLogLog& sketch, double seq_len, uint64_t total_bytes)
+    {
+        profile.distinct = static_cast<size_t>(sketch.estimate());
+        profile.records = profile.sampled_records;
+        if (profile.sampled_records > 0)
+            profile.seq_len = seq_len / profile.sampled_records;
+        if (!profile.complete && (profile.sampled_bytes > 0))
+        {
+            double scale = std::max(1.0, static_cast<double>(total_bytes) / profile.sampled_bytes);
+            profile.records = static_cast<size_t>(profile.sampled_records * scale);
+            profile.distinct = static_cast<size_t>(profile.distinct * scale);
+        }
+        profile.distinct = std::min(profile.distinct, profile.records);
+    }
+
+    // Profile of single reads, up to max_bytes are sampled
+    template<class T>
+    InputProfile profile(const std::string& infile, uint64_t max_bytes)
+    {
+        InputProfile result;
+        HyperLogLog sketch;
+        double seq_len = 0.0;
+        result.complete = scan<T>(infile, max_bytes, [&](const T& obj)
+        {
+            sketch.add(seq_hash(obj));
+            seq_len += obj.seq_len() - 1;
+            result.sampled_records++;
+            result.sampled_bytes += obj.size();
+        });
+        extrapolate(result, sketch, seq_len, expected_size(infile));
+        return result;
+    }
+
+    // Profile of read pairs of synchronized inputs, up to max_bytes of each input are sampled
+    template<class T>
+    InputProfile profile(const std::string& infile1, const std::string& infile2, uint64_t max_bytes)
+    {
+        InputProfile result;
+        HyperLogLog sketch;
+        double seq_len = 0.0;
+        result.complete = scan<T>(infile1, infile2, max_bytes, [&](const T& left, const T& right)
+        {
+            sketch.add(pair_hash(seq_hash(left), seq_hash(right)));
+            seq_len += left.seq_len() + right.seq_len() - 2;
+            result.sampled_records++;
+            result.sampled_bytes += left.size() + right.size();
+        });
+        extrapolate(result, sketch, seq_len, expected_size(infile1) + expected_size(infile2));
+        return result;
+    }
+
+    // Duplication of reads of all inputs (lanes) taken together, up to max_bytes of every (first) input are read;
+    // read pairs are estimated if second inputs are given
+    template<class T>
+    DuplicationEstimate estimate(const std::vector<std::string>& inputs1, const std::vector<std::string>& inputs2, uint64_t max_bytes)
+    {
+        DuplicationEstimate result;
+        auto add = [&](uint64_t hash, uint64_t bytes)
+        {
+            result.distinct.add(hash);
+            result.clusters.add(hash);
+            result.records++;
+            result.bytes += bytes;
+        };
+        for (size_t i = 0; i < inputs1.size(); ++i)
+        {
+            bool complete;
+            if (inputs2.empty())
+                complete = scan<T>(inputs1[i], max_bytes, [&](const T& obj) { add(seq_hash(obj), obj.size()); });
+            else
+                complete = scan<T>(inputs1[i], inputs2[i], max_bytes, [&](const T& left, const T& right)
+                    { add(pair_hash(seq_hash(left), seq_hash(right)), left.size() + right.size()); });
+            result.complete = result.complete && complete;
+        }
+        return result;
+    }
+}
@@ -0,0 +1,172 @@
+#include "key_set.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <sys/mman.h>
+
+namespace
+{
+    const size_t HUGE_PAGE_SIZE = 2ul * 1024ul * 1024ul;
+}
+
+LargeBuffer::LargeBuffer(size_t size)
+{
+    m_data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m_data == MAP_FAILED)
+    {
+        m_data = nullptr;
+        throw std::bad_alloc();
+    }
+    m_size = size;
+#ifdef MADV_HUGEPAGE
+    if (size >= HUGE_PAGE_SIZE)
+        madvise(m_data, size, MADV_HUGEPAGE);  // only a hint, failure is harmless
+#endif
+}
+
+LargeBuffer& LargeBuffer::operator=(LargeBuffer&& other)
+{
+    if (this != &other)
+    {
+        this->reset();
+        std::swap(m_data, other.m_data);
+        std::swap(m_size, other.m_size);
+    }
+    return *this;
+}
+
+void LargeBuffer::reset()
+{
+    if (m_data)
+        munmap(m_data, m_size);
+    m_data = nullptr;
+    m_size = 0;
+}
+
+uint64_t KeySet::hash(const uint64_t* key, size_t words)
+{
+    uint64_t result = words * 0x9e3779b97f4a7c15ul;
+    for (size_t i = 0; i < words; ++i)
+    {
+        result = (result ^ key[i]) * 0xbf58476d1ce4e5b9ul;
+        result ^= result >> 31;
+    }
+    result *= 0x94d049bb133111ebul;
+    return result ^ (result >> 29);
+}
+
+size_t KeySet::expected_memory(size_t keys, double words)
+{
+    // table is 3/8 to 3/4 full, keys are packed in the arena
+    return static_cast<size_t>(keys * (words * sizeof(uint64_t) + 2 * sizeof(Slot)));
+}
+
+const uint64_t* KeySet::key_at(uint64_t ref) const
+{
+    size_t block = (ref >> OFFSET_BITS) & ((1ul << BLOCK_BITS) - 1);
+    size_t offset = ref & ((1ul << OFFSET_BITS) - 1);
+    return static_cast<const uint64_t*>(m_blocks[block].data()) + offset;
+}
+
+KeySet::Slot* KeySet::find(const uint64_t* key, size_t words, uint64_t hash) const
+{
+    Slot* slots = static_cast<Slot*>(m_table.data());
+    for (size_t idx = hash & m_mask; ; idx = (idx + 1) & m_mask)
+    {
+        Slot* slot = slots + idx;
+        if ((slot->ref == 0)
+            || ((slot->hash == hash) && (words_of(slot->ref) == words)
+                && (memcmp(this->key_at(slot->ref), key, words * sizeof(uint64_t)) == 0)))
+            return slot;
+    }
+}
+
+// Copies key to the arena, a new block is started if it does not fit into the last one
+bool KeySet::store(const uint64_t* key, size_t words, uint64_t& ref)
+{
+    if ((words == 0) || (words >= (1ul << (64 - BLOCK_BITS - OFFSET_BITS))))
+        throw std::runtime_error("Unsupported size of hash key!");
+    if (m_blocks.empty() || (m_block_used + words > m_blocks.back().size() / sizeof(uint64_t)))
+    {
+        if (m_blocks.size() == (1ul << BLOCK_BITS))
+            return false;
+        // blocks grow with the set, so that small sets stay small
+        size_t block_words = m_blocks.empty() ? MIN_BLOCK_WORDS
+                                              : std::min(2 * m_blocks.back().size() / sizeof(uint64_t), MAX_BLOCK_WORDS);
+        block_words = std::max(block_words, words);
+        if (!m_memory.add(block_words * sizeof(uint64_t)))
+        {
+            m_memory.sub(block_words * sizeof(uint64_t));
+            return false;
+        }
+        m_blocks.emplace_back(block_words * sizeof(uint64_t));
+        m_block_used = 0;
+    }
+    uint64_t* dest = static_cast<uint64_t*>(m_blocks.back().data()) + m_block_used;
+    memcpy(dest, key, words * sizeof(uint64_t));
+    ref = (static_cast<uint64_t>(words) << (BLOCK_BITS + OFFSET_BITS))
+        | (static_cast<uint64_t>(m_blocks.size() - 1) << OFFSET_BITS) | m_block_used;
+    m_block_used += words;
+    return true;
+}
+
+// Moves slots to a table of given capacity (a power of 2)
+bool KeySet::resize(size_t capacity)
+{
+    if (!m_memory.add(capacity * sizeof(Slot)))
+    {
+        m_memory.sub(capacity * sizeof(Slot));
+        return false;
+    }
+    LargeBuffer table(capacity * sizeof(Slot));
+    Slot* slots = static_cast<Slot*>(table.data());
+    size_t mask = capacity - 1;
+    Slot* old_slots = static_cast<Slot*>(m_table.data());
+    for (size_t i = 0; i < m_table.size() / sizeof(Slot); ++i)
+    {
+        if (old_slots[i].ref == 0)
+            continue;
+        size_t idx = old_slots[i].hash & mask;
+        while (slots[idx].ref != 0)
+            idx = (idx + 1) & mask;
+        slots[idx] = old_slots[i];
+    }
+    m_memory.sub(m_table.size());
+    m_table = std::move(table);
+    m_mask = mask;
+    return true;
+}
+
+bool KeySet::reserve(size_t keys)
+{
+    size_t capacity = MIN_CAPACITY;
+    while (capacity * 3 < keys * 4)
+        capacity *= 2;
+    return (capacity <= m_mask + 1) || this->resize(capacity);
+}
+
+KeySet::Result KeySet::insert(const uint64_t* key, size_t words, uint64_t hash)
+{
+    if (!m_table.data() && !this->resize(MIN_CAPACITY))
+        return Result::FULL;
+    Slot* slot = this->find(key, words, hash);
+    if (slot->ref != 0)
+        return Result::FOUND;
+
+    // table is kept at most 3/4 full
+    if ((m_size + 1) * 4 > (m_mask + 1) * 3)
+    {
+        if (!this->resize(2 * (m_mask + 1)))
+            return Result::FULL;
+        slot = this->find(key, words, hash);
+    }
+    uint64_t ref;
+    if (!this->store(key, words, ref))
+        return Result::FULL;
+    slot->hash = hash;
+    slot->ref = ref;
+    m_size++;
+    return Result::INSERTED;
+}
@@ -0,0 +1,72 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "memory_budget.hpp"
+
+/*
+Large buffer mapped from the system directly: it is zero-filled, returned to the system at once on destruction
+instead of fragmenting the heap, and backed by transparent huge pages where supported, which reduces TLB misses.
+*/
+class LargeBuffer
+{
+public:
+    LargeBuffer() {}
+    explicit LargeBuffer(size_t);
+    LargeBuffer(LargeBuffer&& other) : m_data(other.m_data), m_size(other.m_size)  { other.m_data = nullptr; other.m_size = 0; }
+    LargeBuffer& operator=(LargeBuffer&&);
+    LargeBuffer(const LargeBuffer&) = delete;
+    LargeBuffer& operator=(const LargeBuffer&) = delete;
+    ~LargeBuffer()                              { this->reset(); }
+    inline void* data()                 const   { return m_data; }
+    inline size_t size()                const   { return m_size; }
+    void reset();
+private:
+    void* m_data = nullptr;
+    size_t m_size = 0;
+};
+
+/*
+Set of keys given as arrays of 64-bit words (e.g. sequences encoded by SeqUtils::seq2hash).
+Keys are copied one after another to large arena blocks, while an open addressing table (linear probing)
+holds their hashes and positions in the arena. So the set takes a few large allocations instead of two per key,
+and all of them are released in bulk. Memory is drawn from MemoryBudget: an insertion that does not fit
+into the budget fails and leaves the set unchanged.
+*/
+class KeySet
+{
+public:
+    enum class Result { INSERTED, FOUND, FULL };
+    KeySet() {}
+    // Sizes table for the expected number of keys, returns false if the budget does not allow it
+    bool reserve(size_t);
+    Result insert(const uint64_t* key, size_t words)            { return this->insert(key, words, hash(key, words)); }
+    Result insert(const uint64_t* key, size_t words, uint64_t hash);
+    inline size_t size()                        const   { return m_size; }
+    // memory taken by arena and table
+    inline size_t memory()                      const   { return m_memory.used(); }
+    static uint64_t hash(const uint64_t* key, size_t words);
+    // Expected memory of a set of keys of given mean size in words
+    static size_t expected_memory(size_t keys, double words);
+private:
+    struct Slot
+    {
+        uint64_t hash;
+        uint64_t ref;  // number of words and position of a key in the arena, 0 for empty slots
+    };
+    const uint64_t* key_at(uint64_t ref)        const;
+    static inline size_t words_of(uint64_t ref)         { return ref >> (BLOCK_BITS + OFFSET_BITS); }
+    bool store(const uint64_t* key, size_t words, uint64_t& ref);
+    bool resize(size_t capacity);
+    Slot* find(const uint64_t* key, size_t words, uint64_t hash) const;
+private:
+    // key references: words (20 bits), block index (18 bits), offset in block (26 bits)
+    static const int BLOCK_BITS = 18, OFFSET_BITS = 26;
+    static constexpr size_t MIN_BLOCK_WORDS = 1ul << 17, MAX_BLOCK_WORDS = 1ul << 23;  // 1MB to 64MB
+    static const size_t MIN_CAPACITY = 1024ul;
+    std::vector<LargeBuffer> m_blocks;
+    size_t m_block_used = 0ul;  // words taken in the last block
+    LargeBuffer m_table;
+    size_t m_mask = 0ul, m_size = 0ul;
+    MemoryBudget::Tracker m_memory;
+};
@@ -0,0 +1,167 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include "seq_utils.hpp"
+
+/*
+Compact sort key of a single record (N = 1) or a pair of records (N = 2):
+packed sequence(s) accompanied with location of record(s) in source file(s).
+
+Binary layout:
+    N x uint64 record offset | N x uint32 record size | N x uint32 number of packed codes | N x packed sequence
+Number of codes equals sequence length unless the sequence has characters other than A, C, G, N, T.
+
+Keys compare in the same order as respective records do (by sequences),
+records with equal sequences are ordered by their position in source file.
+*/
+template<int N>
+class KeyView
+{
+public:
+    // binary records are not split into lines
+    static const int LINES_PER_RECORD = 0;
+    static const ssize_t HEADER_SIZE = N * (sizeof(uint64_t) + 2 * sizeof(uint32_t));
+
+    KeyView() {}
+    KeyView(const KeyView& other) : m_data(other.m_data), m_size(other.m_size) {}
+    KeyView(KeyView&& other) : m_data(other.m_data), m_size(other.m_size) { other.clear(); }
+    KeyView& operator=(KeyView&& other);
+    void clear()                            { m_data = nullptr; m_size = 0; }
+    bool isEmpty()                  const   { return (m_data == nullptr); }
+    inline ssize_t size()           const   { return m_size; }
+    inline const char* start()      const   { return m_data; }
+    uint64_t offset(int i)          const   { return this->field<uint64_t>(i * sizeof(uint64_t)); }
+    uint32_t record_len(int i)      const   { return this->field<uint32_t>(N * sizeof(uint64_t) + i * sizeof(uint32_t)); }
+    uint32_t codes(int i)           const   { return this->field<uint32_t>(N * (sizeof(uint64_t) + sizeof(uint32_t)) + i * sizeof(uint32_t)); }
+    // seq must have room for codes(i) characters, returns sequence length
+    ssize_t unpack(int i, char* seq) const  { return SeqUtils::unpackSeq(seq, this->packed(i), this->codes(i)); }
+    int cmp(const KeyView& other) const;
+    std::streamsize read_new(char*, char*);
+    static ssize_t full_size(const char*);
+    template<class T>
+    static void save(std::ostream&, const T* const*, const uint64_t*, std::string&);
+
+    friend bool operator>(const KeyView& left, const KeyView& right)    { return (left.cmp(right) > 0); }
+    friend bool operator<(const KeyView& left, const KeyView& right)    { return (left.cmp(right) < 0); }
+    friend std::ostream& operator<<(std::ostream& os, const KeyView& key)
+    {
+        os.write(key.m_data, key.m_size);
+        return os;
+    }
+private:
+    template<class F>
+    F field(ssize_t pos) const
+    {   // keys are not aligned in buffer
+        F value;
+        memcpy(&value, m_data + pos, sizeof(F));
+        return value;
+    }
+    const char* packed(int i) const;
+private:
+    char* m_data = nullptr;
+    ssize_t m_size = 0;
+};
+
+template<int N>
+KeyView<N>& KeyView<N>::operator=(KeyView<N>&& other)
+{
+    if (this != &other)
+    {
+        m_data = other.m_data;
+        m_size = other.m_size;
+        other.clear();
+    }
+    return *this;
+}
+
+template<int N>
+const char* KeyView<N>::packed(int i) const
+{
+    const char* ptr = m_data + HEADER_SIZE;
+    for (int j = 0; j < i; ++j)
+        ptr += SeqUtils::packedLen(this->codes(j));
+    return ptr;
+}
+
+template<int N>
+int KeyView<N>::cmp(const KeyView<N>& other) const
+{
+    for (int i = 0; i < N; ++i)
+    {
+        ssize_t len = SeqUtils::packedLen(this->codes(i));
+        ssize_t other_len = SeqUtils::packedLen(other.codes(i));
+        int res = memcmp(this->packed(i), other.packed(i), std::min(len, other_len));
+        if (res != 0)
+            return res;
+        // packed sequence is a prefix of another one
+        if (len != other_len)
+            return (len < other_len) ? -1 : 1;
+    }
+    // same sequences -> keep order of appearance
+    uint64_t pos = this->offset(0), other_pos = other.offset(0);
+    if (pos != other_pos)
+        return (pos < other_pos) ? -1 : 1;
+    return 0;
+}
+
+template<int N>
+std::streamsize KeyView<N>::read_new(char* start, char* stop)
+{   // try to map char* buffer to self, return -1 if buffer end is encountered prematurely
+    if (stop - start < HEADER_SIZE) { this->clear(); return -1; }
+    m_data = start;
+    m_size = full_size(start);
+    if (stop - start < m_size) { this->clear(); return -1; }
+    return m_size;
+}
+
+// Size of a key given its fixed-size header
+template<int N>
+ssize_t KeyView<N>::full_size(const char* header)
+{
+    ssize_t size = HEADER_SIZE;
+    for (int i = 0; i < N; ++i)
+    {
+        uint32_t codes;
+        memcpy(&codes, header + N * (sizeof(uint64_t) + sizeof(uint32_t)) + i * sizeof(uint32_t), sizeof(uint32_t));
+        size += SeqUtils::packedLen(codes);
+    }
+    return size;
+}
+
+// Writes key of record(s) to stream; buf is used as a temporary storage
+template<int N>
+template<class T>
+void KeyView<N>::save(std::ostream& os,
+                      const T* const* records,
+                      const uint64_t* offsets,
+                      std::string& buf)
+{
+    uint32_t codes[N];
+    ssize_t size = HEADER_SIZE;
+    for (int i = 0; i < N; ++i)
+    {
+        codes[i] = SeqUtils::packedCodes(records[i]->seq(), records[i]->seq_len() - 1);  // skip newline
+        size += SeqUtils::packedLen(codes[i]);
+    }
+    buf.resize(size);
+
+    char* ptr = buf.data();
+    for (int i = 0; i < N; ++i, ptr += sizeof(uint64_t))
+        memcpy(ptr, offsets + i, sizeof(uint64_t));
+    for (int i = 0; i < N; ++i, ptr += sizeof(uint32_t))
+    {
+        uint32_t record_len = records[i]->size();
+        memcpy(ptr, &record_len, sizeof(uint32_t));
+    }
+    for (int i = 0; i < N; ++i, ptr += sizeof(uint32_t))
+        memcpy(ptr, codes + i, sizeof(uint32_t));
+    for (int i = 0; i < N; ++i)
+    {
+        SeqUtils::packSeq(ptr, records[i]->seq(), records[i]->seq_len() - 1);
+        ptr += SeqUtils::packedLen(codes[i]);
+    }
+    os.write(buf.data(), size);
+}
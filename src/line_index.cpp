@@ -0,0 +1,128 @@
+#include "line_index.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LINE_INDEX_X86
+#endif
+
+namespace
+{
+    void scan_scalar(std::vector<char*>& newlines, char* ptr, char* stop)
+    {
+        while ((ptr = (char*)memchr(ptr, '\n', stop - ptr)) != nullptr)
+            newlines.push_back(ptr++);
+    }
+
+    size_t count_scalar(const char* ptr, const char* stop)
+    {
+        return std::count(ptr, stop, '\n');
+    }
+
+#ifdef LINE_INDEX_X86
+    // each set bit of a comparison mask marks a newline
+    inline void push_mask(std::vector<char*>& newlines, char* ptr, uint32_t mask)
+    {
+        while (mask)
+        {
+            newlines.push_back(ptr + __builtin_ctz(mask));
+            mask &= mask - 1;
+        }
+    }
+
+    void scan_sse2(std::vector<char*>& newlines, char* ptr, char* stop)
+    {
+        const __m128i newline = _mm_set1_epi8('\n');
+        for (; ptr + 16 <= stop; ptr += 16)
+        {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr));
+            push_mask(newlines, ptr, _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline)));
+        }
+        scan_scalar(newlines, ptr, stop);
+    }
+
+    size_t count_sse2(const char* ptr, const char* stop)
+    {
+        const __m128i newline = _mm_set1_epi8('\n');
+        size_t count = 0;
+        for (; ptr + 16 <= stop; ptr += 16)
+        {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr));
+            count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(block, newline)));
+        }
+        return count + count_scalar(ptr, stop);
+    }
+
+    __attribute__((target("avx2")))
+    void scan_avx2(std::vector<char*>& newlines, char* ptr, char* stop)
+    {
+        const __m256i newline = _mm256_set1_epi8('\n');
+        for (; ptr + 32 <= stop; ptr += 32)
+        {
+            __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr));
+            push_mask(newlines, ptr, _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline)));
+        }
+        scan_sse2(newlines, ptr, stop);
+    }
+
+    __attribute__((target("avx2")))
+    size_t count_avx2(const char* ptr, const char* stop)
+    {
+        const __m256i newline = _mm256_set1_epi8('\n');
+        size_t count = 0;
+        for (; ptr + 32 <= stop; ptr += 32)
+        {
+            __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr));
+            count += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline)));
+        }
+        return count + count_sse2(ptr, stop);
+    }
+
+    // instruction set is chosen once at runtime, so that binary stays portable
+    bool has_avx2()
+    {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+    }
+    const bool use_avx2 = has_avx2();
+    const auto scan_window = use_avx2 ? scan_avx2 : scan_sse2;
+    const auto count_lines = use_avx2 ? count_avx2 : count_sse2;
+#else
+    const auto scan_window = scan_scalar;
+    const auto count_lines = count_scalar;
+#endif
+}
+
+// Number of newline characters in buffer
+size_t LineIndex::count(const char* start, const char* stop)
+{
+    return count_lines(start, stop);
+}
+
+void LineIndex::reset(char* start, char* stop)
+{
+    m_newlines.clear();
+    m_cur = 0;
+    m_scanned = start;
+    m_stop = stop;
+}
+
+// Makes sure that at least n newlines following the cursor are indexed,
+// returns false if buffer does not contain that many
+bool LineIndex::ensure(size_t n)
+{
+    while (m_newlines.size() - m_cur < n)
+    {
+        if (m_scanned >= m_stop)
+            return false;
+        // drop consumed positions so that index stays small
+        m_newlines.erase(m_newlines.begin(), m_newlines.begin() + m_cur);
+        m_cur = 0;
+        char* window_end = (m_stop - m_scanned > WINDOW_SIZE) ? m_scanned + WINDOW_SIZE : m_stop;
+        scan_window(m_newlines, m_scanned, window_end);
+        m_scanned = window_end;
+    }
+    return true;
+}
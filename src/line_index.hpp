@@ -0,0 +1,74 @@
+#pragma once
+#include <iostream>
+#include <vector>
+
+/*
+Positions of newline characters in a buffer.
+Buffer is scanned window by window with SIMD comparisons (SSE2, or AVX2 if supported by cpu),
+so that text records can be split into lines without scanning them byte by byte.
+*/
+class LineIndex
+{
+public:
+    static const std::streamsize WINDOW_SIZE = 64L * 1024L;
+
+    static size_t count(const char* start, const char* stop);
+    void reset(char* start, char* stop);
+    bool ensure(size_t);
+    inline char* const* lines() const   { return m_newlines.data() + m_cur; }
+    inline void advance(size_t n)       { m_cur += n; }
+private:
+    std::vector<char*> m_newlines;
+    size_t m_cur = 0;
+    char* m_scanned = nullptr;
+    char* m_stop = nullptr;
+};
+
+/*
+Splits buffer into consecutive records.
+Text records (LINES_PER_RECORD > 0) are built from newline positions found by LineIndex,
+other records (e.g. binary keys) are parsed by their own read_new method.
+*/
+template <class T>
+class RecordReader
+{
+public:
+    void reset(char* start, char* stop);
+    std::streamsize read(T&);
+private:
+    char* m_pos = nullptr;
+    char* m_stop = nullptr;
+    LineIndex m_lines;
+};
+
+template <class T>
+void RecordReader<T>::reset(char* start, char* stop)
+{
+    m_pos = start;
+    m_stop = stop;
+    if constexpr (T::LINES_PER_RECORD > 0)
+        m_lines.reset(start, stop);
+}
+
+// Maps next record in buffer to obj, returns its size or -1 if buffer end is encountered prematurely
+template <class T>
+std::streamsize RecordReader<T>::read(T& obj)
+{
+    std::streamsize size;
+    if constexpr (T::LINES_PER_RECORD > 0)
+    {
+        if ((m_pos >= m_stop) || !m_lines.ensure(T::LINES_PER_RECORD))
+        {
+            obj.clear();
+            return -1;
+        }
+        size = obj.read_lines(m_pos, m_lines.lines());
+        m_lines.advance(T::LINES_PER_RECORD);
+    } else {
+        size = obj.read_new(m_pos, m_stop);
+        if (size < 0)
+            return -1;
+    }
+    m_pos += size;
+    return size;
+}
@@ -1,17 +1,39 @@
+#include <boost/algorithm/string.hpp>
+#include <boost/format.hpp>
 #include <boost/program_options.hpp>
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 
+#include "buffer_pool.hpp"
 #include "constants.hpp"
 #include "comparator.hpp"
 #include "fastaview.hpp"
 #include "fastqview.hpp"
 #include "seq_dup_remover.hpp"
 #include "hash_dup_remover.hpp"
+#include "input_profile.hpp"
+#include "memory_budget.hpp"
+#include "parallel_parse.hpp"
+#include "record_index.hpp"
+#include "run_stats.hpp"
+#include "shard.hpp"
 
 using std::string;
 namespace po = boost::program_options;
 
+const ssize_t MIN_MEM_LIMIT = 500L;  // megabytes
+const uint64_t PROFILE_SAMPLE_SIZE = 128ul * constants::ONE_MB;  // bytes of every input sampled by --mode auto
+
 enum Modes
 {
     BASE = 0,   // Default: single-end Fastq file, seq-based "tight" approach
@@ -29,14 +51,117 @@ struct Options
 {
     Modes mode = Modes::BASE;
     ssize_t memLimit = constants::TWO_GB;
+    bool mem_auto       = false;  // memory limit is derived from memory available to the process
+    bool mode_auto      = false;  // hash-based or sequence-based mode is selected for every sample by its profile
+    size_t expected_records = 0ul;  // estimated number of distinct reads, sizes hash table
+    bool estimate_only  = false;
+    uint64_t sample_size = 0ul;     // bytes of every input read by --estimate-only, 0 for whole inputs
     string input_1, input_2, output_1, output_2;
+    // all lanes of joint deduplication, input_1 etc. refer to the first one
+    std::vector<string> inputs_1, inputs_2, outputs_1, outputs_2;
+    std::vector<string> tmpdirs;
+    bool temp_compression = false;  // sorted runs are compressed by zstd
     ComparatorType ctype = ComparatorType::CT_TIGHT;
     uint hammdist       = 2;
+    uint threads        = 1;
     bool unordered      = false;
+    bool interleaved    = false;  // mates follow each other in first input files (and in first output files, unless second ones are given)
     bool verbose        = false;
     bool write_clusters = false;
+    bool key_sort       = false;
+    bool length_buckets = false;
+    bool use_index      = false;
+    string index_in, index_out;
+    string manifest;
+    string stats_json;
+    uint shard_index = 0, shard_count = 0;  // 1-based index, sharding is disabled if count is 0
+    bool merge_shards   = false;
+    bool hash_join      = false;
+    bool stream         = false;
+    size_t window       = 10000000ul;  // number of recent distinct reads remembered in streaming mode
+    size_t block_size   = 0ul;  // upper bound of input buffers (bytes), only lowered by tests
 };
 
+// Checks input and output files of a sample against other options,
+// fields describing the first lane are set as well
+void init_sample(Options& opts)
+{
+    bool paired = static_cast<bool>(opts.mode & Modes::PAIRED);
+
+    // every lane needs its own outputs, while shard outputs are merged into a single one; estimation writes no outputs
+    size_t num_lanes = opts.inputs_1.size();
+    size_t num_outputs = opts.estimate_only ? 0 : (opts.merge_shards ? 1 : num_lanes);
+    // second files of interleaved pairs are given by empty names
+    if (opts.interleaved)
+    {
+        opts.inputs_2.assign(num_lanes, "");
+        if (opts.outputs_2.empty())
+            opts.outputs_2.assign(num_outputs, "");
+    }
+    if ((opts.outputs_1.size() != num_outputs)
+        || (paired && ((opts.inputs_2.size() != num_lanes) || (opts.outputs_2.size() != num_outputs))))
+        throw std::runtime_error("Numbers of input and output files do not match!");
+    opts.input_1 = opts.inputs_1[0];
+    if (num_outputs > 0)
+        opts.output_1 = opts.outputs_1[0];
+    if (paired)
+    {
+        opts.input_2 = opts.inputs_2[0];
+        if (num_outputs > 0)
+            opts.output_2 = opts.outputs_2[0];
+    }
+
+    // standard streams ("-") can only be read or written once
+    auto std_streams = [](const std::vector<string>& a, const std::vector<string>& b)
+    {
+        return std::count(a.begin(), a.end(), "-") + std::count(b.begin(), b.end(), "-");
+    };
+    if (std_streams(opts.inputs_1, opts.inputs_2) > 1)
+        throw std::runtime_error("Standard input (-) can only be used as a single input file!");
+    if (std_streams(opts.outputs_1, opts.outputs_2) > 1)
+        throw std::runtime_error("Standard output (-) can only be used as a single output file!");
+    if (std_streams(opts.outputs_1, opts.outputs_2) && opts.write_clusters)
+        throw std::runtime_error("--write-clusters argument can not be used with standard output!");
+    if (std_streams(opts.inputs_1, opts.inputs_2) && (opts.use_index || opts.key_sort || opts.merge_shards))
+        throw std::runtime_error("Standard input can not be used with --fqi, --key-sort or --merge-shards!");
+
+    // check if both files in pair reference the same file
+    if (paired)
+    {
+        for (size_t i = 0; i < num_lanes; ++i)
+            if (opts.inputs_1[i] == opts.inputs_2[i])
+                throw std::runtime_error("Paired input files should not be the same file!");
+        for (size_t i = 0; i < num_outputs; ++i)
+            if (opts.outputs_1[i] == opts.outputs_2[i])
+                throw std::runtime_error("Paired output files should not be the same file!");
+    }
+
+    // length buckets are only valid for single reads
+    if (opts.length_buckets && paired)
+        throw std::runtime_error("--length-buckets argument can only be used with single-end input!");
+
+    // lanes are merged after sorting, which is only done by the regular sequence-based pass
+    if ((num_lanes > 1) && !opts.merge_shards)
+    {
+        if ((opts.mode & Modes::HASH) || opts.key_sort || opts.length_buckets || opts.use_index
+            || !opts.index_in.empty() || !opts.index_out.empty())
+            throw std::runtime_error("Several input files can only be deduplicated jointly by the default sequence-based mode"
+                                     " without --key-sort, --length-buckets, --fqi and index options!");
+    }
+
+    if (opts.unordered && !paired)
+        throw std::runtime_error("--unordered argument can only be used with paired inputs!");
+
+    // key-based sorting needs random access to inputs
+    if (opts.key_sort)
+    {
+        for (auto* files: {&opts.inputs_1, &opts.inputs_2})
+            for (auto& filename: *files)
+                if (FileUtils::isCompressed(filename.c_str()))
+                    throw std::runtime_error("--key-sort argument can only be used with uncompressed input files!");
+    }
+}
+
 bool parse_args(int argc, char** argv, Options& opts)
 {
     try {
@@ -46,14 +171,47 @@ bool parse_args(int argc, char** argv, Options& opts)
         desc.add_options()
         ("help,h", "Produce help message and exit")
         ("verbose,v", po::bool_switch(&opts.verbose), "Report run summary after program execution.")
-        ("input-1,i", po::value<string>(&opts.input_1)->required(), "First input file (required)")
-        ("input-2,u", po::value<string>(&opts.input_2), "Second input file (optional, enables paired-end mode)")
-        ("output-1,o", po::value<string>(&opts.output_1)->required(), "First output file (required)")
-        ("output-2,p", po::value<string>(&opts.output_2), "Second output file (optional, required for paired-end mode)")
-        ("mem-limit,m", po::value<ssize_t>(), "Memory limit in megabytes (default 2048 = 2Gb).\n"
-                                              "Supported value range is [500 <-> 10240 (10 Gb)]\n"
-                                              "Actual memory usage may slightly exceed this value.\n"
-                                              "NB: The 'fast' deduplication mode does not support strict memory limitation.")
+        ("stats-json", po::value<string>(&opts.stats_json), "Write performance metrics of the run to a JSON file: wall and CPU time, bytes read and written"
+                                                            " (input, temporary and output files), number of records and peak memory usage"
+                                                            " of every processing phase (sorted runs generation, merge passes, deduplication pass).")
+        ("threads,t", po::value<uint>(&opts.threads), "Number of threads to use (default 1).")
+        ("estimate-only", po::bool_switch(&opts.estimate_only), "Only estimate duplication of input in a single pass with small fixed memory"
+                                                                " (no output files are written): number of unique reads, duplicate fraction"
+                                                                " and cluster size histogram, with 95% confidence intervals.")
+        ("sample-size", po::value<uint64_t>(), "Stop --estimate-only after this many megabytes of every input, estimates then describe the sampled prefix.")
+        ("input-1,i", po::value<std::vector<string>>(&opts.inputs_1)->multitoken(), "First input file (required).\n"
+                                                                                            "Several files (lanes) may be provided to deduplicate them jointly,"
+                                                                                            " each lane then needs its own output file.")
+        ("input-2,u", po::value<std::vector<string>>(&opts.inputs_2)->multitoken(), "Second input file (optional, enables paired-end mode)")
+        ("output-1,o", po::value<std::vector<string>>(&opts.outputs_1)->multitoken(), "First output file (required)")
+        ("output-2,p", po::value<std::vector<string>>(&opts.outputs_2)->multitoken(), "Second output file (optional, required for paired-end mode)")
+        ("interleaved", po::bool_switch(&opts.interleaved), "Paired-end input is interleaved: mates follow each other in a single input file"
+                                                            " (e.g. standard input), input-2 is not used.\n"
+                                                            "Read pairs are written interleaved to output-1 as well,"
+                                                            " unless output-2 is provided to write mates to separate files.")
+        ("manifest", po::value<string>(&opts.manifest), "Process many samples in one run instead of a single one. Tab-separated manifest file lists one sample per line:"
+                                                        " <input> <output> for single-end or <input-1> <input-2> <output-1> <output-2> for paired-end samples.\n"
+                                                        "Several samples are processed concurrently if several threads are available, sharing memory limit,"
+                                                        " temporary directory and input buffers. All other options apply to every sample.")
+        ("shard", po::value<string>(), "Only deduplicate shard i out of N, given as i/N (1 <= i <= N).\n"
+                                       "Reads are routed to shards by a hash of the first 16 bases of their sequences, so shards can be"
+                                       " deduplicated independently, e.g. by separate processes or on separate nodes."
+                                       " Outputs of all shards are then assembled with --merge-shards.")
+        ("merge-shards", po::bool_switch(&opts.merge_shards), "Merge outputs of all shards (listed as input files in any order) into a single output"
+                                                              " (two for paired-end data).\n"
+                                                              "Mode options used for shards (--fast, --length-buckets, --write-clusters, --format)"
+                                                              " should be passed as well.")
+        ("mem-limit,m", po::value<string>(), "Memory limit in megabytes (default 2048 = 2Gb), at least 500.\n"
+                                             "'auto' takes 80% of memory available to the process: the lowest of cgroup (container)"
+                                             " limits and available RAM.\n"
+                                             "Buffers and hash tables of all modes are drawn from this budget.\n"
+                                             "In 'fast' mode, reads that do not fit are deduplicated in partitions on disk.")
+        ("tmpdir", po::value<std::vector<string>>(&opts.tmpdirs)->multitoken(), "One or more directories to store temporary files in (default: current working directory).\n"
+                                                                               "If several directories are provided, temporary files are distributed between them evenly,"
+                                                                               " e.g. --tmpdir /mnt/nvme0 /mnt/nvme1")
+        ("temp-compression", po::value<string>(), "Compression of sorted runs written to temporary directory: 'none' (default) or 'zstd'.\n"
+                                                  "zstd at its fastest level makes temporary files several times smaller at some CPU cost,"
+                                                  " which pays off on slow or small scratch disks.")
         ("format", po::value<string>(), "input file format: fastq (default) or fasta.")
         ("compare-seq", po::value<string>(), "Sequence comparison mode for deduplication step.\n"
                                              "Supported options:\n"
@@ -70,18 +228,60 @@ bool parse_args(int argc, char** argv, Options& opts)
                                                                    "Resulting file is written in addition to main output and is named <output-file>.clusters\n"
                                                                    "(2 cluster files are written in case of paired mode).\n"
                                                                     "This option is only supported by the sequence-based modes.")
+        ("key-sort", po::bool_switch(&opts.key_sort), "Only sort compact keys (packed sequences and positions of records in input files)"
+                                                      " instead of complete records, and copy deduplicated records from inputs afterwards.\n"
+                                                      "Significantly reduces size of temporary files, but requires uncompressed input files.\n"
+                                                      "This option is only supported by the sequence-based modes.")
+        ("length-buckets", po::bool_switch(&opts.length_buckets), "Split single-end input by sequence length and sort and deduplicate"
+                                                                  " each part independently (in parallel if several threads are available).\n"
+                                                                  "Output reads are ordered by sequence length.\n"
+                                                                  "This option is only supported by the 'tight' sequence comparison mode.")
+        ("fqi", po::bool_switch(&opts.use_index), "Use sidecar index files <input>.fqi with record counts, sequence length statistics"
+                                                  " and offsets of every 65536th record of inputs. Missing or outdated indexes are built"
+                                                  " while input is read and saved next to input files.\n"
+                                                  "Exact record counts allow 'fast' mode to size its hash table upfront. With several threads,"
+                                                  " sequence-based mode sorts parts of uncompressed and BGZF-compressed inputs in parallel,"
+                                                  " each thread seeking to its own part.")
+        ("index-in", po::value<string>(&opts.index_in), "Deduplicate input against a set of unique sequences saved by a previous run with --index-out:"
+                                                        " reads that duplicate any of saved sequences are removed as well.")
+        ("index-out", po::value<string>(&opts.index_out), "Save sorted set of unique sequences (including ones from --index-in) to a file,"
+                                                          " so that later runs can deduplicate new data against it.\n"
+                                                          "The same file may be used with --index-in.\n"
+                                                          "Index options are only supported by the sequence-based modes.")
+        ("mode", po::value<string>(), "Deduplication approach: 'sequence' (default), 'fast' (same as --fast) or 'auto'.\n"
+                                      "'auto' estimates the number of distinct reads from a sample of input (HyperLogLog) and uses"
+                                      " 'fast' mode if its hash table is expected to fit into memory limit, 'sequence' mode otherwise;"
+                                      " the estimate also sizes the hash table. Sequence-based mode is always used if any of its"
+                                      " options are provided.")
         ("fast", po::bool_switch(&hash_opt), "Use hash-based approach instead of sequence-based.\n"
-                                             "In this mode the program will run significantly faster, however no memory limit can be set"
-                                             " and only complete duplicates will be filtered out.")
+                                             "In this mode the program will run significantly faster, however"
+                                             " only complete duplicates will be filtered out.")
+        ("stream", po::bool_switch(&opts.stream), "Streaming deduplication: reads are written out as soon as they are processed,"
+                                                  " which allows to use the program in pipelines (pass - as input or output file"
+                                                  " to read standard input or write standard output).\n"
+                                                  "Only complete duplicates within a window of recently seen distinct reads are removed,"
+                                                  " so memory usage is bounded by both --window and --mem-limit.")
+        ("window", po::value<size_t>(&opts.window), "Number of recent distinct reads (read pairs) remembered by --stream mode (default 10000000).")
         ("unordered", po::bool_switch(&opts.unordered), "This option is supported only by 'fast' mode for paired inputs.\n"
                                                         "Enable this flag if reads in your paired input files are not synchronized"
                                                         " (i.e. the order in which reads appear (determined by read IDs) and/or the"
                                                         " number of reads differs between two input files).\n"
                                                         "If this option is enabled, both input files will be sorted by read IDs before deduplication.")
+        ("hash-join", po::bool_switch(&opts.hash_join), "Match reads of --unordered inputs by a hash join on read IDs instead of sorting both"
+                                                        " input files: reads of the first file are kept in memory (split into partitions by read IDs"
+                                                        " if they do not fit into memory limit), while the second file is streamed through.\n"
+                                                        "Output pairs follow the order of the second input file rather than the order of read IDs.")
+        ;
+        // options for testing, not shown in help
+        po::options_description hidden;
+        hidden.add_options()
+        ("block-size", po::value<size_t>(&opts.block_size), "Upper bound of input buffers in bytes: small inputs are split into many sort chunks and parse blocks.")
         ;
+        po::options_description all;
+        all.add(desc).add(hidden);
         // Parse command line arguments
         po::variables_map vm;
-        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::store(po::parse_command_line(argc, argv, all), vm);
         if (vm.count("help"))
         {
             std::cerr << constants::VERSION << "\n";
@@ -90,22 +290,51 @@ bool parse_args(int argc, char** argv, Options& opts)
         }
         po::notify(vm);
 
+        // estimation reads inputs only
+        if (opts.estimate_only)
+        {
+            if (vm.count("output-1") || vm.count("output-2"))
+                throw std::runtime_error("--estimate-only does not write output files, output arguments can not be used with it!");
+            if (vm.count("manifest") || vm.count("shard") || opts.merge_shards || opts.unordered)
+                throw std::runtime_error("--estimate-only can not be used with --manifest, --shard, --merge-shards or --unordered!");
+            if (!vm.count("input-1"))
+                throw std::runtime_error("input-1 argument is required!");
+            if (vm.count("sample-size"))
+            {
+                opts.sample_size = vm["sample-size"].as<uint64_t>() * constants::ONE_MB;
+                if (opts.sample_size == 0)
+                    throw std::runtime_error("--sample-size should be a positive integer!");
+            }
+        }
+        else if (vm.count("sample-size"))
+            throw std::runtime_error("--sample-size argument can only be used with --estimate-only!");
+
         // check whether PE mode args passed correctly
-        if (vm.count("input-2") ^ vm.count("output-2"))
+        if (opts.interleaved)
+        {
+            if (vm.count("input-2"))
+                throw std::runtime_error("Interleaved input is a single file, input-2 argument can not be used with --interleaved!");
+            // mates of interleaved input are synchronized, and have no second file to address records in
+            if (opts.unordered || opts.key_sort || opts.write_clusters)
+                throw std::runtime_error("--interleaved argument can not be used with --unordered, --key-sort or --write-clusters!");
+        }
+        else if ((vm.count("input-2") ^ vm.count("output-2")) && !opts.estimate_only)
             throw std::runtime_error("Both input-2 and output-2 arguments are required for paired-end mode!");
 
-        // paired or single mode
-        if (vm.count("input-2"))
-            opts.mode = (opts.mode | Modes::PAIRED);
-
-        // check if both files in pair reference the same file
-        if (vm.count("input-2"))
+        // input and output files are either listed in a manifest or passed directly
+        if (vm.count("manifest"))
         {
-            if (opts.input_1 == opts.input_2)
-                throw std::runtime_error("Paired input files should not be the same file!");
-            if (opts.output_1 == opts.output_2)
-                throw std::runtime_error("Paired output files should not be the same file!");
+            if (vm.count("input-1") || vm.count("input-2") || vm.count("output-1") || vm.count("output-2"))
+                throw std::runtime_error("--manifest argument can not be used together with input and output file arguments!");
+            if (vm.count("index-in") || vm.count("index-out"))
+                throw std::runtime_error("--manifest argument can not be used together with --index-in or --index-out!");
         }
+        else if (!vm.count("input-1") || (!vm.count("output-1") && !opts.estimate_only))
+            throw std::runtime_error("Both input-1 and output-1 arguments are required!");
+
+        // paired or single mode
+        if (vm.count("input-2") || opts.interleaved)
+            opts.mode = (opts.mode | Modes::PAIRED);
 
         // file format check
         if (vm.count("format"))
@@ -119,6 +348,15 @@ bool parse_args(int argc, char** argv, Options& opts)
                 throw std::runtime_error("Only \"fastq\" or \"fasta\" file formats are supported!");
         }
 
+        if (vm.count("temp-compression"))
+        {
+            string value = vm["temp-compression"].as<string>();
+            if (value == "zstd")
+                opts.temp_compression = true;
+            else if (value != "none")
+                throw std::runtime_error("Only \"none\" or \"zstd\" compression of temporary files is supported!");
+        }
+
         // comparator type
         if (vm.count("compare-seq"))
         {
@@ -136,13 +374,54 @@ bool parse_args(int argc, char** argv, Options& opts)
         // memory limit safe check
         if (vm.count("mem-limit"))
         {
-            ssize_t value = vm["mem-limit"].as<ssize_t>();
-            if ((value >= 500L) && (value <= 10240L))
-                opts.memLimit = value * constants::ONE_MB;
-            else
+            string value = vm["mem-limit"].as<string>();
+            ssize_t megabytes;
+            char extra;
+            if (value == "auto")
+            {
+                size_t available = MemoryBudget::instance().system_memory();
+                if (available == 0)
+                {
+                    std::cerr << "Memory available to the process could not be detected, default limit is used.\n";
+                } else {
+                    opts.memLimit = std::max<ssize_t>(available / 10 * 8, MIN_MEM_LIMIT * constants::ONE_MB);
+                    opts.mem_auto = true;
+                }
+            } else if ((sscanf(value.c_str(), "%zd%c", &megabytes, &extra) == 1) && (megabytes >= MIN_MEM_LIMIT)
+                       && (megabytes <= SSIZE_MAX / constants::ONE_MB)) {
+                opts.memLimit = megabytes * constants::ONE_MB;
+            } else {
                 throw std::runtime_error("Value of unsupported range provided for --mem-limit option!");
+            }
         }
 
+        // deduplication approach
+        if (vm.count("mode"))
+        {
+            string value = vm["mode"].as<string>();
+            if ((value != "sequence") && (value != "fast") && (value != "auto"))
+                throw std::runtime_error("Only \"sequence\", \"fast\" or \"auto\" modes are supported!");
+            if ((hash_opt || opts.stream) && (value != "fast"))
+                throw std::runtime_error("--fast and --stream arguments can only be used with --mode fast!");
+            if ((value == "auto") && (vm.count("shard") || opts.merge_shards))
+                throw std::runtime_error("--mode auto can not be used with --shard or --merge-shards, since all shards should use the same mode!");
+            // only 'fast' mode supports unordered pairs, its hash table is still sized by input profile
+            hash_opt = (value == "fast") || ((value == "auto") && opts.unordered);
+            opts.mode_auto = (value == "auto");
+        }
+
+        // streaming mode is a bounded variant of hash-based approach
+        if (opts.stream)
+        {
+            if (opts.unordered)
+                throw std::runtime_error("--stream and --unordered arguments can not be used together!");
+            if (opts.window < 1)
+                throw std::runtime_error("--window should be a positive integer!");
+            hash_opt = true;
+        }
+        else if (vm.count("window"))
+            throw std::runtime_error("--window argument can only be used with --stream mode!");
+
         // seq-based or hash-based
         if (hash_opt)
         {
@@ -150,19 +429,58 @@ bool parse_args(int argc, char** argv, Options& opts)
             opts.ctype = ComparatorType::CT_NONE;
 
             // check if user provided arguments for seq-based modes
-            if (vm.count("compare-seq") || vm.count("distance") || opts.write_clusters)
-                throw std::runtime_error("--fast mode was enabled, but argument(s) for sequence-based mode were provided!");
+            if (vm.count("compare-seq") || vm.count("distance") || opts.write_clusters || opts.key_sort || opts.length_buckets
+                || vm.count("index-in") || vm.count("index-out"))
+                throw std::runtime_error("--fast or --stream mode was enabled, but argument(s) for sequence-based mode were provided!");
         }
 
-        // check is unordered option was used incorrectly
-        if (opts.unordered)
+        // length buckets are only valid for tight comparison of single reads
+        if (opts.length_buckets)
+        {
+            if (opts.ctype != ComparatorType::CT_TIGHT)
+                throw std::runtime_error("--length-buckets argument can only be used with 'tight' sequence comparison mode!");
+            if (opts.key_sort)
+                throw std::runtime_error("--length-buckets and --key-sort arguments can not be used together!");
+        }
+
+        // persistent indexes are merged in during regular deduplication pass
+        if (vm.count("index-in") || vm.count("index-out"))
+        {
+            if (opts.key_sort || opts.length_buckets)
+                throw std::runtime_error("--index-in and --index-out arguments can not be used with --key-sort or --length-buckets!");
+            if (vm.count("index-in") && opts.write_clusters)
+                throw std::runtime_error("--index-in and --write-clusters arguments can not be used together!");
+            if (vm.count("index-in") && !FS::is_regular_file(opts.index_in))
+                throw std::runtime_error("Index file provided with --index-in does not exist!");
+        }
+
+        if (opts.threads < 1)
+            throw std::runtime_error("Number of threads should be a positive integer!");
+
+        // sharding options
+        if (vm.count("shard"))
         {
-            if (!hash_opt)
-                throw std::runtime_error("--unordered argument can only be used with --fast mode!");
-            if (!vm.count("input-2"))
-                throw std::runtime_error("--unordered argument can only be used with paired inputs!");
+            string value = vm["shard"].as<string>();
+            char extra;
+            if ((sscanf(value.c_str(), "%u/%u%c", &opts.shard_index, &opts.shard_count, &extra) != 2)
+                || (opts.shard_index < 1) || (opts.shard_index > opts.shard_count))
+                throw std::runtime_error("--shard argument should be of the form i/N, where 1 <= i <= N!");
+            if (opts.merge_shards)
+                throw std::runtime_error("--shard and --merge-shards arguments can not be used together!");
+            if (opts.use_index)
+                throw std::runtime_error("--shard and --fqi arguments can not be used together!");
         }
+        if (opts.merge_shards && vm.count("manifest"))
+            throw std::runtime_error("--merge-shards and --manifest arguments can not be used together!");
 
+        // check is unordered option was used incorrectly
+        if (opts.unordered && !(opts.mode & Modes::HASH) && !opts.mode_auto)
+            throw std::runtime_error("--unordered argument can only be used with --fast mode!");
+        if (opts.hash_join && !opts.unordered)
+            throw std::runtime_error("--hash-join argument can only be used with --unordered mode!");
+
+        if (!vm.count("manifest"))
+            init_sample(opts);
     }
     catch(const std::exception& e)
     {
@@ -178,6 +496,434 @@ bool parse_args(int argc, char** argv, Options& opts)
     return true;
 }
 
+// Opens sidecar indexes of all inputs, missing ones are built during the run;
+// returns number of records in the largest input with a loaded index
+size_t open_indexes(const Options& opts)
+{
+    size_t records = 0ul;
+    for (const string* source: {&opts.input_1, &opts.input_2})
+    {
+        if (source->empty())
+            continue;
+        if (auto index = RecordIndex::open(*source, opts.verbose))
+            records = std::max<size_t>(records, index->records());
+    }
+    // an interleaved input holds both mates of every pair
+    return opts.interleaved ? records / 2 : records;
+}
+
+// Selects hash-based mode if hash table of distinct reads is expected to fit into memory limit, sequence-based one otherwise
+template<class T>
+void select_mode(Options& opts)
+{
+    RunStats::Phase phase("mode selection");
+    bool paired = static_cast<bool>(opts.mode & Modes::PAIRED);
+    opts.mode_auto = false;
+    if (!(opts.mode & Modes::HASH) && ((opts.ctype != ComparatorType::CT_TIGHT) || opts.write_clusters || opts.key_sort
+                                       || opts.length_buckets || !opts.index_in.empty() || !opts.index_out.empty()
+                                       || (opts.inputs_1.size() > 1)))
+    {
+        if (opts.verbose)
+            std::cout << "Options of sequence-based mode were provided, 'sequence' mode is used.\n";
+        return;
+    }
+
+    InputProfile profile;
+    if (paired && opts.unordered)
+    {
+        // mates can not be matched by a sample, distinct pairs are at least as many as distinct reads of either input
+        InputProfile right = InputProfiler::profile<T>(opts.input_2, PROFILE_SAMPLE_SIZE);
+        profile = InputProfiler::profile<T>(opts.input_1, PROFILE_SAMPLE_SIZE);
+        profile.records = std::max(profile.records, right.records);
+        profile.distinct = std::max(profile.distinct, right.distinct);
+        profile.seq_len += right.seq_len;
+        profile.complete = profile.complete && right.complete;
+    } else if (paired) {
+        profile = InputProfiler::profile<T>(opts.input_1, opts.input_2, PROFILE_SAMPLE_SIZE);
+    } else {
+        profile = InputProfiler::profile<T>(opts.input_1, PROFILE_SAMPLE_SIZE);
+    }
+    size_t needed = HashDupRemover<T>::set_memory(profile.distinct, profile.seq_len, paired);
+    size_t budget = HashDupRemover<T>::set_budget(opts.memLimit, paired);
+    bool fast = (opts.mode & Modes::HASH) || (needed <= budget);
+    if (fast)
+    {
+        opts.mode = (opts.mode | Modes::HASH);
+        opts.ctype = ComparatorType::CT_NONE;
+        opts.expected_records = profile.distinct;
+    }
+    phase.set("records", profile.sampled_records);
+    phase.set("distinct", profile.distinct);
+
+    if (opts.verbose)
+    {
+        const char* unit = paired ? "read pairs" : "reads";
+        std::cout << boost::format("Input profile (%1%): %2% %3% of mean length %4$.1f, %5% of them distinct.\n")
+            % (profile.complete ? "whole input" : "extrapolated from the first " + std::to_string(PROFILE_SAMPLE_SIZE / constants::ONE_MB) + " MB")
+            % profile.records % unit % profile.seq_len % profile.distinct;
+        if (opts.unordered)
+            std::cout << "Unordered pairs are only supported by 'fast' mode, 'fast' mode is used.\n";
+        else
+            std::cout << boost::format("Hash table of distinct %1% is expected to take %2% MB out of %3% MB available: '%4%' mode is used.\n")
+                % unit % (needed / constants::ONE_MB) % (budget / constants::ONE_MB) % (fast ? "fast" : "sequence");
+    }
+}
+
+// Reports estimated duplication of inputs (all lanes together) without deduplicating them
+template<class T>
+void run_estimate(const Options& opts)
+{
+    RunStats::Phase phase("estimate");
+    bool paired = static_cast<bool>(opts.mode & Modes::PAIRED);
+    DuplicationEstimate estimate = InputProfiler::estimate<T>(opts.inputs_1, paired ? opts.inputs_2 : std::vector<string>(),
+                                                              opts.sample_size ? opts.sample_size : UINT64_MAX);
+    // bounds are 95% confidence intervals of normally distributed errors
+    const double Z = 1.96;
+    double records = estimate.records;
+    double distinct = estimate.clusters.exact() ? estimate.clusters.size() : std::min(estimate.distinct.estimate(), records);
+    double error = estimate.clusters.exact() ? 0.0 : estimate.distinct.error();
+    double distinct_low = std::max(0.0, distinct * (1.0 - Z * error));
+    double distinct_high = std::min(records, distinct * (1.0 + Z * error));
+    auto dup_share = [&](double value) { return (records > 0) ? 100.0 * (1.0 - value / records) : 0.0; };
+    const char* unit = paired ? "read pairs" : "reads";
+
+    std::cout << boost::format("Estimated duplication of %1% %2% (%3%):\n") % estimate.records % unit
+        % (estimate.complete ? string("whole input") : "first " + std::to_string(opts.sample_size / constants::ONE_MB) + " MB of every input");
+    std::cout << boost::format("Unique %1%: %2$.0f (95%% CI %3$.0f - %4$.0f)\n") % unit % distinct % distinct_low % distinct_high;
+    std::cout << boost::format("Duplicate fraction: %1$.2f%% (95%% CI %2$.2f%% - %3$.2f%%)\n")
+        % dup_share(distinct) % dup_share(distinct_high) % dup_share(distinct_low);
+
+    // shares of unique reads by size of their clusters, the sample of unique reads is all of them if it is exact
+    std::map<uint64_t, size_t> histogram = estimate.clusters.histogram();
+    double sampled = estimate.clusters.size();
+    if (estimate.clusters.exact())
+        std::cout << "Cluster size histogram (share of unique " << unit << ", exact):\n";
+    else
+        std::cout << "Cluster size histogram (share of unique " << unit << ", estimated from a sample of "
+                  << estimate.clusters.size() << " of them):\n";
+    const std::vector<std::pair<uint64_t, uint64_t>> bins = {{1, 1}, {2, 2}, {3, 3}, {4, 4}, {5, 5}, {6, 10}, {11, 100}, {101, UINT64_MAX}};
+    for (auto& [low, high]: bins)
+    {
+        size_t count = 0ul;
+        for (auto it = histogram.lower_bound(low); (it != histogram.end()) && (it->first <= high); ++it)
+            count += it->second;
+        if (count == 0)
+            continue;
+        double share = count / sampled;
+        string label = (low == high) ? std::to_string(low) : (high == UINT64_MAX) ? std::to_string(low) + "+"
+                                                                               : std::to_string(low) + "-" + std::to_string(high);
+        std::cout << boost::format("  %1$-8s %2$6.2f%%") % label % (100.0 * share);
+        if (!estimate.clusters.exact())
+            std::cout << boost::format(" +- %1$.2f%%") % (100.0 * Z * std::sqrt(share * (1.0 - share) / sampled));
+        std::cout << '\n';
+    }
+    phase.set("records", estimate.records);
+    phase.set("distinct", static_cast<uint64_t>(distinct));
+}
+
+// Copies reads of the selected shard of every input to temporary files, which replace inputs
+template<class T>
+Options extract_shard(const Options& opts, FileUtils::TemporaryDirectory* tempdir)
+{
+    bool paired = static_cast<bool>(opts.mode & Modes::PAIRED);
+    Options shard = opts;
+    shard.shard_count = 0;
+    size_t selected = 0ul, total = 0ul;
+    for (size_t i = 0; i < opts.inputs_1.size(); ++i)
+    {
+        std::pair<size_t, size_t> counts;
+        shard.inputs_1[i] = tempdir->unique_name("shard_1");
+        if (paired)
+        {
+            shard.inputs_2[i] = tempdir->unique_name("shard_2");
+            counts = Shard::extract<T>(opts.inputs_1[i], opts.inputs_2[i], shard.inputs_1[i], shard.inputs_2[i],
+                                       opts.shard_index - 1, opts.shard_count, opts.memLimit);
+        } else {
+            counts = Shard::extract<T>(opts.inputs_1[i], shard.inputs_1[i],
+                                       opts.shard_index - 1, opts.shard_count, opts.memLimit);
+        }
+        selected += counts.first;
+        total += counts.second;
+    }
+    shard.input_1 = shard.inputs_1[0];
+    if (paired)
+        shard.input_2 = shard.inputs_2[0];
+    if (opts.verbose)
+        std::cout << boost::format("Shard %1%/%2%: %3% out of %4% reads were selected.\n")
+            % opts.shard_index % opts.shard_count % selected % total;
+    return shard;
+}
+
+// Assembles outputs of independent shard runs into final output(s)
+template<class T>
+void merge_shards(const Options& opts)
+{
+    // sequence-based outputs are sorted by sequence, unless they are split by length
+    bool sorted = !(opts.mode & Modes::HASH) && !opts.length_buckets;
+    if (opts.mode & Modes::PAIRED)
+        Shard::merge<T>(opts.inputs_1, opts.inputs_2, opts.output_1, opts.output_2, sorted, opts.write_clusters, opts.memLimit);
+    else
+        Shard::merge<T>(opts.inputs_1, opts.output_1, sorted, opts.write_clusters, opts.memLimit);
+    if (opts.verbose)
+        std::cout << "Outputs of " << opts.inputs_1.size() << " shards were merged.\n";
+}
+
+// Copies (decompressed) standard input to a temporary file, for modes that read their input more than once
+string spool_stdin(FileUtils::TemporaryDirectory* tempdir)
+{
+    string filename = tempdir->unique_name("stdin");
+    std::unique_ptr<FileUtils::I_InputFile> input(FileUtils::openInputFile("-"));
+    std::ofstream output(filename, std::ios_base::binary);
+    check_fstream_ok<std::ofstream>(output, filename.c_str());
+    std::vector<char> buffer(constants::ONE_MB);
+    while (!input->eof())
+    {
+        input->read(buffer.data(), buffer.size());
+        output.write(buffer.data(), input->gcount());
+    }
+    if (!output)
+        throw std::runtime_error("Could not save standard input to a temporary file!");
+    return filename;
+}
+
+// Deduplicates a single sample, temporary files are placed in tempdir
+void run_sample(const Options& opts, FileUtils::TemporaryDirectory* tempdir)
+{
+    if (opts.merge_shards)
+    {
+        if (opts.mode & Modes::FASTA)
+            merge_shards<FastaView>(opts);
+        else
+            merge_shards<FastqView>(opts);
+        return;
+    }
+    if (opts.shard_count > 0)
+    {
+        Options shard = (opts.mode & Modes::FASTA) ? extract_shard<FastaView>(opts, tempdir)
+                                                   : extract_shard<FastqView>(opts, tempdir);
+        run_sample(shard, tempdir);
+        for (auto* files: {&shard.inputs_1, &shard.inputs_2})
+            for (auto& filename: *files)
+                FS::remove(filename);
+        return;
+    }
+    // only hash-based modes (except for unordered pairs) read their inputs in a single pass
+    bool single_pass = (opts.mode & Modes::HASH) && !opts.unordered;
+    for (auto* files: {&opts.inputs_1, &opts.inputs_2})
+    {
+        auto it = std::find(files->begin(), files->end(), "-");
+        if (single_pass || (it == files->end()))
+            continue;
+        Options spooled = opts;
+        string filename = spool_stdin(tempdir);
+        (files == &opts.inputs_1 ? spooled.inputs_1 : spooled.inputs_2)[it - files->begin()] = filename;
+        spooled.input_1 = spooled.inputs_1[0];
+        if (!spooled.inputs_2.empty())
+            spooled.input_2 = spooled.inputs_2[0];
+        run_sample(spooled, tempdir);
+        FS::remove(filename);
+        return;
+    }
+
+    if (opts.mode_auto)
+    {
+        Options selected = opts;
+        if (opts.mode & Modes::FASTA)
+            select_mode<FastaView>(selected);
+        else
+            select_mode<FastqView>(selected);
+        run_sample(selected, tempdir);
+        return;
+    }
+
+    bool paired = static_cast<bool>(opts.mode & Modes::PAIRED);
+
+    BaseComparator* comp = makeComparator(opts.ctype, paired, opts.hammdist);
+
+    size_t num_records = 0ul;
+    if (opts.use_index)
+        num_records = open_indexes(opts);
+    // distinct reads estimated by --mode auto size hash table better than the number of records
+    if (opts.expected_records > 0)
+        num_records = opts.expected_records;
+
+    SeqDupRemoverSettings settings;
+    settings.write_clusters = opts.write_clusters;
+    settings.key_sort       = opts.key_sort;
+    settings.length_buckets = opts.length_buckets;
+    settings.verbose        = opts.verbose;
+    settings.threads        = opts.threads;
+    settings.index_in       = opts.index_in;
+    settings.index_out      = opts.index_out;
+
+    if (opts.mode == Modes::BASE) {
+        // seq, single, fastq
+        SeqDupRemover<FastqView> remover(opts.memLimit, comp, tempdir, settings);
+        remover.filterSE(opts.inputs_1, opts.outputs_1);
+
+    } else if (opts.mode == Modes::FASTA) {
+        // seq, single, fasta
+        SeqDupRemover<FastaView> remover(opts.memLimit, comp, tempdir, settings);
+        remover.filterSE(opts.inputs_1, opts.outputs_1);
+
+    } else if (opts.mode == Modes::PAIRED) {
+        // seq, paired, fastq
+        SeqDupRemover<FastqView> remover(opts.memLimit, comp, tempdir, settings);
+        remover.filterPE(opts.inputs_1, opts.inputs_2,
+                         opts.outputs_1, opts.outputs_2);
+
+    } else if (opts.mode == (Modes::FASTA | Modes::PAIRED)) {
+        // seq, paired, fasta
+        SeqDupRemover<FastaView> remover(opts.memLimit, comp, tempdir, settings);
+        remover.filterPE(opts.inputs_1, opts.inputs_2,
+                         opts.outputs_1, opts.outputs_2);
+
+    } else if (opts.mode == Modes::HASH) {
+        // hash, single, fastq
+        //HashDupRemover<FastqViewWithId> remover(opts.memLimit, tempdir); // slight optimization
+        HashDupRemover<FastqView> remover(opts.memLimit, tempdir, opts.verbose, opts.threads);
+        remover.set_expected_records(num_records);
+        if (opts.stream)
+            remover.set_stream_window(opts.window);
+        remover.filterSE(opts.input_1, opts.output_1);
+
+    } else if (opts.mode == (Modes::HASH | Modes::FASTA)) {
+        // hash, single, fasta
+        //HashDupRemover<FastaViewWithId> remover(opts.memLimit, tempdir); // slight optimization
+        HashDupRemover<FastaView> remover(opts.memLimit, tempdir, opts.verbose, opts.threads);
+        remover.set_expected_records(num_records);
+        if (opts.stream)
+            remover.set_stream_window(opts.window);
+        remover.filterSE(opts.input_1, opts.output_1);
+
+    } else if (opts.mode == (Modes::HASH | Modes::PAIRED)) {
+        // hash, paired, fastq
+        HashDupRemover<FastqViewWithId> remover(opts.memLimit, tempdir, opts.verbose, opts.threads);
+        remover.set_expected_records(num_records);
+        if (opts.stream)
+            remover.set_stream_window(opts.window);
+        remover.set_hash_join(opts.hash_join);
+        remover.filterPE(opts.input_1, opts.input_2,
+                         opts.output_1, opts.output_2,
+                         opts.unordered);
+
+    } else if (opts.mode == (Modes::HASH | Modes::PAIRED | Modes::FASTA)) {
+        // hash, paired, fasta
+        HashDupRemover<FastaViewWithId> remover(opts.memLimit, tempdir, opts.verbose, opts.threads);
+        remover.set_expected_records(num_records);
+        if (opts.stream)
+            remover.set_stream_window(opts.window);
+        remover.set_hash_join(opts.hash_join);
+        remover.filterPE(opts.input_1, opts.input_2,
+                         opts.output_1, opts.output_2,
+                         opts.unordered);
+    } else {
+        std::cerr << "Unknown mode!\n";
+    }
+
+    if (opts.use_index)
+    {   // new indexes are saved once inputs were read
+        RecordIndex::close(opts.input_1, opts.verbose);
+        if (!opts.input_2.empty())
+            RecordIndex::close(opts.input_2, opts.verbose);
+    }
+    if (comp)
+        delete comp;
+}
+
+// Reads samples of batch mode from a tab-separated manifest, every sample inherits all other options
+std::vector<Options> read_manifest(const Options& opts)
+{
+    std::ifstream input(opts.manifest);
+    check_fstream_ok<std::ifstream>(input, opts.manifest.c_str());
+    std::vector<Options> samples;
+    string line;
+    for (size_t line_num = 1; std::getline(input, line); ++line_num)
+    {
+        if (!line.empty() && (line.back() == '\r'))
+            line.pop_back();
+        if (line.empty() || (line[0] == '#'))
+            continue;
+        std::vector<string> fields;
+        boost::split(fields, line, boost::is_any_of("\t"));
+        Options sample = opts;
+        if (opts.interleaved && ((fields.size() == 2) || (fields.size() == 3))) {
+            // mates are written to separate files if both outputs are listed
+            sample.inputs_1 = {fields[0]};
+            sample.outputs_1 = {fields[1]};
+            if (fields.size() == 3)
+                sample.outputs_2 = {fields[2]};
+        } else if (opts.interleaved) {
+            std::cerr << "Line " << line_num << " of manifest " << opts.manifest << " has " << fields.size()
+                      << " fields, while 2 or 3 (interleaved input and its output files) are expected." << std::endl;
+            throw std::runtime_error("Invalid manifest file provided!");
+        } else if (fields.size() == 2) {
+            sample.inputs_1 = {fields[0]};
+            sample.outputs_1 = {fields[1]};
+        } else if (fields.size() == 4) {
+            sample.mode = (sample.mode | Modes::PAIRED);
+            sample.inputs_1 = {fields[0]};
+            sample.inputs_2 = {fields[1]};
+            sample.outputs_1 = {fields[2]};
+            sample.outputs_2 = {fields[3]};
+        } else {
+            std::cerr << "Line " << line_num << " of manifest " << opts.manifest << " has " << fields.size()
+                      << " fields, while 2 (single-end) or 4 (paired-end) are expected." << std::endl;
+            throw std::runtime_error("Invalid manifest file provided!");
+        }
+        init_sample(sample);
+        samples.push_back(std::move(sample));
+    }
+    if (samples.empty())
+        throw std::runtime_error("Manifest file does not list any samples!");
+    return samples;
+}
+
+// Processes all samples of a manifest in one process.
+// Concurrent samples split memory limit and threads evenly, and share temporary directory.
+// Input buffers of finished samples are kept for reuse: with equal memory shares all samples request buffers of the same sizes.
+// Idle buffers are freed as soon as any other request of memory budget does not fit.
+void run_batch(const Options& opts, FileUtils::TemporaryDirectory* tempdir)
+{
+    std::vector<Options> samples = read_manifest(opts);
+    uint num_workers = std::max(1u, std::min(opts.threads, static_cast<uint>(samples.size())));
+    ssize_t memlimit = opts.memLimit / num_workers;
+    uint threads = std::max(1u, opts.threads / num_workers);
+    FileUtils::UniversalOutputFile::set_threads(threads);
+    BufferPool::instance().set_capacity(opts.memLimit);
+
+    std::atomic<size_t> next_sample = 0ul;
+    std::atomic<bool> failed = false;
+    std::mutex report_mutex;
+    runParallel(num_workers, [&](uint)
+    {
+        for (size_t idx = next_sample++; (idx < samples.size()) && !failed; idx = next_sample++)
+        {
+            Options& sample = samples[idx];
+            sample.memLimit = memlimit;
+            sample.threads = threads;
+            // summaries of concurrent samples would be interleaved
+            sample.verbose = opts.verbose && (num_workers == 1);
+            try {
+                run_sample(sample, tempdir);
+            } catch (...) {
+                failed = true;
+                std::lock_guard<std::mutex> lock(report_mutex);
+                std::cerr << "Sample " << sample.input_1 << " could not be processed." << std::endl;
+                throw;
+            }
+            if (opts.verbose)
+            {
+                std::lock_guard<std::mutex> lock(report_mutex);
+                std::cout << boost::format("Sample %1%/%2% done: %3%\n") % (idx + 1) % samples.size() % sample.input_1;
+            }
+        }
+    });
+    BufferPool::instance().set_capacity(0);
+    if (opts.verbose)
+        std::cout << samples.size() << " samples were processed, up to " << num_workers << " at a time.\n";
+}
+
 int main(int argc, char** argv)
 {
     Options opts;
@@ -185,68 +931,42 @@ int main(int argc, char** argv)
     if (!result)
         return 1;
 
-    try {
+    // reads written to standard output should not be mixed with run summary
+    if (std::count(opts.outputs_1.begin(), opts.outputs_1.end(), "-") || std::count(opts.outputs_2.begin(), opts.outputs_2.end(), "-"))
+        std::cout.rdbuf(std::cerr.rdbuf());
 
-        bool paired = static_cast<bool>(opts.mode & Modes::PAIRED);
-
-        FileUtils::TemporaryDirectory tempdir;
-
-        BaseComparator* comp = makeComparator(opts.ctype, paired, opts.hammdist);
-
-        if (opts.mode == Modes::BASE) {
-            // seq, single, fastq
-            SeqDupRemover<FastqView> remover(opts.memLimit, comp, &tempdir, opts.write_clusters, opts.verbose);
-            remover.filterSE(opts.input_1, opts.output_1);
-
-        } else if (opts.mode == Modes::FASTA) {
-            // seq, single, fasta
-            SeqDupRemover<FastaView> remover(opts.memLimit, comp, &tempdir, opts.write_clusters, opts.verbose);
-            remover.filterSE(opts.input_1, opts.output_1);
-
-        } else if (opts.mode == Modes::PAIRED) {
-            // seq, paired, fastq
-            SeqDupRemover<FastqView> remover(opts.memLimit, comp, &tempdir, opts.write_clusters, opts.verbose);
-            remover.filterPE(opts.input_1, opts.input_2,
-                             opts.output_1, opts.output_2);
-
-        } else if (opts.mode == (Modes::FASTA | Modes::PAIRED)) {
-            // seq, paired, fasta
-            SeqDupRemover<FastaView> remover(opts.memLimit, comp, &tempdir, opts.write_clusters, opts.verbose);
-            remover.filterPE(opts.input_1, opts.input_2,
-                             opts.output_1, opts.output_2);
-
-        } else if (opts.mode == Modes::HASH) {
-            // hash, single, fastq
-            //HashDupRemover<FastqViewWithId> remover(opts.memLimit, &tempdir); // slight optimization
-            HashDupRemover<FastqView> remover(opts.memLimit, &tempdir, opts.verbose);
-            remover.filterSE(opts.input_1, opts.output_1);
-
-        } else if (opts.mode == (Modes::HASH | Modes::FASTA)) {
-            // hash, single, fasta
-            //HashDupRemover<FastaViewWithId> remover(opts.memLimit, &tempdir); // slight optimization
-            HashDupRemover<FastaView> remover(opts.memLimit, &tempdir, opts.verbose);
-            remover.filterSE(opts.input_1, opts.output_1);
-
-        } else if (opts.mode == (Modes::HASH | Modes::PAIRED)) {
-            // hash, paired, fastq
-            HashDupRemover<FastqViewWithId> remover(opts.memLimit, &tempdir, opts.verbose);
-            remover.filterPE(opts.input_1, opts.input_2,
-                             opts.output_1, opts.output_2,
-                             opts.unordered);
-
-        } else if (opts.mode == (Modes::HASH | Modes::PAIRED | Modes::FASTA)) {
-            // hash, paired, fasta
-            HashDupRemover<FastaViewWithId> remover(opts.memLimit, &tempdir, opts.verbose);
-            remover.filterPE(opts.input_1, opts.input_2,
-                             opts.output_1, opts.output_2,
-                             opts.unordered);
-        } else {
-            std::cerr << "Unknown mode!\n";
+    MemoryBudget::instance().set_limit(opts.memLimit);
+    FileUtils::UniversalOutputFile::set_threads(opts.threads);
+    if (opts.block_size > 0)
+        BufferPool::instance().set_max_buffer(opts.block_size);
+    if (opts.verbose && opts.mem_auto)
+        std::cout << boost::format("Memory limit is set to %1% MB.\n") % (opts.memLimit / constants::ONE_MB);
+    try {
+        FileUtils::TemporaryDirectory tempdir(opts.tmpdirs);
+        tempdir.set_compressed(opts.temp_compression);
+        if (!opts.stats_json.empty())
+        {
+            std::vector<string> temp_dirs;
+            for (size_t i = 0; i < tempdir.size(); ++i)
+                temp_dirs.push_back(tempdir.dir(i));
+            RunStats::instance().enable(temp_dirs);
         }
-
-        if (comp)
-            delete comp;
-
+        if (opts.estimate_only)
+        {
+            if (opts.mode & Modes::FASTA)
+                run_estimate<FastaView>(opts);
+            else
+                run_estimate<FastqView>(opts);
+        }
+        else if (opts.manifest.empty())
+            run_sample(opts, &tempdir);
+        else
+            run_batch(opts, &tempdir);
+        if (opts.verbose)
+            std::cout << boost::format("Peak tracked memory: %1% MB out of %2% MB memory limit.\n")
+                % (MemoryBudget::instance().peak() / constants::ONE_MB) % (opts.memLimit / constants::ONE_MB);
+        if (!opts.stats_json.empty())
+            RunStats::instance().save(opts.stats_json);
     } catch (const std::exception& exc) {
         std::cerr << "An error occured during fastq-dupaway execution:\n";
         std::cerr << exc.what() << '\n';
@@ -0,0 +1,230 @@
+#include "memory_budget.hpp"
+
+#include <algorithm>
+#include <boost/format.hpp>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+namespace
+{
+    const size_t ONE_MB = 1024ul * 1024ul;
+    // share of the limit kept for fixed-size and untracked allocations
+    const size_t MAX_RESERVE = 32ul * ONE_MB;
+
+    // Reads a single number from a file, "max" (cgroup v2) or a missing file mean no limit
+    size_t read_limit(const std::string& filename)
+    {
+        std::ifstream input(filename);
+        std::string value;
+        if (!(input >> value) || (value == "max"))
+            return SIZE_MAX;
+        try {
+            return std::stoull(value);
+        } catch (const std::exception&) {
+            return SIZE_MAX;
+        }
+    }
+
+    // Lowest limit of a cgroup and its ancestors, found in limit_file under mount point
+    size_t cgroup_limit(const std::string& mount, std::string path, const char* limit_file)
+    {
+        size_t result = SIZE_MAX;
+        while (true)
+        {
+            result = std::min(result, read_limit(mount + path + "/" + limit_file));
+            if (path.empty() || (path == "/"))
+                break;
+            path = path.substr(0, path.rfind('/'));
+        }
+        return result;
+    }
+
+    // MemAvailable of /proc/meminfo
+    size_t available_ram()
+    {
+        std::ifstream input("/proc/meminfo");
+        std::string line;
+        while (std::getline(input, line))
+        {
+            size_t kbytes;
+            if ((line.rfind("MemAvailable:", 0) == 0) && (std::istringstream(line.substr(13)) >> kbytes))
+                return kbytes * 1024ul;
+        }
+        return SIZE_MAX;
+    }
+}
+
+MemoryBudget& MemoryBudget::instance()
+{
+    static MemoryBudget budget;
+    return budget;
+}
+
+void MemoryBudget::set_limit(size_t limit)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_limit = limit;
+}
+
+size_t MemoryBudget::limit() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_limit;
+}
+
+size_t MemoryBudget::used() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_used;
+}
+
+size_t MemoryBudget::peak() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_peak;
+}
+
+// Limit for large requests, 0 if unlimited
+size_t MemoryBudget::large_limit() const
+{
+    return m_limit - std::min(m_limit / 16, MAX_RESERVE);
+}
+
+size_t MemoryBudget::available() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_limit == 0)
+        return SIZE_MAX;
+    return this->large_limit() - std::min(m_used, this->large_limit());
+}
+
+size_t MemoryBudget::acquire(size_t requested, size_t minimum)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    this->reclaim(lock, requested, this->large_limit());
+    size_t granted = requested;
+    if (m_limit > 0)
+    {
+        size_t available = this->large_limit() - std::min(m_used, this->large_limit());
+        granted = std::min(requested, available);
+        if (granted < minimum)
+            this->throw_exhausted(minimum);
+    }
+    m_used += granted;
+    m_peak = std::max(m_peak, m_used);
+    return granted;
+}
+
+bool MemoryBudget::try_acquire(size_t size)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    this->reclaim(lock, size, this->large_limit());
+    if ((m_limit > 0) && (m_used + size > this->large_limit()))
+        return false;
+    m_used += size;
+    m_peak = std::max(m_peak, m_used);
+    return true;
+}
+
+void MemoryBudget::acquire_fixed(size_t size)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    this->reclaim(lock, size, m_limit);
+    if ((m_limit > 0) && (m_used + size > m_limit))
+        this->throw_exhausted(size);
+    m_used += size;
+    m_peak = std::max(m_peak, m_used);
+}
+
+void MemoryBudget::release(size_t size)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_used -= std::min(size, m_used);
+}
+
+void MemoryBudget::set_reclaimer(void (*reclaimer)())
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_reclaimer = reclaimer;
+}
+
+// Frees memory held for reuse if a request of given size does not fit into the limit, mutex should be locked.
+// Reclaimer returns memory to the budget itself, so it is called with the mutex unlocked.
+void MemoryBudget::reclaim(std::unique_lock<std::mutex>& lock, size_t size, size_t limit)
+{
+    if ((m_limit == 0) || (m_used + size <= limit) || (m_reclaimer == nullptr))
+        return;
+    void (*reclaimer)() = m_reclaimer;
+    lock.unlock();
+    reclaimer();
+    lock.lock();
+}
+
+void MemoryBudget::throw_exhausted(size_t size) const
+{
+    std::cerr << boost::format("Could not allocate %1% MB: %2% MB out of %3% MB memory limit are in use.\n")
+        % ((size + ONE_MB - 1) / ONE_MB) % (m_used / ONE_MB) % (m_limit / ONE_MB);
+    throw std::runtime_error("Memory limit is too low, please increase --mem-limit value!");
+}
+
+MemoryBudget::Reservation& MemoryBudget::Reservation::operator=(Reservation&& other)
+{
+    if (this != &other)
+    {
+        this->reset();
+        m_size = other.m_size;
+        other.m_size = 0;
+    }
+    return *this;
+}
+
+MemoryBudget::Reservation MemoryBudget::Reservation::fixed(size_t size)
+{
+    MemoryBudget::instance().acquire_fixed(size);
+    Reservation result;
+    result.m_size = size;
+    return result;
+}
+
+bool MemoryBudget::Reservation::try_grow(size_t size)
+{
+    if (!MemoryBudget::instance().try_acquire(size))
+        return false;
+    m_size += size;
+    return true;
+}
+
+void MemoryBudget::Reservation::reset()
+{
+    if (m_size > 0)
+        MemoryBudget::instance().release(m_size);
+    m_size = 0;
+}
+
+size_t MemoryBudget::system_memory()
+{
+    size_t result = available_ram();
+    // lines of /proc/self/cgroup are "<id>:<controllers>:<path>", cgroup v2 has empty controllers
+    std::ifstream input("/proc/self/cgroup");
+    std::string line;
+    while (std::getline(input, line))
+    {
+        size_t first = line.find(':'), second = line.find(':', first + 1);
+        if ((first == std::string::npos) || (second == std::string::npos))
+            continue;
+        std::string controllers = line.substr(first + 1, second - first - 1);
+        std::string path = line.substr(second + 1);
+        if (controllers.empty())
+        {
+            result = std::min(result, cgroup_limit("/sys/fs/cgroup", path, "memory.max"));
+            result = std::min(result, cgroup_limit("/sys/fs/cgroup/unified", path, "memory.max"));
+        } else if ((',' + controllers + ',').find(",memory,") != std::string::npos) {
+            result = std::min(result, cgroup_limit("/sys/fs/cgroup/memory", path, "memory.limit_in_bytes"));
+        }
+    }
+    return (result == SIZE_MAX) ? 0 : result;
+}
@@ -0,0 +1,83 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <mutex>
+
+/*
+Memory budget of a run (--mem-limit), shared by all components that allocate large amounts of memory:
+input buffers, arrays of sorted records, merge buffers, hash tables and output buffers draw from it,
+so that tracked memory never exceeds the limit.
+Large requests may be granted partially: a component that gets less than it asked for shrinks its buffers
+or spills data to disk. A small share of the limit is kept for fixed-size allocations (e.g. output streams)
+and untracked memory of the program itself, only fixed-size requests may use it.
+The budget is unlimited (but still tracked) until a limit is set.
+*/
+class MemoryBudget
+{
+public:
+    static MemoryBudget& instance();
+    void set_limit(size_t);
+    size_t limit() const;
+    size_t used() const;
+    size_t peak() const;
+    // memory currently available for large requests
+    size_t available() const;
+    // Grants as much of requested size as available, but not less than minimum; throws if even minimum is not available
+    size_t acquire(size_t requested, size_t minimum);
+    // Grants exactly requested size if it is available
+    bool try_acquire(size_t);
+    // Grants requested size out of the whole limit; throws if it is not available
+    void acquire_fixed(size_t);
+    void release(size_t);
+    // Function that frees memory held for reuse (idle buffers), called before a request is refused
+    void set_reclaimer(void (*)());
+    // Memory available to the process: the lowest of cgroup (v1 or v2) limits and available RAM, 0 if unknown
+    static size_t system_memory();
+
+    // Granted memory that is returned to the budget on destruction
+    class Reservation
+    {
+    public:
+        Reservation() {}
+        Reservation(size_t requested, size_t minimum) : m_size(MemoryBudget::instance().acquire(requested, minimum)) {}
+        Reservation(Reservation&& other) : m_size(other.m_size)     { other.m_size = 0; }
+        Reservation& operator=(Reservation&&);
+        Reservation(const Reservation&) = delete;
+        Reservation& operator=(const Reservation&) = delete;
+        ~Reservation()                                              { this->reset(); }
+        static Reservation fixed(size_t);
+        inline size_t size()                        const   { return m_size; }
+        bool try_grow(size_t);
+        void reset();
+    private:
+        size_t m_size = 0;
+    };
+
+    // Memory of a growing structure (e.g. hash table), drawn from the budget in steps
+    class Tracker
+    {
+    public:
+        // Accounts for more memory, returns false if the budget is exhausted
+        bool add(size_t bytes)
+        {
+            m_used += bytes;
+            return (m_used <= m_memory.size()) || m_memory.try_grow(std::max(STEP, m_used - m_memory.size()));
+        }
+        inline void sub(size_t bytes)               { m_used -= std::min(bytes, m_used); }
+        inline size_t used()                const   { return m_used; }
+        void reset()                                { m_memory.reset(); m_used = 0; }
+    private:
+        static constexpr size_t STEP = 16ul * 1024ul * 1024ul;
+        Reservation m_memory;
+        size_t m_used = 0;
+    };
+private:
+    MemoryBudget() {}
+    size_t large_limit() const;
+    void reclaim(std::unique_lock<std::mutex>&, size_t, size_t);
+    void throw_exhausted(size_t) const;
+private:
+    mutable std::mutex m_mutex;
+    size_t m_limit = 0, m_used = 0, m_peak = 0;
+    void (*m_reclaimer)() = nullptr;
+};
@@ -3,12 +3,16 @@
 #include <cstdio>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <queue>
 #include <vector>
 
 #include "constants.hpp"
 #include "bufferedinput.hpp"
+#include "external_sort.hpp"
 #include "file_utils.hpp"
+#include "memory_budget.hpp"
+#include "run_stats.hpp"
 
 
 template<class T>
@@ -33,6 +37,110 @@ struct RecordPair
     }
 };
 
+// Reads record pairs from two synchronized files, or from a single interleaved file
+// (mates follow each other) if the second file name is empty; mimics BufferedInput interface
+template<class T>
+class PairedBufferedInput
+{
+public:
+    PairedBufferedInput(std::streamsize size) : m_size(size) {}
+    bool eof()          { return m_left->eof() || (m_right && m_right->eof()); }
+    bool block_end()    { return m_right ? (m_left->block_end() || m_right->block_end()) : m_block_end; }
+    void set_files(const char* infilename1, const char* infilename2);
+    void unset_files();
+    void refresh();
+    RecordPair<T> next();
+    // low-latency input of files set afterwards, see BufferedInput::set_partial
+    void set_partial(bool partial)  { m_partial = partial; }
+private:
+    void next_mate();
+private:
+    std::streamsize m_size;
+    bool m_partial = false;
+    // interleaved input is read by a single buffer of both sizes
+    std::unique_ptr<BufferedInput<T>> m_left, m_right;
+    // first mate of the next interleaved pair, block ends if its second mate is not in the buffer yet
+    T m_mate;
+    bool m_block_end = true;
+};
+
+template<class T>
+void PairedBufferedInput<T>::set_files(const char* infilename1, const char* infilename2)
+{
+    bool interleaved = (*infilename2 == '\0');
+    if (!m_left)
+        m_left = std::make_unique<BufferedInput<T>>(interleaved ? 2 * m_size : m_size);
+    if (!interleaved && !m_right)
+        m_right = std::make_unique<BufferedInput<T>>(m_size);
+    // a complete interleaved pair is two records
+    m_left->set_partial(m_partial ? (interleaved ? 2 : 1) : 0);
+    m_left->set_file(infilename1);
+    if (interleaved)
+    {
+        m_right.reset();
+        this->next_mate();
+        if (m_block_end && !m_left->eof())
+            throw std::runtime_error("Not enough memory to read a single pair of records!");
+    } else {
+        m_right->set_partial(m_partial ? 1 : 0);
+        m_right->set_file(infilename2);
+    }
+}
+
+template<class T>
+void PairedBufferedInput<T>::unset_files()
+{
+    m_left->unset_file();
+    if (m_right)
+        m_right->unset_file();
+    m_block_end = true;
+}
+
+template<class T>
+void PairedBufferedInput<T>::refresh()
+{
+    if (m_right)
+    {
+        m_left->refresh();
+        m_right->refresh();
+        return;
+    }
+    // first mate of the next pair is kept as well
+    if (!m_block_end)
+        m_left->unread(std::move(m_mate));
+    m_left->refresh();
+    this->next_mate();
+    // buffer is full, unless input has ended
+    if (m_block_end && !m_left->eof())
+        throw std::runtime_error("Not enough memory to read a single pair of records!");
+}
+
+template<class T>
+RecordPair<T> PairedBufferedInput<T>::next()
+{
+    if (m_right)
+        return RecordPair<T>(m_left->next(), m_right->next());
+    RecordPair<T> pair(m_mate, m_left->next());
+    this->next_mate();
+    return pair;
+}
+
+// Reads the first mate of the next interleaved pair, it is given back to the buffer if its second mate is not there
+template<class T>
+void PairedBufferedInput<T>::next_mate()
+{
+    m_block_end = m_left->block_end();
+    if (m_block_end)
+        return;
+    m_mate = m_left->next();
+    if (!m_left->block_end())
+        return;
+    if (m_left->eof())
+        throw std::runtime_error("Interleaved input has an odd number of records, the last one has no mate!");
+    m_left->unread(std::move(m_mate));
+    m_block_end = true;
+}
+
 template<class T>
 struct PairedQueueNode
 {
@@ -50,48 +158,76 @@ template <class T>
 class PairedExternalSorter
 {
 public:
-    PairedExternalSorter(ssize_t, const char*);
+    PairedExternalSorter(ssize_t, FileUtils::TemporaryDirectory*);
     ~PairedExternalSorter();
-    void sort(const char*, const char*, const char*, const char*);
+    SortResult sort(const char*, const char*, const char*, const char*, bool in_memory = false);
+    inline std::vector<RecordPair<T>>& records() { return m_records; }
 private:
-    void sort_buckets(const char*, const char*);
+    void sort_buckets(const char*, const char*, bool);
+    bool check_sorted(PairedBufferedInput<T>&, const RecordPair<T>&);
     void mergeHelper(ssize_t, ssize_t, ssize_t);
     void merge(const char*, const char*);
     void reserve(ssize_t);
     void saveOutput(ssize_t, const char*, const char*);
+    std::string chunk_name(ssize_t, int) const;
 private:
-    const char* m_tempdir = "chunks";
-    const char* m_workdir;
+    std::vector<std::string> m_chunkdirs;
     ssize_t m_memlimit, m_filesNum;
+    size_t m_num_records = 0ul;  // number of record pairs in sorted runs
+    bool m_presorted = false;
+    bool m_compressed;  // sorted runs are written compressed
     std::priority_queue<PairedQueueNode<T>, std::vector<PairedQueueNode<T>>> m_queue;
     std::vector<BufferedInput<T>> m_buffers;
+    // keep data of a single sorted chunk alive for in-memory processing
+    std::unique_ptr<PairedBufferedInput<T>> m_input;
+    std::vector<RecordPair<T>> m_records;
+    MemoryBudget::Reservation m_views;
 };
 
 template <class T>
 PairedExternalSorter<T>::PairedExternalSorter(ssize_t memlimit,
-                                              const char* workdir) : m_workdir(workdir), m_memlimit(memlimit)
+                                              FileUtils::TemporaryDirectory* tempdir) : m_memlimit(memlimit),
+                                                                                        m_compressed(tempdir->compressed())
 {
-    std::ignore = chdir(m_workdir);
-    FS::create_directory(m_tempdir);
-    std::ignore = chdir("..");
+    m_chunkdirs = tempdir->create_subdirs("chunks");
 }
 
 template <class T>
 PairedExternalSorter<T>::~PairedExternalSorter()
 {
-    std::ignore = chdir(m_workdir);
-    FS::remove_all(m_tempdir);
-    std::ignore = chdir("..");
+    for (auto& dirname: m_chunkdirs)
+        FS::remove_all(dirname);
+}
+
+template <class T>
+std::string PairedExternalSorter<T>::chunk_name(ssize_t idx, int side) const
+{   // chunks are striped across all scratch directories, mates are kept together
+    return (boost::format("%1%/%2%_%3%.tmp") % m_chunkdirs[idx % m_chunkdirs.size()] % idx % side).str();
 }
 
+// If in_memory flag is set and whole input fits in a single chunk, no files are written:
+// sorted record pairs are kept in memory and can be accessed via records() method.
+// If inputs are already sorted, nothing is written either and input files should be used as is.
 template <class T>
-void PairedExternalSorter<T>::sort(const char* infilename1,
-                                   const char* infilename2,
-                                   const char* outfilename1,
-                                   const char* outfilename2)
+SortResult PairedExternalSorter<T>::sort(const char* infilename1,
+                                         const char* infilename2,
+                                         const char* outfilename1,
+                                         const char* outfilename2,
+                                         bool in_memory)
 {
-    this->sort_buckets(infilename1, infilename2);
+    RunStats::Phase phase("sort: run generation");
+    this->sort_buckets(infilename1, infilename2, in_memory);
+    phase.set("runs", m_filesNum);
+    phase.set("records", m_num_records);
+    phase.finish();
+    if (m_filesNum == 0)  // empty input is sorted as is
+        m_presorted = true;
+    if (m_input)
+        return SortResult::SR_IN_MEMORY;
+    if (m_presorted)
+        return SortResult::SR_PRESORTED;
     this->merge(outfilename1, outfilename2);
+    return SortResult::SR_SAVED;
 }
 
 template <class T>
@@ -102,8 +238,9 @@ void PairedExternalSorter<T>::reserve(ssize_t count)
     container.reserve(count);
     m_queue = std::priority_queue<PairedQueueNode<T>, std::vector<PairedQueueNode<T>>>
         (std::less<PairedQueueNode<T>>(), std::move(container));
-    // input buffers
-    ssize_t mem = std::max(this->m_memlimit / (count*2), constants::ONE_MB);
+    // input buffers, decompressors of compressed runs take their share of memory as well
+    ssize_t decompressor = FileUtils::RunOutputFile::read_memory(m_compressed);
+    ssize_t mem = std::max(this->m_memlimit / (count*2) - decompressor, constants::ONE_MB);
     this->m_buffers.reserve(count * 2);
     for (ssize_t i = 0; i < count*2; ++i)
         this->m_buffers.emplace_back(mem);
@@ -111,35 +248,64 @@ void PairedExternalSorter<T>::reserve(ssize_t count)
 
 template <class T>
 void PairedExternalSorter<T>::sort_buckets(const char* infilename1,
-                                           const char* infilename2)
+                                           const char* infilename2,
+                                           bool in_memory)
 {
-    std::ofstream output1;
-    std::ofstream output2;
-
     m_filesNum = 0;
+    // "view" objects take up to 1/3 of corresponding memory chunk,
+    // a chunk ends early if its records do not fit there
+    m_views = MemoryBudget::Reservation(m_memlimit / 3, constants::ONE_MB);
     std::vector<RecordPair<T>> arr;
-    // TODO arr.reserve???
-    // "view" objects take up to 1/3 of corresponding memory chunk
-    BufferedInput<T> buffer1(m_memlimit / 3);
-    BufferedInput<T> buffer2(m_memlimit / 3);
-    buffer1.set_file(infilename1);
-    buffer2.set_file(infilename2);
+    arr.reserve(m_views.size() / sizeof(RecordPair<T>));
+    auto input = std::make_unique<PairedBufferedInput<T>>(m_memlimit / 3);
+    PairedBufferedInput<T>& buffer = *input;
+    buffer.set_files(infilename1, infilename2);
+    bool check_order = true;
 
-    while(!buffer1.eof() && !buffer2.eof())
+    while(!buffer.eof())
     {
         m_filesNum++;
         // read paired chunks of "view" objects from files
-        while (!buffer1.block_end() && !buffer2.block_end())
-            arr.emplace_back(buffer1.next(), buffer2.next());
+        while (!buffer.block_end() && (arr.size() < arr.capacity()))
+            arr.push_back(buffer.next());
+        if (check_order && std::is_sorted(arr.begin(), arr.end()))
+        {   // first chunk is already sorted -> the whole input may need no sorting
+            bool input_end = buffer.eof();
+            if (in_memory && input_end)
+            {
+                m_input = std::move(input);
+                m_records = std::move(arr);
+                return;
+            }
+            if (input_end || this->check_sorted(buffer, arr.back()))
+            {
+                m_presorted = true;
+                m_views.reset();
+                return;
+            }
+            // order is broken further in input -> start over
+            m_filesNum = 0;
+            arr.clear();
+            buffer.unset_files();
+            buffer.set_files(infilename1, infilename2);
+            check_order = false;
+            continue;
+        }
+        check_order = false;
+        m_num_records += arr.size();
         // sort objects
         std::sort(arr.begin(), arr.end());
+        if (in_memory && (m_filesNum == 1) && buffer.eof())
+        {   // whole input fits in memory, no need to save it
+            m_input = std::move(input);
+            m_records = std::move(arr);
+            return;
+        }
         // save sorted chunks to paired files in tmp dir
-        boost::format outname1 = boost::format("%1%/%2%/%3%_1.tmp") % m_workdir % m_tempdir % (m_filesNum - 1);
-        boost::format outname2 = boost::format("%1%/%2%/%3%_2.tmp") % m_workdir % m_tempdir % (m_filesNum - 1);
-        output1.open(outname1.str());
-        output2.open(outname2.str());
-        check_fstream_ok<std::ofstream>(output1, outname1.str().c_str());
-        check_fstream_ok<std::ofstream>(output2, outname2.str().c_str());
+        std::string outname1 = this->chunk_name(m_filesNum - 1, 1);
+        std::string outname2 = this->chunk_name(m_filesNum - 1, 2);
+        FileUtils::RunOutputFile output1(outname1.c_str(), m_compressed);
+        FileUtils::RunOutputFile output2(outname2.c_str(), m_compressed);
         for (auto& item: arr)
         {
             output1 << item.left;
@@ -149,9 +315,41 @@ void PairedExternalSorter<T>::sort_buckets(const char* infilename1,
         output2.close();
         // empty array and load new chunks of data
         arr.clear();
-        buffer1.refresh();
-        buffer2.refresh();
+        buffer.refresh();
+    }
+    // memory of views is only kept by in-memory result
+    m_views.reset();
+}
+
+// Checks whether the rest of inputs follows the given record pair in sorted order
+template <class T>
+bool PairedExternalSorter<T>::check_sorted(PairedBufferedInput<T>& buffer,
+                                           const RecordPair<T>& last)
+{
+    // previous records are copied since buffer contents are shifted on refresh
+    std::string boundary1(last.left.start(), last.left.size());
+    std::string boundary2(last.right.start(), last.right.size());
+    RecordPair<T> prev(last);
+    prev.left.read_new(boundary1.data(), boundary1.data() + boundary1.size());
+    prev.right.read_new(boundary2.data(), boundary2.data() + boundary2.size());
+    buffer.refresh();
+
+    while (!buffer.eof())
+    {
+        while (!buffer.block_end())
+        {
+            RecordPair<T> pair = buffer.next();
+            if (pair < prev)
+                return false;
+            prev = std::move(pair);
+        }
+        boundary1.assign(prev.left.start(), prev.left.size());
+        boundary2.assign(prev.right.start(), prev.right.size());
+        prev.left.read_new(boundary1.data(), boundary1.data() + boundary1.size());
+        prev.right.read_new(boundary2.data(), boundary2.data() + boundary2.size());
+        buffer.refresh();
     }
+    return true;
 }
 
 template <class T>
@@ -160,14 +358,15 @@ void PairedExternalSorter<T>::mergeHelper(ssize_t start,
                                           ssize_t location)
 {
     ssize_t filesCount = end - start;
+    RunStats::Phase phase("sort: merge pass");
+    phase.set("fan_in", filesCount);
+    size_t num_records = 0ul;
     std::vector<std::string> filenames;
     filenames.reserve(filesCount*2);
     // set up files
     for (ssize_t i = 0; i < filesCount; ++i) {
-        boost::format inpname1 = boost::format("%1%/%2%/%3%_1.tmp") % m_workdir % m_tempdir % (start+i);
-        boost::format inpname2 = boost::format("%1%/%2%/%3%_2.tmp") % m_workdir % m_tempdir % (start+i);
-        filenames.push_back(inpname1.str());
-        filenames.push_back(inpname2.str());
+        filenames.push_back(this->chunk_name(start+i, 1));
+        filenames.push_back(this->chunk_name(start+i, 2));
         m_buffers[2*i].set_file(filenames[2*i].c_str());
         m_buffers[2*i+1].set_file(filenames[2*i+1].c_str());
     }
@@ -180,13 +379,10 @@ void PairedExternalSorter<T>::mergeHelper(ssize_t start,
         }
     }
     // output files
-    std::ofstream output1, output2;
-    boost::format outname1 = boost::format("%1%/%2%/%3%_1.tmp") % m_workdir % m_tempdir % location;
-    boost::format outname2 = boost::format("%1%/%2%/%3%_2.tmp") % m_workdir % m_tempdir % location;
-    output1.open(outname1.str());
-    output2.open(outname2.str());
-    check_fstream_ok<std::ofstream>(output1, outname1.str().c_str());
-    check_fstream_ok<std::ofstream>(output2, outname2.str().c_str());
+    std::string outname1 = this->chunk_name(location, 1);
+    std::string outname2 = this->chunk_name(location, 2);
+    FileUtils::RunOutputFile output1(outname1.c_str(), m_compressed);
+    FileUtils::RunOutputFile output2(outname2.c_str(), m_compressed);
     // merge files iteratively
     while (!m_queue.empty())
     {
@@ -194,6 +390,7 @@ void PairedExternalSorter<T>::mergeHelper(ssize_t start,
         output1 << m_queue.top().data().left;
         output2 << m_queue.top().data().right;
         m_queue.pop();
+        num_records++;
         // push new item from file to queue if possible
         if (m_buffers[2*index].block_end())
             m_buffers[2*index].refresh();
@@ -208,6 +405,7 @@ void PairedExternalSorter<T>::mergeHelper(ssize_t start,
         m_buffers[2*i].unset_file();
         m_buffers[2*i+1].unset_file();
     }
+    phase.set("records", num_records);
     output1.close();
     output2.close();
     for (auto& name: filenames)
@@ -225,6 +423,9 @@ void PairedExternalSorter<T>::merge(const char* outfilename1,
     }
 
     ssize_t start = 0, end = m_filesNum, step = 50L;
+    // decompressors of merged runs (two per run) take at most half of memory
+    if (m_compressed)
+        step = std::clamp<ssize_t>(m_memlimit / (4 * FileUtils::RunOutputFile::read_memory(true)), 2L, step);
 
     if (step > end-start)
     {// can merge all files in one cycle
@@ -261,8 +462,6 @@ void PairedExternalSorter<T>::saveOutput(ssize_t idx,
                                          const char* outfilename1,
                                          const char* outfilename2)
 {
-    boost::format name1 = boost::format("%1%/%2%/%3%_1.tmp") % m_workdir % m_tempdir % idx;
-    boost::format name2 = boost::format("%1%/%2%/%3%_2.tmp") % m_workdir % m_tempdir % idx;
-    std::rename(name1.str().c_str(), outfilename1);
-    std::rename(name2.str().c_str(), outfilename2);
+    FileUtils::move_file(this->chunk_name(idx, 1), outfilename1);
+    FileUtils::move_file(this->chunk_name(idx, 2), outfilename2);
 }
\ No newline at end of file
@@ -0,0 +1,110 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <exception>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "line_index.hpp"
+
+// Calls func(thread_idx) for every thread_idx in [0, n) concurrently, the calling thread included.
+// Rethrows the first exception thrown by any of the calls.
+template<class F>
+void runParallel(uint n, F&& func)
+{
+    std::vector<std::exception_ptr> errors(n);
+    auto worker = [&](uint thread_idx)
+    {
+        try {
+            func(thread_idx);
+        } catch (...) {
+            errors[thread_idx] = std::current_exception();
+        }
+    };
+    std::vector<std::thread> threads;
+    for (uint i = 1; i < n; ++i)
+        threads.emplace_back(worker, i);
+    worker(0);
+    for (auto& thread: threads)
+        thread.join();
+    for (auto& error: errors)
+        if (error)
+            std::rethrow_exception(error);
+}
+
+// Splits text buffer into n ranges of about the same size, each one starting at a record start;
+// known record starts (sorted) are used when there is one in the share of a range, rather than searched for.
+// Returns n+1 range bounds
+template<class T>
+std::vector<char*> splitRecords(char* start, char* stop, uint n, const std::vector<char*>& starts = {})
+{
+    std::vector<char*> bounds{start};
+    for (uint i = 1; i < n; ++i)
+    {
+        char* guess = start + (stop - start) / n * i;
+        auto known = std::lower_bound(starts.begin(), starts.end(), guess);
+        if (guess <= bounds.back())
+            bounds.push_back(bounds.back());
+        else if ((known != starts.end()) && (*known < guess + (stop - start) / n))
+            bounds.push_back(*known);
+        else
+            bounds.push_back(T::find_record_start(guess, stop));
+    }
+    bounds.push_back(stop);
+    return bounds;
+}
+
+/*
+Parses complete records of text buffer using n threads and appends them to records in order,
+until there are max_records of them. Known record starts (see splitRecords) split buffer exactly.
+Each thread counts records in its range first, so that all of them are placed without extra copies.
+Returns number of bytes parsed: incomplete record at the end of buffer (and records beyond the limit) are left as is.
+*/
+template<class T>
+std::streamsize parseParallel(char* start, char* stop, uint n, std::vector<T>& records, size_t max_records = SIZE_MAX,
+                              const std::vector<char*>& starts = {})
+{
+    static_assert(T::LINES_PER_RECORD > 0, "Only text records can be split between threads");
+    std::vector<char*> bounds = splitRecords<T>(start, stop, n, starts);
+    std::vector<size_t> offsets(n + 1, records.size());
+    runParallel(n, [&](uint idx)
+    {
+        offsets[idx+1] = LineIndex::count(bounds[idx], bounds[idx+1]) / T::LINES_PER_RECORD;
+    });
+    for (uint i = 0; i < n; ++i)
+        offsets[i+1] += offsets[i];
+    // ranges are cut at the limit, the range holding the last record is the last one parsed
+    size_t limit = std::min(offsets[n], std::max(max_records, records.size()));
+    bool truncated = (limit < offsets[n]);
+    for (uint i = 0; i < n; ++i)
+        offsets[i+1] = std::min(offsets[i+1], limit);
+    records.resize(limit);
+
+    std::vector<char*> ends(n);
+    runParallel(n, [&](uint idx)
+    {
+        RecordReader<T> reader;
+        reader.reset(bounds[idx], bounds[idx+1]);
+        char* end = bounds[idx];
+        for (size_t i = offsets[idx]; i < offsets[idx+1]; ++i)
+        {
+            std::streamsize size = reader.read(records[i]);
+            if (size < 0)
+                throw std::runtime_error("Could not split input into records, input file may be malformed!");
+            end += size;
+        }
+        ends[idx] = end;
+    });
+    if (limit == offsets[0])
+        return 0;
+    uint i = 0;
+    // only the range at the end of buffer may end with an incomplete record,
+    // or the range holding the last record if the limit is reached
+    for (; truncated ? (offsets[i+1] < limit) : (bounds[i+1] != stop); ++i)
+    {
+        if (ends[i] != bounds[i+1])
+            throw std::runtime_error("Could not split input into records, input file may be malformed!");
+    }
+    return ends[i] - start;
+}
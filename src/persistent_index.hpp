@@ -0,0 +1,163 @@
+#pragma once
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+
+#include "file_utils.hpp"
+#include "keyview.hpp"
+
+/*
+Sorted set of unique sequences (N = 1) or sequence pairs (N = 2) kept between runs
+(--index-in / --index-out options), so that new data can be deduplicated against already processed one.
+
+Binary layout:
+    "FQDX" | uint32 N | sorted keys in KeyView<N> format
+Record offsets are meaningless in stored keys and are set to 0.
+*/
+namespace PersistentIndex
+{
+    const char MAGIC[4] = {'F', 'Q', 'D', 'X'};
+
+    // Sequential reader of a stored index
+    template<int N>
+    class Reader
+    {
+    public:
+        Reader(const std::string&);
+        inline bool eof()                       const   { return m_eof; }
+        // current sequence, with trailing newline as in records
+        inline const std::string& seq(int i)    const   { return m_seqs[i]; }
+        template<class T>
+        int cmp(const T* const*) const;
+        void next();
+        inline const std::string& raw()         const   { return m_raw; }
+    private:
+        std::ifstream m_input;
+        std::string m_raw, m_seqs[N];
+        bool m_eof = false;
+    };
+
+    // Writes keys to a temporary file, which replaces target file on commit,
+    // so that the same index can be used as an input and an output of a run
+    template<int N>
+    class Writer
+    {
+    public:
+        Writer(const std::string&);
+        ~Writer();
+        template<class T>
+        void add(const T* const*);
+        void add(const Reader<N>& reader)       { m_output.write(reader.raw().data(), reader.raw().size()); }
+        void commit();
+    private:
+        std::string m_filename, m_tmpname, m_buf;
+        std::ofstream m_output;
+        bool m_committed = false;
+    };
+
+    template<int N>
+    Reader<N>::Reader(const std::string& filename)
+    {
+        m_input.open(filename, std::ios_base::binary);
+        check_fstream_ok<std::ifstream>(m_input, filename.c_str());
+        char magic[sizeof(MAGIC)];
+        uint32_t n = 0;
+        m_input.read(magic, sizeof(MAGIC));
+        m_input.read(reinterpret_cast<char*>(&n), sizeof(n));
+        if (!m_input || memcmp(magic, MAGIC, sizeof(MAGIC)))
+        {
+            std::cerr << "File " << filename << " is not a deduplication index!" << std::endl;
+            throw std::runtime_error("Invalid index file provided!");
+        }
+        if (n != N)
+        {
+            std::cerr << "Index " << filename << " was built for " << ((n == 1) ? "single-end" : "paired-end") << " data!" << std::endl;
+            throw std::runtime_error("Invalid index file provided!");
+        }
+        this->next();
+    }
+
+    template<int N>
+    void Reader<N>::next()
+    {
+        m_raw.resize(KeyView<N>::HEADER_SIZE);
+        m_input.read(m_raw.data(), m_raw.size());
+        if (m_input.gcount() == 0)
+        {
+            m_eof = true;
+            return;
+        }
+        if (m_input.gcount() == KeyView<N>::HEADER_SIZE)
+        {
+            m_raw.resize(KeyView<N>::full_size(m_raw.data()));
+            m_input.read(m_raw.data() + KeyView<N>::HEADER_SIZE, m_raw.size() - KeyView<N>::HEADER_SIZE);
+        }
+        if (!m_input)
+            throw std::runtime_error("Index file is truncated!");
+
+        KeyView<N> key;
+        key.read_new(m_raw.data(), m_raw.data() + m_raw.size());
+        for (int i = 0; i < N; ++i)
+        {
+            m_seqs[i].resize(key.codes(i) + 1);
+            m_seqs[i].resize(key.unpack(i, m_seqs[i].data()) + 1);
+            m_seqs[i].back() = '\n';
+        }
+    }
+
+    // Compares current key with record(s) in the same way as records are compared with each other
+    template<int N>
+    template<class T>
+    int Reader<N>::cmp(const T* const* records) const
+    {
+        for (int i = 0; i < N; ++i)
+        {
+            ssize_t len = m_seqs[i].size(), other_len = records[i]->seq_len();
+            int res = strncmp(m_seqs[i].data(), records[i]->seq(), std::min(len, other_len));
+            if (res != 0)
+                return res;
+            if (len != other_len)
+                return (len < other_len) ? -1 : 1;
+        }
+        return 0;
+    }
+
+    template<int N>
+    Writer<N>::Writer(const std::string& filename) : m_filename(filename), m_tmpname(filename + ".tmp")
+    {
+        m_output.open(m_tmpname, std::ios_base::binary);
+        check_fstream_ok<std::ofstream>(m_output, m_tmpname.c_str());
+        uint32_t n = N;
+        m_output.write(MAGIC, sizeof(MAGIC));
+        m_output.write(reinterpret_cast<const char*>(&n), sizeof(n));
+    }
+
+    template<int N>
+    Writer<N>::~Writer()
+    {
+        if (!m_committed)
+        {
+            m_output.close();
+            FS::remove(m_tmpname);
+        }
+    }
+
+    template<int N>
+    template<class T>
+    void Writer<N>::add(const T* const* records)
+    {
+        const uint64_t offsets[N] = {};
+        KeyView<N>::save(m_output, records, offsets, m_buf);
+    }
+
+    template<int N>
+    void Writer<N>::commit()
+    {
+        m_output.close();
+        if (!m_output)
+            throw std::runtime_error("Could not write index file!");
+        FileUtils::move_file(m_tmpname, m_filename);
+        m_committed = true;
+    }
+}
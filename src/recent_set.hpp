@@ -0,0 +1,69 @@
+#pragma once
+#include <list>
+#include <unordered_map>
+
+#include "memory_budget.hpp"
+
+/*
+Bounded set of recently seen keys for streaming deduplication.
+Keys are evicted in least-recently-seen order once either the number of keys exceeds the limit
+or memory budget does not allow their estimated footprint to grow any further.
+*/
+template<class Key, class Hash>
+class RecentSet
+{
+public:
+    RecentSet(size_t max_keys) : m_max_keys(max_keys) {}
+    // Returns true if key was not seen recently; a key that was seen is marked as the most recent one
+    bool insert(Key&&, size_t);
+    inline size_t size()        const   { return m_keys.size(); }
+    inline size_t evicted()     const   { return m_evicted; }
+private:
+    // approximate allocation overhead of a key in both containers: nodes with allocator headers,
+    // hash table buckets (twice as many while rehashing) and a header of key's own allocation
+    static const size_t ENTRY_OVERHEAD = sizeof(Key) + 16 * sizeof(void*);
+    struct Entry
+    {
+        typename std::list<const Key*>::iterator position;
+        size_t bytes;
+    };
+    void evict();
+private:
+    std::unordered_map<Key, Entry, Hash> m_keys;
+    std::list<const Key*> m_order;  // points to keys of m_keys, least recent first
+    MemoryBudget::Tracker m_memory;
+    size_t m_max_keys;
+    size_t m_evicted = 0ul;
+};
+
+template<class Key, class Hash>
+bool RecentSet<Key, Hash>::insert(Key&& key, size_t key_bytes)
+{
+    auto [it, inserted] = m_keys.try_emplace(std::move(key), Entry{m_order.end(), key_bytes + ENTRY_OVERHEAD});
+    if (!inserted)
+    {
+        m_order.splice(m_order.end(), m_order, it->second.position);
+        return false;
+    }
+    // once the budget is exhausted, least recent keys make room for the new one
+    while (!m_memory.add(it->second.bytes) && !m_order.empty())
+    {
+        m_memory.sub(it->second.bytes);
+        this->evict();
+    }
+    // keys of unordered_map are never moved, so pointers to them stay valid
+    it->second.position = m_order.insert(m_order.end(), &it->first);
+    while (m_keys.size() > m_max_keys)
+        this->evict();
+    return true;
+}
+
+template<class Key, class Hash>
+void RecentSet<Key, Hash>::evict()
+{
+    auto it = m_keys.find(*m_order.front());
+    m_memory.sub(it->second.bytes);
+    m_order.pop_front();
+    m_keys.erase(it);
+    m_evicted++;
+}
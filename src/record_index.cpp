@@ -0,0 +1,264 @@
+#include "record_index.hpp"
+#include "constants.hpp"
+#include "file_utils.hpp"
+
+#include <boost/format.hpp>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <mutex>
+
+namespace
+{
+    const char MAGIC[4] = {'F', 'Q', 'I', '\3'};  // format name and version
+
+    // FNV-1a hash
+    uint64_t checksum(uint64_t hash, const char* data, std::streamsize n)
+    {
+        for (std::streamsize i = 0; i < n; ++i)
+        {
+            hash ^= static_cast<unsigned char>(data[i]);
+            hash *= 1099511628211ul;
+        }
+        return hash;
+    }
+
+    template<class V>
+    void write_value(std::ofstream& os, V value)
+    {
+        os.write(reinterpret_cast<const char*>(&value), sizeof(V));
+    }
+
+    template<class V>
+    bool read_value(std::ifstream& is, V& value)
+    {
+        is.read(reinterpret_cast<char*>(&value), sizeof(V));
+        return static_cast<bool>(is);
+    }
+
+    bool read_values(std::ifstream& is, std::vector<uint64_t>& values, uint64_t n)
+    {
+        values.resize(n);
+        is.read(reinterpret_cast<char*>(values.data()), n * sizeof(uint64_t));
+        return static_cast<bool>(is);
+    }
+
+    // indexes of inputs of current run, either loaded or being built
+    struct OpenIndex
+    {
+        std::shared_ptr<const RecordIndex> index;
+        std::shared_ptr<RecordIndex::Builder> builder;
+    };
+    std::mutex open_mutex;
+    std::map<string, OpenIndex> open_indexes;
+}
+
+std::shared_ptr<const RecordIndex> RecordIndex::open(const string& source, bool verbose)
+{
+    auto index = std::make_shared<RecordIndex>();
+    bool loaded = index->load(source);
+    {
+        std::lock_guard<std::mutex> lock(open_mutex);
+        if (loaded)
+            open_indexes[source].index = index;
+        else
+            open_indexes[source].builder = std::make_shared<Builder>(source);
+    }
+    if (!loaded)
+        return nullptr;
+    if (verbose)
+    {
+        std::cout << "Using index " << path(source) << ": ";
+        index->print(std::cout);
+    }
+    return index;
+}
+
+void RecordIndex::close(const string& source, bool verbose)
+{
+    std::shared_ptr<Builder> builder;
+    {
+        std::lock_guard<std::mutex> lock(open_mutex);
+        auto it = open_indexes.find(source);
+        if (it == open_indexes.end())
+            return;
+        builder = std::move(it->second.builder);
+        open_indexes.erase(it);
+    }
+    if (!builder || !builder->complete())
+        return;
+
+    RecordIndex index = builder->result();
+    try {
+        index.save(source);
+    } catch (const std::exception& exc) {
+        // index is only an optimization -> proceed without saving it
+        std::cerr << "Warning: could not save index " << path(source) << ": " << exc.what() << '\n';
+        return;
+    }
+    if (verbose)
+    {
+        std::cout << "Built index " << path(source) << ": ";
+        index.print(std::cout);
+    }
+}
+
+std::shared_ptr<const RecordIndex> RecordIndex::find(const string& source)
+{
+    std::lock_guard<std::mutex> lock(open_mutex);
+    auto it = open_indexes.find(source);
+    return (it != open_indexes.end()) ? it->second.index : nullptr;
+}
+
+std::shared_ptr<RecordIndex::Builder> RecordIndex::claim(const string& source)
+{
+    std::lock_guard<std::mutex> lock(open_mutex);
+    auto it = open_indexes.find(source);
+    if ((it == open_indexes.end()) || !it->second.builder || it->second.builder->m_claimed.exchange(true))
+        return nullptr;
+    return it->second.builder;
+}
+
+// Fingerprint is taken before input is read, so that index of a file changed in the meantime is outdated
+RecordIndex::Builder::Builder(const string& source) : m_source(source)
+{
+    m_index.m_source = fingerprint(source);
+    m_index.m_min_len = UINT64_MAX;
+}
+
+RecordIndex RecordIndex::Builder::result()
+{
+    RecordIndex index = m_index;
+    index.m_bytes = m_end;
+    if (!index.m_records)
+        index.m_min_len = 0;
+    index.find_seek_positions(m_source);
+    return index;
+}
+
+// Positions of indexed records in source: byte offsets of uncompressed file, virtual offsets of BGZF file;
+// none if it is compressed otherwise
+void RecordIndex::find_seek_positions(const string& source)
+{
+    FileUtils::Compression compression = FileUtils::detectCompression(source.c_str());
+    if (compression == FileUtils::Compression::NONE)
+    {
+        m_seek = m_offsets;
+        return;
+    }
+    m_seek.clear();
+    if (compression != FileUtils::Compression::GZIP)
+        return;
+    auto blocks = FileUtils::bgzfBlocks(source.c_str());
+    uint64_t total = 0;
+    for (auto& block: blocks)
+        total += block.second;
+    if (blocks.empty() || (total != m_bytes))
+        return;
+    size_t idx = 0;
+    uint64_t start = 0;  // decompressed offset of current block
+    for (uint64_t offset: m_offsets)
+    {
+        while (offset >= start + blocks[idx].second)
+            start += blocks[idx++].second;
+        m_seek.push_back((blocks[idx].first << 16) | (offset - start));
+    }
+}
+
+// Splits source into at most n ranges of about the same size, each one starting at an indexed record
+std::vector<RecordIndex::Range> RecordIndex::split(uint n) const
+{
+    std::vector<Range> ranges;
+    size_t first = 0;
+    for (uint i = 1; (i <= n) && (first < m_offsets.size()); ++i)
+    {
+        size_t last = m_offsets.size();
+        if (i < n)
+            last = std::lower_bound(m_offsets.begin() + first + 1, m_offsets.end(), m_bytes / n * i) - m_offsets.begin();
+        uint64_t end = (last < m_offsets.size()) ? m_offsets[last] : m_bytes;
+        ranges.push_back({m_seek[first], m_offsets[first], end - m_offsets[first]});
+        first = last;
+    }
+    return ranges;
+}
+
+// Size, modification time and checksum of the first and the last megabytes of file:
+// cheap to compute, but catches rewritten or appended files
+RecordIndex::Fingerprint RecordIndex::fingerprint(const string& source)
+{
+    Fingerprint result;
+    result.size = FS::file_size(source);
+    result.mtime = FS::last_write_time(source).time_since_epoch().count();
+
+    std::ifstream input(source, std::ios_base::binary);
+    check_fstream_ok<std::ifstream>(input, source.c_str());
+    std::vector<char> buf(constants::ONE_MB);
+    uint64_t hash = 14695981039346656037ul;
+    input.read(buf.data(), buf.size());
+    hash = checksum(hash, buf.data(), input.gcount());
+    if (result.size > static_cast<uint64_t>(2 * constants::ONE_MB))
+    {
+        input.clear();
+        input.seekg(result.size - constants::ONE_MB);
+        input.read(buf.data(), buf.size());
+        hash = checksum(hash, buf.data(), input.gcount());
+    }
+    result.checksum = hash;
+    return result;
+}
+
+// Returns false if index is missing, malformed or does not match the source file
+bool RecordIndex::load(const string& source)
+{
+    std::ifstream input(path(source), std::ios_base::binary);
+    if (!input)
+        return false;
+    char magic[sizeof(MAGIC)];
+    input.read(magic, sizeof(MAGIC));
+    if (!input || memcmp(magic, MAGIC, sizeof(MAGIC)))
+        return false;
+
+    Fingerprint stored;
+    uint64_t stride = 0, num_offsets = 0, num_seek = 0;
+    bool ok = read_value(input, stored.size) && read_value(input, stored.mtime) && read_value(input, stored.checksum)
+           && read_value(input, m_records) && read_value(input, m_min_len) && read_value(input, m_max_len)
+           && read_value(input, m_total_len) && read_value(input, m_bytes)
+           && read_value(input, stride) && read_value(input, num_offsets) && read_value(input, num_seek);
+    if (!ok || (stride != STRIDE) || (num_offsets != (m_records + STRIDE - 1) / STRIDE)
+        || ((num_seek != num_offsets) && (num_seek != 0)))
+        return false;
+    if (!read_values(input, m_offsets, num_offsets) || !read_values(input, m_seek, num_seek))
+        return false;
+
+    m_source = fingerprint(source);
+    return (m_source == stored);
+}
+
+void RecordIndex::save(const string& source) const
+{
+    // index is written under a temporary name first so that readers never see a partial file
+    string filename = path(source);
+    string tmpname = filename + ".tmp";
+    {
+        std::ofstream output(tmpname, std::ios_base::binary);
+        check_fstream_ok<std::ofstream>(output, tmpname.c_str());
+        output.write(MAGIC, sizeof(MAGIC));
+        for (uint64_t value: {m_source.size, m_source.mtime, m_source.checksum,
+                              m_records, m_min_len, m_max_len, m_total_len, m_bytes,
+                              STRIDE, static_cast<uint64_t>(m_offsets.size()), static_cast<uint64_t>(m_seek.size())})
+            write_value(output, value);
+        output.write(reinterpret_cast<const char*>(m_offsets.data()), m_offsets.size() * sizeof(uint64_t));
+        output.write(reinterpret_cast<const char*>(m_seek.data()), m_seek.size() * sizeof(uint64_t));
+        if (!output)
+            throw std::runtime_error("Could not write index file!");
+    }
+    FileUtils::move_file(tmpname, filename);
+}
+
+void RecordIndex::print(std::ostream& os) const
+{
+    os << boost::format("%1% records, sequence lengths %2%-%3% (mean %4$.1f)%5%.\n")
+        % m_records % m_min_len % m_max_len % this->mean_len()
+        % ((this->seekable() && (m_offsets.size() > 1)) ? ", can be read in parallel" : "");
+}
@@ -0,0 +1,116 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+using std::string;
+
+/*
+Sidecar index of a sequence file, stored next to it as <input>.fqi:
+number of records, sequence length statistics, (decompressed) byte offsets of every STRIDE-th record
+and a fingerprint of the source file, so that an outdated index is never used.
+Uncompressed and BGZF-compressed (e.g. written by bgzip) inputs can be read from any of these records:
+positions to seek to are stored as well, byte offsets or BGZF virtual offsets respectively
+(offset of compressed block << 16 | offset within its decompressed data).
+
+Indexes of inputs are opened before a run: loaded ones are used by readers of the inputs (see BufferedInput),
+missing or outdated ones are built from records read by the first pass over input and saved after the run.
+*/
+class RecordIndex
+{
+public:
+    static const uint64_t STRIDE = 64L * 1024L;
+
+    // part of source that starts at a record: position to seek to, (decompressed) offset and size
+    struct Range
+    {
+        uint64_t seek, offset, bytes;
+    };
+    class Builder;
+
+    static string path(const string& source)    { return source + ".fqi"; }
+    // indexes of inputs of a run: open() returns loaded index (nullptr if a new one is built),
+    // close() saves the new one if the whole input was read
+    static std::shared_ptr<const RecordIndex> open(const string&, bool);
+    static void close(const string&, bool);
+    // loaded index of an input, if any
+    static std::shared_ptr<const RecordIndex> find(const string&);
+    // index of an input being built, if any: it is fed by a single reader at a time until released
+    static std::shared_ptr<Builder> claim(const string&);
+
+    bool load(const string&);
+    void save(const string&) const;
+
+    inline uint64_t records()       const   { return m_records; }
+    inline uint64_t min_len()       const   { return m_min_len; }
+    inline uint64_t max_len()       const   { return m_max_len; }
+    inline double mean_len()        const   { return m_records ? static_cast<double>(m_total_len) / m_records : 0.0; }
+    // size of (decompressed) source
+    inline uint64_t bytes()         const   { return m_bytes; }
+    // (decompressed) byte offsets of records 0, STRIDE, 2*STRIDE, ...
+    inline const std::vector<uint64_t>& offsets() const { return m_offsets; }
+    // source can be read starting at any of these records
+    inline bool seekable()          const   { return m_seek.size() == m_offsets.size(); }
+    std::vector<Range> split(uint) const;
+    void print(std::ostream&) const;
+private:
+    struct Fingerprint
+    {
+        uint64_t size = 0, mtime = 0, checksum = 0;
+        bool operator==(const Fingerprint& other) const
+        {
+            return (size == other.size) && (mtime == other.mtime) && (checksum == other.checksum);
+        }
+    };
+    static Fingerprint fingerprint(const string&);
+    void find_seek_positions(const string&);
+private:
+    Fingerprint m_source;
+    uint64_t m_records = 0, m_min_len = 0, m_max_len = 0, m_total_len = 0, m_bytes = 0;
+    std::vector<uint64_t> m_offsets, m_seek;
+};
+
+// Collects index of source from its records as they are read in order:
+// records read once again are skipped, and index is incomplete if any record is missed
+class RecordIndex::Builder
+{
+public:
+    Builder(const string& source);
+    template<class T>
+    void add(const T& record, uint64_t offset);
+    // input has ended after given number of (decompressed) bytes
+    void finish(uint64_t bytes)     { m_end = bytes; }
+    void release()                  { m_claimed = false; }
+    bool complete() const           { return !m_broken && (m_next == m_end); }
+    RecordIndex result();
+private:
+    friend class RecordIndex;
+    string m_source;
+    RecordIndex m_index;
+    uint64_t m_next = 0, m_end = UINT64_MAX;
+    bool m_broken = false;
+    std::atomic<bool> m_claimed = false;
+};
+
+template<class T>
+void RecordIndex::Builder::add(const T& record, uint64_t offset)
+{
+    if (offset != m_next)
+    {
+        if (offset > m_next)
+            m_broken = true;
+        return;
+    }
+    if (m_index.m_records % STRIDE == 0)
+        m_index.m_offsets.push_back(offset);
+    uint64_t len = record.seq_len() - 1;  // skip newline
+    m_index.m_min_len = std::min(m_index.m_min_len, len);
+    m_index.m_max_len = std::max(m_index.m_max_len, len);
+    m_index.m_total_len += len;
+    m_index.m_records++;
+    m_next = offset + record.size();
+}
@@ -0,0 +1,121 @@
+#include "run_stats.hpp"
+
+#include <boost/format.hpp>
+#include <fstream>
+#include <stdexcept>
+#include <sys/resource.h>
+
+#include "constants.hpp"
+#include "file_utils.hpp"
+#include "memory_budget.hpp"
+
+RunStats& RunStats::instance()
+{
+    static RunStats stats;
+    return stats;
+}
+
+void RunStats::enable(const std::vector<string>& temp_dirs)
+{
+    m_temp_dirs = temp_dirs;
+    m_origin = std::chrono::steady_clock::now();
+    m_enabled = true;
+    m_start = this->snapshot();
+}
+
+bool RunStats::is_temp(const char* filename) const
+{
+    string name = filename;
+    for (auto& dir: m_temp_dirs)
+        if (name.compare(0, dir.size(), dir) == 0)
+            return true;
+    return false;
+}
+
+RunStats::Snapshot RunStats::snapshot() const
+{
+    Snapshot values;
+    for (int i = 0; i < NUM_COUNTERS; ++i)
+        values[i] = m_counters[i].load(std::memory_order_relaxed);
+    auto wall = std::chrono::steady_clock::now() - m_origin;
+    values[WALL_NS] = std::chrono::duration_cast<std::chrono::nanoseconds>(wall).count();
+    // CPU time of all threads of the process
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    values[USER_NS] = usage.ru_utime.tv_sec * 1000000000ul + usage.ru_utime.tv_usec * 1000ul;
+    values[SYSTEM_NS] = usage.ru_stime.tv_sec * 1000000000ul + usage.ru_stime.tv_usec * 1000ul;
+    return values;
+}
+
+uint64_t RunStats::peak_rss()
+{
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss * 1024ul;  // kilobytes on Linux
+}
+
+RunStats::Phase::Phase(const char* name) : m_name(name), m_active(RunStats::instance().enabled())
+{
+    if (m_active)
+        m_start = RunStats::instance().snapshot();
+}
+
+void RunStats::Phase::finish()
+{
+    if (!m_active)
+        return;
+    m_active = false;
+    RunStats& stats = RunStats::instance();
+    PhaseRecord record{m_name, m_start, stats.snapshot(), peak_rss(), std::move(m_values)};
+    std::lock_guard<std::mutex> lock(stats.m_mutex);
+    stats.m_phases.push_back(std::move(record));
+}
+
+// Writes metrics of an interval between two snapshots as JSON fields
+void RunStats::write_metrics(std::ostream& output, const Snapshot& start, const Snapshot& end, const char* indent)
+{
+    auto seconds = [&](int idx) { return (end[idx] - start[idx]) / 1e9; };
+    auto bytes = [&](int idx) { return end[idx] - start[idx]; };
+    output << boost::format("%1%\"wall_seconds\": %2$.6f,\n") % indent % seconds(WALL_NS);
+    output << boost::format("%1%\"user_seconds\": %2$.6f,\n") % indent % seconds(USER_NS);
+    output << boost::format("%1%\"system_seconds\": %2$.6f,\n") % indent % seconds(SYSTEM_NS);
+    output << boost::format("%1%\"output_compression_seconds\": %2$.6f,\n") % indent % seconds(COMPRESS_NS);
+    output << boost::format("%1%\"bytes\": {\"input_read\": %2%, \"temp_read\": %3%, \"temp_written\": %4%, \"output_written\": %5%},\n")
+        % indent % bytes(INPUT_READ) % bytes(TEMP_READ) % bytes(TEMP_WRITTEN) % bytes(OUTPUT_WRITTEN);
+}
+
+void RunStats::save(const string& filename) const
+{
+    std::ofstream output(filename);
+    check_fstream_ok<std::ofstream>(output, filename.c_str());
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    output << "{\n";
+    output << "  \"version\": \"" << constants::VERSION << "\",\n";
+    write_metrics(output, m_start, this->snapshot(), "  ");
+    output << "  \"peak_rss_bytes\": " << peak_rss() << ",\n";
+    output << "  \"memory_budget\": {\"limit_bytes\": " << MemoryBudget::instance().limit()
+           << ", \"peak_bytes\": " << MemoryBudget::instance().peak() << "},\n";
+    output << "  \"phases\": [";
+    for (size_t i = 0; i < m_phases.size(); ++i)
+    {
+        const PhaseRecord& phase = m_phases[i];
+        output << (i ? ",\n" : "\n") << "    {\n";
+        output << "      \"name\": \"" << phase.name << "\",\n";
+        output << boost::format("      \"start_seconds\": %1$.6f,\n") % ((phase.start[WALL_NS] - m_start[WALL_NS]) / 1e9);
+        write_metrics(output, phase.start, phase.end, "      ");
+        double wall = (phase.end[WALL_NS] - phase.start[WALL_NS]) / 1e9;
+        for (auto& [key, value]: phase.values)
+        {
+            output << "      \"" << key << "\": " << value << ",\n";
+            if ((string(key) == "records") && (wall > 0))
+                output << boost::format("      \"records_per_second\": %1$.1f,\n") % (value / wall);
+        }
+        output << "      \"peak_rss_so_far_bytes\": " << phase.peak_rss_so_far << "\n";
+        output << "    }";
+    }
+    output << (m_phases.empty() ? "]\n" : "\n  ]\n");
+    output << "}\n";
+    if (!output)
+        throw std::runtime_error("Could not write statistics file!");
+}
@@ -0,0 +1,84 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+using std::string;
+
+/*
+Per-phase performance metrics of a run (--stats-json option).
+Byte counters are global and are updated by inputs, outputs and sorters;
+a phase takes snapshots of counters, wall clock and CPU time at its start and end,
+so phases of concurrent work (e.g. samples of batch mode) may overlap.
+Nothing is measured unless collection is enabled.
+*/
+class RunStats
+{
+public:
+    enum Counter
+    {
+        INPUT_READ = 0,     // bytes read from input files (decompressed)
+        TEMP_READ,          // bytes read from temporary files
+        TEMP_WRITTEN,       // bytes written to temporary files
+        OUTPUT_WRITTEN,     // bytes written to output files (before compression)
+        COMPRESS_NS,        // time spent writing compressed outputs, in nanoseconds
+        NUM_COUNTERS
+    };
+    // counters followed by wall, user and system time in nanoseconds
+    enum Clock { WALL_NS = NUM_COUNTERS, USER_NS, SYSTEM_NS, SNAPSHOT_SIZE };
+    using Snapshot = std::array<uint64_t, SNAPSHOT_SIZE>;
+
+    static RunStats& instance();
+    void enable(const std::vector<string>& temp_dirs);
+    inline bool enabled()                   const   { return m_enabled; }
+    // whether a file belongs to temporary directory
+    bool is_temp(const char* filename) const;
+    inline void add(Counter counter, uint64_t value)
+    {
+        if (m_enabled)
+            m_counters[counter].fetch_add(value, std::memory_order_relaxed);
+    }
+    void save(const string& filename) const;
+
+    // Measures a phase of processing from its construction to finish() or destruction
+    class Phase
+    {
+    public:
+        explicit Phase(const char* name);
+        ~Phase()                                    { this->finish(); }
+        // additional numeric attribute of phase, e.g. number of records or runs
+        void set(const char* key, uint64_t value)   { m_values.emplace_back(key, value); }
+        void finish();
+    private:
+        const char* m_name;
+        bool m_active;
+        Snapshot m_start;
+        std::vector<std::pair<const char*, uint64_t>> m_values;
+    };
+private:
+    RunStats() {}
+    Snapshot snapshot() const;
+    static uint64_t peak_rss();
+    static void write_metrics(std::ostream&, const Snapshot&, const Snapshot&, const char*);
+private:
+    struct PhaseRecord
+    {
+        string name;
+        Snapshot start, end;
+        uint64_t peak_rss_so_far;  // process peak up to the end of phase, not the peak of phase itself
+        std::vector<std::pair<const char*, uint64_t>> values;
+    };
+    bool m_enabled = false;
+    std::vector<string> m_temp_dirs;
+    std::atomic<uint64_t> m_counters[NUM_COUNTERS] = {};
+    std::chrono::steady_clock::time_point m_origin;
+    Snapshot m_start;
+    mutable std::mutex m_mutex;
+    std::vector<PhaseRecord> m_phases;
+};
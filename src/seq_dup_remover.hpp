@@ -1,79 +1,196 @@
 #pragma once
+#include <atomic>
+#include <exception>
+#include <map>
+#include <memory>
 #include <string>
+#include <thread>
+#include <vector>
 #include "bufferedinput.hpp"
 #include "comparator.hpp"
 #include "external_sort.hpp"
 #include "file_utils.hpp"
+#include "keyview.hpp"
+#include "memory_budget.hpp"
 #include "paired_external_sort.hpp"
+#include "persistent_index.hpp"
+#include "run_stats.hpp"
+#include "spsc_queue.hpp"
 
 using std::string;
 using FileUtils::TemporaryDirectory;
 
+struct SeqDupRemoverSettings
+{
+    bool write_clusters = false;
+    bool key_sort       = false;
+    bool length_buckets = false;
+    bool verbose        = false;
+    uint threads        = 1;
+    string index_in, index_out;  // persistent sets of unique sequences
+};
+
+// View with sequence of known length: records in the same length bucket
+// can be compared with a single memcmp call
+template<class T>
+class FixedLengthView : public T
+{
+public:
+    int cmp(const FixedLengthView& other) const
+    {
+        return memcmp(this->seq(), other.seq(), this->seq_len());
+    }
+    friend bool operator>(const FixedLengthView& left, const FixedLengthView& right) { return (left.cmp(right) > 0); }
+    friend bool operator<(const FixedLengthView& left, const FixedLengthView& right) { return (left.cmp(right) < 0); }
+};
+
+template<class T> struct is_fixed_length_view : std::false_type {};
+template<class T> struct is_fixed_length_view<FixedLengthView<T>> : std::true_type {};
+
 template<class T>
 class SeqDupRemover
 {
 public:
-    SeqDupRemover(ssize_t memlimit, BaseComparator* comparator, TemporaryDirectory* tempdir, bool write_clusters, bool verbose) 
-        : m_memlimit(memlimit), m_comparator(comparator), m_tempdir(tempdir), m_write_clusters(write_clusters), m_verbose(verbose)
+    SeqDupRemover(ssize_t memlimit, BaseComparator* comparator, TemporaryDirectory* tempdir, const SeqDupRemoverSettings& settings) 
+        : m_memlimit(memlimit), m_comparator(comparator), m_tempdir(tempdir), m_settings(settings)
     {
         // perform longest duplicate save only for loose mode to save perfomance
         if (LooseComparator* tmp = dynamic_cast<LooseComparator*>(comparator); tmp != nullptr)
             m_loose_comp = true;
+        m_write_clusters = settings.write_clusters;
+        m_verbose = settings.verbose;
+        m_sorted1 = tempdir->unique_name("data.sorted1");
+        m_sorted2 = tempdir->unique_name("data.sorted2");
     }
     ~SeqDupRemover() {}
     void filterSE(const string&, const string&);
     void filterPE(const string&, const string&,
                   const string&, const string&);
+    // joint deduplication of several lanes, each with its own output
+    void filterSE(const std::vector<string>&, const std::vector<string>&);
+    void filterPE(const std::vector<string>&, const std::vector<string>&,
+                  const std::vector<string>&, const std::vector<string>&);
+    inline size_t total_reads()     const { return m_tot_reads; }
+    inline size_t duplicate_reads() const { return m_dup_reads; }
 private:
     void impl_filterSE(const char*, const char*);
     void impl_filterPE(const char*, const char*,
                        const char*, const char*);
+    template<class Input>
+    void dedupSE(Input&, const char*, RunStats::Phase&);
+    void pipelineSE(const char*, const char*);
+    bool is_duplicate(const char*, ssize_t);
+    bool is_duplicate(const char*, ssize_t, const char*, ssize_t);
+    template<int N>
+    void open_indexes(std::unique_ptr<PersistentIndex::Reader<N>>&, std::unique_ptr<PersistentIndex::Writer<N>>&);
+    template<class Input>
+    void dedupPE(Input&, const char*, const char*, RunStats::Phase&);
+    // joint deduplication of lanes
+    template<class F>
+    void sortLanes(size_t, F&&);
+    // key-based sorting
+    void filterSE_keys(const string&, const string&);
+    void filterPE_keys(const string&, const string&,
+                       const string&, const string&);
+    template<int N>
+    void sortKeys(const string&, FileUtils::MappedInputFile*, const char* const*);
+    template<int N, class Input>
+    void dedupKeys(Input&, FileUtils::MappedInputFile*, const char* const*, RunStats::Phase&);
+    // length buckets
+    void filterSE_buckets(const string&, const string&);
+    std::map<ssize_t, string> splitByLength(const char*);
 private:
     ssize_t m_memlimit;
     BaseComparator* m_comparator;
     TemporaryDirectory* m_tempdir;
+    SeqDupRemoverSettings m_settings;
+    string m_sorted1, m_sorted2;
     bool m_loose_comp       = false;
     bool m_write_clusters   = false;
     bool m_verbose          = false;
+    bool m_has_reference    = false;
+    size_t m_tot_reads = 0ul, m_dup_reads = 0ul;
 };
 
 template<class T>
 void SeqDupRemover<T>::filterSE(const string& infile,
                                 const string& outfile)
 {
+    if (m_settings.key_sort)
+        return this->filterSE_keys(infile, outfile);
+    if constexpr (!is_fixed_length_view<T>::value)
+    {   // buckets are never split further
+        if (m_settings.length_buckets)
+            return this->filterSE_buckets(infile, outfile);
+    }
+
+    const char* sorted_file = m_sorted1.c_str();
     {   // sort input file in a scope so all buffers deallocate
-        ExternalSorter<T> sorter(m_memlimit, m_tempdir->name());
-        sorter.sort(infile.c_str(), m_tempdir->sorted_left().c_str());
+        ExternalSorter<T> sorter(m_memlimit, m_tempdir, m_settings.threads);
+        SortResult result = sorter.sort(infile.c_str(), sorted_file, true);
+        if (result == SortResult::SR_IN_MEMORY)
+        {   // whole input was sorted in memory -> deduplicate it right away
+            RunStats::Phase phase("dedup");
+            InMemoryInput<T> input(sorter.records());
+            this->dedupSE(input, outfile.c_str(), phase);
+            return;
+        }
+        if (result == SortResult::SR_PRESORTED)
+        {
+            if (m_verbose)
+                std::cout << "Input is already sorted, sorting step was skipped.\n";
+            sorted_file = infile.c_str();
+        }
     }
 
     // deduplicate file
-    this->impl_filterSE(m_tempdir->sorted_left().c_str(), outfile.c_str());
+    this->impl_filterSE(sorted_file, outfile.c_str());
     
 }
 
 template<class T>
 void SeqDupRemover<T>::impl_filterSE(const char* infile,
                                      const char* outfile)
+{
+    // stored index is merged in sequentially
+    if ((m_settings.threads > 1) && m_settings.index_in.empty() && m_settings.index_out.empty())
+        return this->pipelineSE(infile, outfile);
+    RunStats::Phase phase("dedup");
+    BufferedInput<T> buffer(m_memlimit);
+    buffer.set_file(infile);
+    this->dedupSE(buffer, outfile, phase);
+}
+
+template<class T>
+template<class Input>
+void SeqDupRemover<T>::dedupSE(Input& buffer,
+                               const char* outfile,
+                               RunStats::Phase& phase)
 {
     // std::unique_ptr<FileUtils::I_OutputFile> output_file{FileUtils::openOutputFile(outfile)};
     FileUtils::UniversalOutputFile output_file{outfile};
     FileUtils::ClusterFile clusters_file;
     if (m_write_clusters)
         clusters_file.open(outfile);
+    std::unique_ptr<PersistentIndex::Reader<1>> index_in;
+    std::unique_ptr<PersistentIndex::Writer<1>> index_out;
+    this->open_indexes(index_in, index_out);
+
+    // stored sequences precede equal new ones, so that new duplicates of them are removed
+    auto merge_index = [&](const T* obj)
+    {
+        while (index_in && !index_in->eof() && (!obj || (index_in->cmp(&obj) <= 0)))
+        {
+            this->is_duplicate(index_in->seq(0).data(), index_in->seq(0).size());
+            if (index_out)
+                index_out->add(*index_in);
+            index_in->next();
+        }
+    };
 
     T obj;
-    BufferedInput<T> buffer(m_memlimit);
     size_t tot_reads = 0ul, dup_reads = 0ul;
-
-    buffer.set_file(infile);
-    obj = buffer.next();
-    tot_reads++;
-
-    this->m_comparator->set_seq(obj.seq(), obj.seq_len());
-    //output_file->write(obj.start(), obj.size());
-    output_file.write(obj.start(), obj.size());
-    if (m_write_clusters)
-        clusters_file.write_cluster_head(obj.start(), obj.id_len());
+    m_has_reference = false;
 
     while (!buffer.eof())
     {
@@ -81,49 +198,316 @@ void SeqDupRemover<T>::impl_filterSE(const char* infile,
         {
             obj = buffer.next();
             tot_reads++;
-            if (!(this->m_comparator->compare(obj.seq(), obj.seq_len())))
-            {  // compare returns false -> seqs are different
-                this->m_comparator->set_seq(obj.seq(), obj.seq_len());
+            merge_index(&obj);
+            if (!this->is_duplicate(obj.seq(), obj.seq_len()))
+            {
                 //output_file->write(obj.start(), obj.size());
                 output_file.write(obj.start(), obj.size());
                 if (m_write_clusters)
                     clusters_file.write_cluster_head(obj.start(), obj.id_len());
-            } else {
-                dup_reads++;
-                if (m_loose_comp && (this->m_comparator->left_len() <= obj.seq_len()))
+                if (index_out)
                 {
-                    // current sequence is a duplicate, but we need to keep the longest one as a reference
-                    // this will not affect tight or hamming modes
-                    this->m_comparator->set_seq(obj.seq(), obj.seq_len());
+                    const T* records[1] = {&obj};
+                    index_out->add(records);
                 }
-
+            } else {
+                dup_reads++;
                 if (m_write_clusters)
                     clusters_file.write_cluster_item(obj.start(), obj.id_len());
-            } 
+            }
         }
         buffer.refresh();
     }
+    merge_index(nullptr);
+    if (index_out)
+        index_out->commit();
 
+    phase.set("records", tot_reads);
+    phase.set("duplicates", dup_reads);
+    m_tot_reads += tot_reads;
+    m_dup_reads += dup_reads;
     if (m_verbose)
         std::cout << tot_reads << " reads processed, out of which " << dup_reads << " duplicates were removed.\n";
 }
 
+// Compares sequence with current reference, which is replaced unless sequence is a duplicate
+template<class T>
+bool SeqDupRemover<T>::is_duplicate(const char* seq, ssize_t len)
+{
+    if (m_has_reference && this->m_comparator->compare(seq, len))
+    {
+        if (m_loose_comp && (this->m_comparator->left_len() <= len))
+        {
+            // current sequence is a duplicate, but we need to keep the longest one as a reference
+            // this will not affect tight or hamming modes
+            this->m_comparator->set_seq(seq, len);
+        }
+        return true;
+    }
+    this->m_comparator->set_seq(seq, len);
+    m_has_reference = true;
+    return false;
+}
+
+template<class T>
+bool SeqDupRemover<T>::is_duplicate(const char* left, ssize_t left_len,
+                                    const char* right, ssize_t right_len)
+{
+    if (m_has_reference && this->m_comparator->compare(left, left_len, right, right_len))
+    {
+        if ( m_loose_comp \
+            && (this->m_comparator->left_len() <= left_len) \
+            && (this->m_comparator->right_len() <= right_len))
+        {
+            // current pair is a duplicate, but we need to keep the longest one as a reference
+            // this will not affect tight or hamming modes
+            this->m_comparator->set_seq(left, left_len, right, right_len);
+        }
+        return true;
+    }
+    this->m_comparator->set_seq(left, left_len, right, right_len);
+    m_has_reference = true;
+    return false;
+}
+
+template<class T>
+template<int N>
+void SeqDupRemover<T>::open_indexes(std::unique_ptr<PersistentIndex::Reader<N>>& index_in,
+                                    std::unique_ptr<PersistentIndex::Writer<N>>& index_out)
+{
+    if (!m_settings.index_in.empty())
+        index_in = std::make_unique<PersistentIndex::Reader<N>>(m_settings.index_in);
+    if (!m_settings.index_out.empty())
+        index_out = std::make_unique<PersistentIndex::Writer<N>>(m_settings.index_out);
+}
+
+/*
+Pipelined deduplication pass: reading (with decompression), parsing, comparing
+and writing (with compression) run in separate threads connected by SPSC queues of batches.
+Batches are processed strictly in order, so output is the same as of dedupSE.
+*/
+
+template<class T>
+void SeqDupRemover<T>::pipelineSE(const char* infile,
+                                  const char* outfile)
+{
+    RunStats::Phase phase("dedup");
+    struct RawBlock
+    {
+        std::vector<char> data;
+        std::streamsize size = 0;
+    };
+    struct RecordBatch
+    {   // records point into data
+        std::vector<char> data;
+        std::vector<T> records;
+    };
+    struct OutputBatch
+    {
+        string records, clusters;
+    };
+    const size_t QUEUE_SIZE = 8;
+    // up to (QUEUE_SIZE + 3) objects of each kind are alive at once, each of them takes about a block
+    // (batches up to twice as much with their records); blocks get smaller if memory budget is short
+    const ssize_t blocks_alive = 4 * (QUEUE_SIZE + 3);
+    MemoryBudget::Reservation memory(blocks_alive * std::clamp(m_memlimit / 48, constants::ONE_MB, 8 * constants::ONE_MB),
+                                     blocks_alive * 64 * 1024);
+    // blocks are input buffers as well, so they obey the same upper bound
+    const ssize_t block_size = std::min(memory.size() / blocks_alive, BufferPool::instance().max_buffer());
+
+    SpscQueue<std::unique_ptr<RawBlock>> blocks(QUEUE_SIZE), free_blocks(QUEUE_SIZE);
+    SpscQueue<std::unique_ptr<RecordBatch>> batches(QUEUE_SIZE), free_batches(QUEUE_SIZE);
+    SpscQueue<std::unique_ptr<OutputBatch>> outputs(QUEUE_SIZE), free_outputs(QUEUE_SIZE);
+    auto abort = [&]()
+    {   // wake up all stages so that they stop
+        blocks.close();
+        batches.close();
+        outputs.close();
+    };
+    // reuse a consumed object if possible, allocate new one otherwise
+    auto obtain = [](auto& free_queue, auto& item)
+    {
+        if (!free_queue.try_pop(item))
+            item = std::make_unique<typename std::remove_reference_t<decltype(item)>::element_type>();
+    };
+
+    auto read_stage = [&]()
+    {
+        std::unique_ptr<I_InputFile> input{FileUtils::openInputFile(infile)};
+        while (!input->eof())
+        {
+            std::unique_ptr<RawBlock> block;
+            obtain(free_blocks, block);
+            block->data.resize(block_size);
+            input->read(block->data.data(), block_size);
+            block->size = input->gcount();
+            if (block->size > 0 && !blocks.push(std::move(block)))
+                return;
+        }
+        blocks.close();
+    };
+
+    auto parse_stage = [&]()
+    {
+        std::vector<char> tail;  // incomplete record at the end of previous block
+        RecordReader<T> reader;
+        std::unique_ptr<RawBlock> block;
+        while (blocks.pop(block))
+        {
+            std::unique_ptr<RecordBatch> batch;
+            obtain(free_batches, batch);
+            batch->data.assign(tail.begin(), tail.end());
+            batch->data.insert(batch->data.end(), block->data.data(), block->data.data() + block->size);
+            free_blocks.try_push(std::move(block));
+
+            batch->records.clear();
+            reader.reset(batch->data.data(), batch->data.data() + batch->data.size());
+            T obj;
+            std::streamsize parsed = 0;
+            for (std::streamsize size = reader.read(obj); size >= 0; size = reader.read(obj))
+            {
+                batch->records.push_back(std::move(obj));
+                parsed += size;
+            }
+            tail.assign(batch->data.begin() + parsed, batch->data.end());
+            if (batch->records.empty())
+                free_batches.try_push(std::move(batch));
+            else if (!batches.push(std::move(batch)))
+                return;
+        }
+        // same as BufferedInput, incomplete record at the end of file is ignored
+        batches.close();
+    };
+
+    size_t tot_reads = 0ul, dup_reads = 0ul;
+    auto compare_stage = [&]()
+    {
+        std::unique_ptr<RecordBatch> batch;
+        m_has_reference = false;
+        while (batches.pop(batch))
+        {
+            std::unique_ptr<OutputBatch> output;
+            obtain(free_outputs, output);
+            output->records.clear();
+            output->clusters.clear();
+            for (T& obj: batch->records)
+            {
+                tot_reads++;
+                if (!this->is_duplicate(obj.seq(), obj.seq_len()))
+                {
+                    output->records.append(obj.start(), obj.size());
+                    if (m_write_clusters)
+                        output->clusters.append(obj.start(), obj.id_len());
+                } else {
+                    dup_reads++;
+                    if (m_write_clusters)
+                    {
+                        output->clusters.append("--", 2);
+                        output->clusters.append(obj.start(), obj.id_len());
+                    }
+                }
+            }
+            free_batches.try_push(std::move(batch));
+            if (!outputs.push(std::move(output)))
+                return;
+        }
+        outputs.close();
+    };
+
+    auto write_stage = [&]()
+    {
+        FileUtils::UniversalOutputFile output_file{outfile};
+        FileUtils::ClusterFile clusters_file;
+        if (m_write_clusters)
+            clusters_file.open(outfile);
+        std::unique_ptr<OutputBatch> output;
+        while (outputs.pop(output))
+        {
+            output_file.write(output->records.data(), output->records.size());
+            if (m_write_clusters)
+                clusters_file.write_raw(output->clusters.data(), output->clusters.size());
+            free_outputs.try_push(std::move(output));
+        }
+    };
+
+    // a failed stage stops the others by closing all queues
+    std::exception_ptr errors[4];
+    auto run = [&](auto& stage, std::exception_ptr& error)
+    {
+        try {
+            stage();
+        } catch (...) {
+            error = std::current_exception();
+            abort();
+        }
+    };
+    std::thread reader([&]() { run(read_stage, errors[0]); });
+    std::thread parser([&]() { run(parse_stage, errors[1]); });
+    std::thread writer([&]() { run(write_stage, errors[3]); });
+    run(compare_stage, errors[2]);
+    reader.join();
+    parser.join();
+    writer.join();
+    for (auto& error: errors)
+        if (error)
+            std::rethrow_exception(error);
+
+    phase.set("records", tot_reads);
+    phase.set("duplicates", dup_reads);
+    m_tot_reads += tot_reads;
+    m_dup_reads += dup_reads;
+    if (m_verbose)
+    {
+        std::cout << tot_reads << " reads processed, out of which " << dup_reads << " duplicates were removed.\n";
+        std::cout << "Pipeline queues (mean occupancy / capacity, pushes to a full queue, pops from an empty queue):\n";
+        auto report = [](const char* name, const QueueStats& stats)
+        {
+            std::cout << boost::format("    %1% %2$.1f / %3%, %4$.1f%% full, %5$.1f%% empty\n")
+                % name % stats.mean_occupancy() % stats.capacity
+                % (100.0 * stats.full_ratio()) % (100.0 * stats.empty_ratio());
+        };
+        report("read -> parse:   ", blocks.stats());
+        report("parse -> compare:", batches.stats());
+        report("compare -> write:", outputs.stats());
+    }
+}
+
 template<class T>
 void SeqDupRemover<T>::filterPE(const string& infile1,
                                 const string& infile2,
                                 const string& outfile1,
                                 const string& outfile2)
 {
+    if (m_settings.key_sort)
+        return this->filterPE_keys(infile1, infile2, outfile1, outfile2);
+
+    const char* sorted_file1 = m_sorted1.c_str();
+    const char* sorted_file2 = m_sorted2.c_str();
     {  // sort input files in a scope so all buffers deallocate
-        PairedExternalSorter<T> sorter(m_memlimit, m_tempdir->name());
-        sorter.sort(infile1.c_str(),
-                    infile2.c_str(),
-                    m_tempdir->sorted_left().c_str(),
-                    m_tempdir->sorted_right().c_str());
+        PairedExternalSorter<T> sorter(m_memlimit, m_tempdir);
+        SortResult result = sorter.sort(infile1.c_str(),
+                                        infile2.c_str(),
+                                        sorted_file1,
+                                        sorted_file2,
+                                        true);
+        if (result == SortResult::SR_IN_MEMORY)
+        {   // whole input was sorted in memory -> deduplicate it right away
+            RunStats::Phase phase("dedup");
+            InMemoryInput<RecordPair<T>> input(sorter.records());
+            this->dedupPE(input, outfile1.c_str(), outfile2.c_str(), phase);
+            return;
+        }
+        if (result == SortResult::SR_PRESORTED)
+        {
+            if (m_verbose)
+                std::cout << "Inputs are already sorted, sorting step was skipped.\n";
+            sorted_file1 = infile1.c_str();
+            sorted_file2 = infile2.c_str();
+        }
     }
 
-    this->impl_filterPE(m_tempdir->sorted_left().c_str(),
-                        m_tempdir->sorted_right().c_str(),
+    this->impl_filterPE(sorted_file1,
+                        sorted_file2,
                         outfile1.c_str(),
                         outfile2.c_str());
 }
@@ -133,53 +517,65 @@ void SeqDupRemover<T>::impl_filterPE(const char* infile1,
                                      const char* infile2,
                                      const char* outfile1,
                                      const char* outfile2)
+{
+    RunStats::Phase phase("dedup");
+    PairedBufferedInput<T> buffer(m_memlimit/2);
+    buffer.set_files(infile1, infile2);
+    this->dedupPE(buffer, outfile1, outfile2, phase);
+}
+
+template<class T>
+template<class Input>
+void SeqDupRemover<T>::dedupPE(Input& buffer,
+                               const char* outfile1,
+                               const char* outfile2,
+                               RunStats::Phase& phase)
 {
     // std::unique_ptr<FileUtils::I_OutputFile> output_file1{FileUtils::openOutputFile(outfile1)};
     // std::unique_ptr<FileUtils::I_OutputFile> output_file2{FileUtils::openOutputFile(outfile2)};
-    FileUtils::UniversalOutputFile output_file1{outfile1};
-    FileUtils::UniversalOutputFile output_file2{outfile2};
+    FileUtils::PairedOutputFile outputs{outfile1, outfile2};
+    FileUtils::UniversalOutputFile& output_file1 = outputs.left();
+    FileUtils::UniversalOutputFile& output_file2 = outputs.right();
     FileUtils::ClusterFile clusters_file1, clusters_file2;
     if (m_write_clusters)
     {
         clusters_file1.open(outfile1);
         clusters_file2.open(outfile2);
     }
+    std::unique_ptr<PersistentIndex::Reader<2>> index_in;
+    std::unique_ptr<PersistentIndex::Writer<2>> index_out;
+    this->open_indexes(index_in, index_out);
+
+    // stored sequences precede equal new ones, so that new duplicates of them are removed
+    auto merge_index = [&](const T* const* records)
+    {
+        while (index_in && !index_in->eof() && (!records || (index_in->cmp(records) <= 0)))
+        {
+            this->is_duplicate(index_in->seq(0).data(), index_in->seq(0).size(),
+                               index_in->seq(1).data(), index_in->seq(1).size());
+            if (index_out)
+                index_out->add(*index_in);
+            index_in->next();
+        }
+    };
 
     T left, right;
-    BufferedInput<T> left_buffer(m_memlimit/2), right_buffer(m_memlimit/2);
     size_t tot_reads = 0ul, dup_reads = 0ul;
+    m_has_reference = false;
 
-    left_buffer.set_file(infile1);
-    right_buffer.set_file(infile2);
-    left = left_buffer.next();
-    right = right_buffer.next();
-    tot_reads++;
-
-    this->m_comparator->set_seq(left.seq(), left.seq_len(),
-                                right.seq(), right.seq_len());
-
-    // output_file1->write(left.start(), left.size());
-    // output_file2->write(right.start(), right.size());
-    output_file1.write(left.start(), left.size());
-    output_file2.write(right.start(), right.size());
-    if (m_write_clusters)
-    {
-        clusters_file1.write_cluster_head(left.start(), left.id_len());
-        clusters_file2.write_cluster_head(right.start(), right.id_len());
-    }
-
-    while (!left_buffer.eof() && !right_buffer.eof())
+    while (!buffer.eof())
     {
-        while (!left_buffer.block_end() && !right_buffer.block_end())
+        while (!buffer.block_end())
         {
-            left = left_buffer.next();
-            right = right_buffer.next();
+            RecordPair<T> pair = buffer.next();
+            left = std::move(pair.left);
+            right = std::move(pair.right);
             tot_reads++;
-            if (!(this->m_comparator->compare(left.seq(), left.seq_len(),
-                                              right.seq(), right.seq_len())))
-            {  // current pair differs -> load it as a new ref
-                this->m_comparator->set_seq(left.seq(), left.seq_len(),
-                                            right.seq(), right.seq_len());
+            const T* records[2] = {&left, &right};
+            merge_index(records);
+            if (!this->is_duplicate(left.seq(), left.seq_len(),
+                                    right.seq(), right.seq_len()))
+            {  // current pair differs -> it is a new ref
                 // output_file1->write(left.start(), left.size());
                 // output_file2->write(right.start(), right.size());
                 output_file1.write(left.start(), left.size());
@@ -189,30 +585,568 @@ void SeqDupRemover<T>::impl_filterPE(const char* infile1,
                     clusters_file1.write_cluster_head(left.start(), left.id_len());
                     clusters_file2.write_cluster_head(right.start(), right.id_len());
                 }
+                if (index_out)
+                    index_out->add(records);
             } else {
                 dup_reads++;
-                if ( m_loose_comp \
-                    && (this->m_comparator->left_len() <= left.seq_len()) \
-                    && (this->m_comparator->right_len() <= right.seq_len()))
-                {
-                    // current pair is a duplicate, but we need to keep the longest one as a reference
-                    // this will not affect tight or hamming modes
-                    this->m_comparator->set_seq(left.seq(), left.seq_len(),
-                                                right.seq(), right.seq_len());
-                }
-
                 if (m_write_clusters)
                 {
                     clusters_file1.write_cluster_item(left.start(), left.id_len());
                     clusters_file2.write_cluster_item(right.start(), right.id_len());
                 }
+            }
+        }
+        buffer.refresh();
+    }
+    merge_index(nullptr);
+    if (index_out)
+        index_out->commit();
+
+    phase.set("records", tot_reads);
+    phase.set("duplicates", dup_reads);
+    m_tot_reads += tot_reads;
+    m_dup_reads += dup_reads;
+    if (m_verbose)
+        std::cout << tot_reads << " read pairs processed, out of which " << dup_reads << " duplicates were removed.\n";
+}
+
+/*
+Joint deduplication of several lanes: every lane is sorted on its own (several at a time if threads are available),
+then sorted lanes are merged into a single stream of records tagged with their lane index.
+Equal records are ordered by lane, so that the earliest lane keeps its read, and each surviving read
+is written to the output of its own lane. Clusters span lanes and are written next to the first output.
+*/
+
+template<class T>
+void SeqDupRemover<T>::filterSE(const std::vector<string>& infiles,
+                                const std::vector<string>& outfiles)
+{
+    if (infiles.size() == 1)
+        return this->filterSE(infiles[0], outfiles[0]);
+
+    std::vector<string> sorted_files(infiles.size());
+    this->sortLanes(infiles.size(), [&](size_t lane, ssize_t memlimit, uint threads)
+    {
+        string sorted_file = m_tempdir->unique_name("lane.sorted");
+        ExternalSorter<T> sorter(memlimit, m_tempdir, threads);
+        if (sorter.sort(infiles[lane].c_str(), sorted_file.c_str()) == SortResult::SR_PRESORTED)
+            sorted_file = infiles[lane];
+        sorted_files[lane] = sorted_file;
+    });
+
+    RunStats::Phase phase("dedup");
+    std::vector<std::unique_ptr<BufferedInput<T>>> lanes;
+    std::vector<std::unique_ptr<FileUtils::UniversalOutputFile>> output_files;
+    for (size_t lane = 0; lane < infiles.size(); ++lane)
+    {
+        lanes.push_back(std::make_unique<BufferedInput<T>>(m_memlimit / infiles.size()));
+        lanes.back()->set_file(sorted_files[lane].c_str());
+        output_files.push_back(std::make_unique<FileUtils::UniversalOutputFile>(outfiles[lane].c_str()));
+    }
+    FileUtils::ClusterFile clusters_file;
+    if (m_write_clusters)
+        clusters_file.open(outfiles[0].c_str());
 
+    size_t tot_reads = 0ul, dup_reads = 0ul;
+    m_has_reference = false;
+    mergeSortedInputs(lanes, [&](size_t lane, const T& obj)
+    {
+        tot_reads++;
+        if (!this->is_duplicate(obj.seq(), obj.seq_len()))
+        {
+            output_files[lane]->write(obj.start(), obj.size());
+            if (m_write_clusters)
+                clusters_file.write_cluster_head(obj.start(), obj.id_len());
+        } else {
+            dup_reads++;
+            if (m_write_clusters)
+                clusters_file.write_cluster_item(obj.start(), obj.id_len());
+        }
+    });
+    lanes.clear();
+    for (size_t lane = 0; lane < infiles.size(); ++lane)
+        if (sorted_files[lane] != infiles[lane])
+            FS::remove(sorted_files[lane]);
+
+    phase.set("records", tot_reads);
+    phase.set("duplicates", dup_reads);
+    m_tot_reads += tot_reads;
+    m_dup_reads += dup_reads;
+    if (m_verbose)
+    {
+        std::cout << infiles.size() << " lanes were deduplicated jointly.\n";
+        std::cout << tot_reads << " reads processed, out of which " << dup_reads << " duplicates were removed.\n";
+    }
+}
+
+template<class T>
+void SeqDupRemover<T>::filterPE(const std::vector<string>& infiles1,
+                                const std::vector<string>& infiles2,
+                                const std::vector<string>& outfiles1,
+                                const std::vector<string>& outfiles2)
+{
+    if (infiles1.size() == 1)
+        return this->filterPE(infiles1[0], infiles2[0], outfiles1[0], outfiles2[0]);
+
+    std::vector<std::pair<string, string>> sorted_files(infiles1.size());
+    this->sortLanes(infiles1.size(), [&](size_t lane, ssize_t memlimit, uint)
+    {
+        string sorted_file1 = m_tempdir->unique_name("lane.sorted1");
+        string sorted_file2 = m_tempdir->unique_name("lane.sorted2");
+        PairedExternalSorter<T> sorter(memlimit, m_tempdir);
+        SortResult result = sorter.sort(infiles1[lane].c_str(), infiles2[lane].c_str(),
+                                        sorted_file1.c_str(), sorted_file2.c_str());
+        if (result == SortResult::SR_PRESORTED)
+            sorted_files[lane] = {infiles1[lane], infiles2[lane]};
+        else
+            sorted_files[lane] = {sorted_file1, sorted_file2};
+    });
+
+    RunStats::Phase phase("dedup");
+    std::vector<std::unique_ptr<PairedBufferedInput<T>>> lanes;
+    std::vector<std::unique_ptr<FileUtils::PairedOutputFile>> output_files;
+    for (size_t lane = 0; lane < infiles1.size(); ++lane)
+    {
+        lanes.push_back(std::make_unique<PairedBufferedInput<T>>(m_memlimit / infiles1.size() / 2));
+        lanes.back()->set_files(sorted_files[lane].first.c_str(), sorted_files[lane].second.c_str());
+        output_files.push_back(std::make_unique<FileUtils::PairedOutputFile>(outfiles1[lane].c_str(), outfiles2[lane].c_str()));
+    }
+    FileUtils::ClusterFile clusters_file1, clusters_file2;
+    if (m_write_clusters)
+    {
+        clusters_file1.open(outfiles1[0].c_str());
+        clusters_file2.open(outfiles2[0].c_str());
+    }
+
+    size_t tot_reads = 0ul, dup_reads = 0ul;
+    m_has_reference = false;
+    mergeSortedInputs(lanes, [&](size_t lane, const RecordPair<T>& pair)
+    {
+        const T& left = pair.left;
+        const T& right = pair.right;
+        tot_reads++;
+        if (!this->is_duplicate(left.seq(), left.seq_len(),
+                                right.seq(), right.seq_len()))
+        {
+            output_files[lane]->left().write(left.start(), left.size());
+            output_files[lane]->right().write(right.start(), right.size());
+            if (m_write_clusters)
+            {
+                clusters_file1.write_cluster_head(left.start(), left.id_len());
+                clusters_file2.write_cluster_head(right.start(), right.id_len());
+            }
+        } else {
+            dup_reads++;
+            if (m_write_clusters)
+            {
+                clusters_file1.write_cluster_item(left.start(), left.id_len());
+                clusters_file2.write_cluster_item(right.start(), right.id_len());
             }
         }
-        left_buffer.refresh();
-        right_buffer.refresh();
+    });
+    lanes.clear();
+    for (size_t lane = 0; lane < infiles1.size(); ++lane)
+    {
+        if (sorted_files[lane].first == infiles1[lane])
+            continue;
+        FS::remove(sorted_files[lane].first);
+        FS::remove(sorted_files[lane].second);
     }
 
+    phase.set("records", tot_reads);
+    phase.set("duplicates", dup_reads);
+    m_tot_reads += tot_reads;
+    m_dup_reads += dup_reads;
     if (m_verbose)
+    {
+        std::cout << infiles1.size() << " lanes were deduplicated jointly.\n";
         std::cout << tot_reads << " read pairs processed, out of which " << dup_reads << " duplicates were removed.\n";
+    }
+}
+
+// Calls sort(lane, memlimit, threads) for every lane, lanes are sorted concurrently if several threads are available
+template<class T>
+template<class F>
+void SeqDupRemover<T>::sortLanes(size_t num_lanes, F&& sort)
+{
+    uint num_threads = std::max(1u, std::min(m_settings.threads, static_cast<uint>(num_lanes)));
+    ssize_t memlimit = m_memlimit / num_threads;
+    uint sort_threads = std::max(1u, m_settings.threads / num_threads);
+    std::atomic<size_t> next_lane = 0ul;
+    runParallel(num_threads, [&](uint)
+    {
+        for (size_t lane = next_lane++; lane < num_lanes; lane = next_lane++)
+            sort(lane, memlimit, sort_threads);
+    });
+}
+
+/*
+Key-based sorting: only compact keys (packed sequences with record offsets) are sorted,
+deduplication is performed on keys, and then surviving records are copied from memory-mapped inputs.
+*/
+
+template<class T>
+void SeqDupRemover<T>::filterSE_keys(const string& infile,
+                                     const string& outfile)
+{
+    string keyfile = m_sorted1 + ".keys";
+    {   // extract keys of all records
+        RunStats::Phase phase("key extraction");
+        std::ofstream keys(keyfile, std::ios_base::binary);
+        check_fstream_ok<std::ofstream>(keys, keyfile.c_str());
+        BufferedInput<T> buffer(m_memlimit);
+        buffer.set_file(infile.c_str());
+        string tmp;
+        uint64_t offset = 0;
+        while (!buffer.eof())
+        {
+            while (!buffer.block_end())
+            {
+                T obj = buffer.next();
+                const T* records[1] = {&obj};
+                KeyView<1>::save(keys, records, &offset, tmp);
+                offset += obj.size();
+            }
+            buffer.refresh();
+        }
+        RunStats::instance().add(RunStats::TEMP_WRITTEN, static_cast<std::streamoff>(keys.tellp()));
+    }
+
+    // mapped before sorting, so that sorter leaves room for resident pages of input
+    FileUtils::MappedInputFile sources[1];
+    sources[0].open(infile, m_memlimit / 4);
+    const char* outfiles[1] = {outfile.c_str()};
+    this->sortKeys<1>(keyfile, sources, outfiles);
+}
+
+template<class T>
+void SeqDupRemover<T>::filterPE_keys(const string& infile1,
+                                     const string& infile2,
+                                     const string& outfile1,
+                                     const string& outfile2)
+{
+    string keyfile = m_sorted1 + ".keys";
+    {   // extract keys of all record pairs
+        RunStats::Phase phase("key extraction");
+        std::ofstream keys(keyfile, std::ios_base::binary);
+        check_fstream_ok<std::ofstream>(keys, keyfile.c_str());
+        PairedBufferedInput<T> buffer(m_memlimit/2);
+        buffer.set_files(infile1.c_str(), infile2.c_str());
+        string tmp;
+        uint64_t offsets[2] = {0, 0};
+        while (!buffer.eof())
+        {
+            while (!buffer.block_end())
+            {
+                RecordPair<T> pair = buffer.next();
+                const T* records[2] = {&pair.left, &pair.right};
+                KeyView<2>::save(keys, records, offsets, tmp);
+                offsets[0] += pair.left.size();
+                offsets[1] += pair.right.size();
+            }
+            buffer.refresh();
+        }
+        RunStats::instance().add(RunStats::TEMP_WRITTEN, static_cast<std::streamoff>(keys.tellp()));
+    }
+
+    FileUtils::MappedInputFile sources[2];
+    sources[0].open(infile1, m_memlimit / 8);
+    sources[1].open(infile2, m_memlimit / 8);
+    const char* outfiles[2] = {outfile1.c_str(), outfile2.c_str()};
+    this->sortKeys<2>(keyfile, sources, outfiles);
+}
+
+template<class T>
+template<int N>
+void SeqDupRemover<T>::sortKeys(const string& keyfile,
+                                FileUtils::MappedInputFile* sources,
+                                const char* const* outfiles)
+{
+    string sorted_file = m_sorted1;
+    {   // sort keys in a scope so all buffers deallocate
+        ExternalSorter<KeyView<N>> sorter(m_memlimit, m_tempdir);
+        SortResult result = sorter.sort(keyfile.c_str(), sorted_file.c_str(), true);
+        if (result == SortResult::SR_IN_MEMORY)
+        {   // all keys were sorted in memory -> deduplicate them right away
+            RunStats::Phase phase("dedup");
+            InMemoryInput<KeyView<N>> input(sorter.records());
+            this->dedupKeys<N>(input, sources, outfiles, phase);
+            return;
+        }
+        if (result == SortResult::SR_PRESORTED)
+        {
+            if (m_verbose)
+                std::cout << "Input is already sorted, sorting step was skipped.\n";
+            sorted_file = keyfile;
+        }
+    }
+
+    RunStats::Phase phase("dedup");
+    BufferedInput<KeyView<N>> buffer(m_memlimit);
+    buffer.set_file(sorted_file.c_str());
+    this->dedupKeys<N>(buffer, sources, outfiles, phase);
+}
+
+template<class T>
+template<int N, class Input>
+void SeqDupRemover<T>::dedupKeys(Input& buffer,
+                                 FileUtils::MappedInputFile* sources,
+                                 const char* const* outfiles,
+                                 RunStats::Phase& phase)
+{
+    std::unique_ptr<FileUtils::UniversalOutputFile> output_files[N];
+    FileUtils::ClusterFile clusters_files[N];
+    for (int i = 0; i < N; ++i)
+    {
+        output_files[i] = std::make_unique<FileUtils::UniversalOutputFile>(outfiles[i]);
+        if (m_write_clusters)
+            clusters_files[i].open(outfiles[i]);
+    }
+
+    KeyView<N> key;
+    string seqs[N];
+    size_t tot_reads = 0ul, dup_reads = 0ul;
+
+    auto unpack = [&]()
+    {   // restore sequences with trailing newlines, as comparators expect them
+        for (int i = 0; i < N; ++i)
+        {
+            seqs[i].resize(key.codes(i) + 1);
+            seqs[i].resize(key.unpack(i, seqs[i].data()) + 1);
+            seqs[i].back() = '\n';
+        }
+    };
+    auto set_reference = [&]()
+    {
+        if constexpr (N == 1)
+            this->m_comparator->set_seq(seqs[0].data(), seqs[0].size());
+        else
+            this->m_comparator->set_seq(seqs[0].data(), seqs[0].size(),
+                                        seqs[1].data(), seqs[1].size());
+    };
+    auto write_record = [&](bool is_duplicate)
+    {
+        for (int i = 0; i < N; ++i)
+        {
+            const char* record = sources[i].data(key.offset(i), key.record_len(i));
+            if (!is_duplicate)
+                output_files[i]->write(record, key.record_len(i));
+            if (m_write_clusters)
+            {
+                ssize_t id_len = (const char*)memchr(record, '\n', key.record_len(i)) - record + 1;
+                if (is_duplicate)
+                    clusters_files[i].write_cluster_item(record, id_len);
+                else
+                    clusters_files[i].write_cluster_head(record, id_len);
+            }
+        }
+    };
+
+    if (buffer.eof())  // empty input
+        return;
+    key = buffer.next();
+    tot_reads++;
+    unpack();
+    set_reference();
+    write_record(false);
+
+    while (!buffer.eof())
+    {
+        while (!buffer.block_end())
+        {
+            key = buffer.next();
+            tot_reads++;
+            unpack();
+            bool is_duplicate;
+            if constexpr (N == 1)
+                is_duplicate = this->m_comparator->compare(seqs[0].data(), seqs[0].size());
+            else
+                is_duplicate = this->m_comparator->compare(seqs[0].data(), seqs[0].size(),
+                                                           seqs[1].data(), seqs[1].size());
+            if (!is_duplicate)
+            {   // current record differs -> load it as a new ref
+                set_reference();
+            } else {
+                dup_reads++;
+                bool longer = (this->m_comparator->left_len() <= static_cast<ssize_t>(seqs[0].size()));
+                if constexpr (N == 2)
+                    longer = longer && (this->m_comparator->right_len() <= static_cast<ssize_t>(seqs[1].size()));
+                if (m_loose_comp && longer)
+                {
+                    // current record is a duplicate, but we need to keep the longest one as a reference
+                    // this will not affect tight or hamming modes
+                    set_reference();
+                }
+            }
+            write_record(is_duplicate);
+        }
+        buffer.refresh();
+    }
+
+    phase.set("records", tot_reads);
+    phase.set("duplicates", dup_reads);
+    m_tot_reads += tot_reads;
+    m_dup_reads += dup_reads;
+    if (m_verbose)
+    {
+        if constexpr (N == 1)
+            std::cout << tot_reads << " reads processed, out of which " << dup_reads << " duplicates were removed.\n";
+        else
+            std::cout << tot_reads << " read pairs processed, out of which " << dup_reads << " duplicates were removed.\n";
+    }
+}
+
+/*
+Length buckets: in "tight" mode reads of different lengths are never duplicates,
+so input is split by sequence length and each bucket is sorted and deduplicated independently.
+*/
+
+template<class T>
+void SeqDupRemover<T>::filterSE_buckets(const string& infile,
+                                        const string& outfile)
+{
+    std::map<ssize_t, string> bucket_files = this->splitByLength(infile.c_str());
+
+    struct Bucket
+    {
+        string infile, outfile;
+        uintmax_t size;
+    };
+    std::vector<Bucket> buckets;
+    buckets.reserve(bucket_files.size());
+    for (auto& item: bucket_files)
+        buckets.push_back({item.second, m_tempdir->unique_name("bucket.dedup"), FS::file_size(item.second)});
+    // largest buckets go first so that all threads finish at about the same time
+    std::vector<Bucket*> queue;
+    for (auto& bucket: buckets)
+        queue.push_back(&bucket);
+    std::stable_sort(queue.begin(), queue.end(), [](Bucket* a, Bucket* b) { return a->size > b->size; });
+
+    uint num_threads = std::max(1u, std::min(m_settings.threads, static_cast<uint>(queue.size())));
+    ssize_t memlimit = m_memlimit / num_threads;
+    std::atomic<size_t> next_bucket = 0ul, tot_reads = 0ul, dup_reads = 0ul;
+    std::vector<std::exception_ptr> errors(num_threads);
+
+    auto worker = [&](uint thread_idx)
+    {
+        try {
+            SeqDupRemoverSettings settings;
+            settings.write_clusters = m_write_clusters;
+            for (size_t idx = next_bucket++; idx < queue.size(); idx = next_bucket++)
+            {
+                TightComparator comparator(false);
+                SeqDupRemover<FixedLengthView<T>> remover(memlimit, &comparator, m_tempdir, settings);
+                remover.filterSE(queue[idx]->infile, queue[idx]->outfile);
+                FS::remove(queue[idx]->infile);
+                tot_reads += remover.total_reads();
+                dup_reads += remover.duplicate_reads();
+            }
+        } catch (...) {
+            errors[thread_idx] = std::current_exception();
+        }
+    };
+    std::vector<std::thread> threads;
+    for (uint i = 1; i < num_threads; ++i)
+        threads.emplace_back(worker, i);
+    worker(0);
+    for (auto& thread: threads)
+        thread.join();
+    for (auto& error: errors)
+        if (error)
+            std::rethrow_exception(error);
+
+    // gather results in order of sequence lengths
+    FileUtils::UniversalOutputFile output_file{outfile.c_str()};
+    FileUtils::ClusterFile clusters_file;
+    if (m_write_clusters)
+        clusters_file.open(outfile.c_str());
+    std::vector<char> buf(constants::ONE_MB);
+    auto copy_file = [&buf](const string& filename, auto&& write)
+    {
+        std::ifstream input(filename, std::ios_base::binary);
+        check_fstream_ok<std::ifstream>(input, filename.c_str());
+        while (input)
+        {
+            input.read(buf.data(), buf.size());
+            if (input.gcount() > 0)
+                write(buf.data(), input.gcount());
+        }
+        input.close();
+        FS::remove(filename);
+    };
+    for (auto& bucket: buckets)
+    {
+        copy_file(bucket.outfile, [&](const char* data, ssize_t n) { output_file.write(data, n); });
+        if (m_write_clusters)
+            copy_file(bucket.outfile + ".clusters",
+                      [&](const char* data, ssize_t n) { clusters_file.write_raw(data, n); });
+    }
+
+    m_tot_reads += tot_reads;
+    m_dup_reads += dup_reads;
+    if (m_verbose)
+    {
+        std::cout << "Input was split into " << buckets.size() << " buckets by sequence length.\n";
+        std::cout << tot_reads << " reads processed, out of which " << dup_reads << " duplicates were removed.\n";
+    }
+}
+
+// Distributes records between temporary files by sequence length, returns file names sorted by length.
+// Records are staged in memory drawn from the budget next to the input buffer,
+// capacity of staging strings (not just appended bytes) is accounted for.
+template<class T>
+std::map<ssize_t, string> SeqDupRemover<T>::splitByLength(const char* infile)
+{
+    RunStats::Phase phase("split by length");
+    std::map<ssize_t, string> bucket_files, bucket_data;
+    BufferedInput<T> buffer(m_memlimit / 2);
+    MemoryBudget::Reservation staging(m_memlimit / 2, constants::ONE_MB);
+    size_t staged = 0ul;
+
+    auto flush = [&]()
+    {   // files are only opened for a write so that number of buckets is not limited by number of open files
+        for (auto& [len, data]: bucket_data)
+        {
+            if (data.empty())
+                continue;
+            auto it = bucket_files.find(len);
+            if (it == bucket_files.end())
+                it = bucket_files.emplace(len, m_tempdir->unique_name("bucket")).first;
+            std::ofstream output(it->second, std::ios_base::app);
+            check_fstream_ok<std::ofstream>(output, it->second.c_str());
+            output.write(data.data(), data.size());
+            RunStats::instance().add(RunStats::TEMP_WRITTEN, data.size());
+            string().swap(data);
+        }
+        staged = 0ul;
+    };
+    auto stage = [&](const T& obj)
+    {
+        string& data = bucket_data[obj.seq_len()];
+        size_t needed = data.size() + obj.size();
+        if (needed > data.capacity())
+        {   // grow explicitly, so that staging never exceeds its reservation
+            size_t new_capacity = std::max(needed, 2 * data.capacity());
+            if (staged + new_capacity - data.capacity() > staging.size())
+            {
+                flush();
+                new_capacity = obj.size();
+            }
+            size_t old_capacity = data.capacity();
+            data.reserve(new_capacity);
+            staged += data.capacity() - old_capacity;
+        }
+        data.append(obj.start(), obj.size());
+    };
+
+    buffer.set_file(infile);
+    while (!buffer.eof())
+    {
+        while (!buffer.block_end())
+            stage(buffer.next());
+        buffer.refresh();
+    }
+    flush();
+    phase.set("buckets", bucket_files.size());
+    return bucket_files;
 }
@@ -48,6 +48,91 @@ void SeqUtils::seq2hash(std::vector<uint64_t>& hash, const char* seq, ssize_t le
         );
 }
 
+// Nucleotides take even codes in alphabetical order. Any other character is stored as an odd escape code,
+// which places it between neighbouring nucleotides, followed by two codes of its byte value.
+// Zero is reserved for padding, so packed sequences compare (bytewise) in the same order as the original ones.
+static const char PACK_ALPHABET[] = "ACGNT";
+
+static inline unsigned char _char2code(char c)
+{
+    switch (c)
+    {
+        case 'A':
+            return 2;
+        case 'C':
+            return 4;
+        case 'G':
+            return 6;
+        case 'N':
+            return 8;
+        case 'T':
+            return 10;
+        default:
+        {
+            unsigned char code = 1;
+            for (const char* ptr = PACK_ALPHABET; *ptr && static_cast<unsigned char>(*ptr) < static_cast<unsigned char>(c); ++ptr)
+                code += 2;
+            return code;
+        }
+    }
+}
+
+ssize_t SeqUtils::packedCodes(const char* seq, ssize_t len)
+{
+    ssize_t codes = len;
+    for (ssize_t i = 0; i < len; ++i)
+        if (_char2code(seq[i]) % 2)
+            codes += 2;
+    return codes;
+}
+
+void SeqUtils::packSeq(char* packed, const char* seq, ssize_t len)
+{
+    ssize_t pos = 0;
+    auto put = [&](unsigned char code)
+    {
+        if (pos % 2)
+            packed[pos / 2] |= static_cast<char>(code);
+        else
+            packed[pos / 2] = static_cast<char>(code << 4);
+        ++pos;
+    };
+    for (ssize_t i = 0; i < len; ++i)
+    {
+        unsigned char code = _char2code(seq[i]);
+        put(code);
+        if (code % 2)
+        {
+            unsigned char byte = static_cast<unsigned char>(seq[i]);
+            put(byte >> 4);
+            put(byte & 0x0F);
+        }
+    }
+}
+
+// Restores sequence of given number of codes, returns its length
+ssize_t SeqUtils::unpackSeq(char* seq, const char* packed, ssize_t codes)
+{
+    auto get = [packed](ssize_t pos) -> unsigned char
+    {
+        unsigned char byte = static_cast<unsigned char>(packed[pos / 2]);
+        return (pos % 2) ? (byte & 0x0F) : (byte >> 4);
+    };
+    ssize_t len = 0;
+    for (ssize_t pos = 0; pos < codes; ++len)
+    {
+        unsigned char code = get(pos++);
+        if (code % 2)
+        {
+            seq[len] = static_cast<char>((get(pos) << 4) | get(pos + 1));
+            pos += 2;
+        }
+        else
+            seq[len] = PACK_ALPHABET[code / 2 - 1];
+    }
+    return len;
+}
+
 
 int SeqUtils::seqncmp(const char* s1, const char* s2, size_t len)
 {
@@ -12,6 +12,12 @@ namespace SeqUtils
     uint64_t pattern2number(const char*, size_t);
     void seq2hash(std::vector<uint64_t>&, const char*, ssize_t);
 
+    // order-preserving packing of two nucleotides per byte (other characters take three 4-bit codes)
+    ssize_t packedCodes(const char*, ssize_t);
+    inline ssize_t packedLen(ssize_t codes) { return (codes + 1) / 2; }
+    void packSeq(char*, const char*, ssize_t);
+    ssize_t unpackSeq(char*, const char*, ssize_t);
+
     int seqncmp(const char*, const char*, size_t);
     uint hammingDistance(const char*, const char*, ssize_t);
 }
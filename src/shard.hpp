@@ -0,0 +1,212 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "bufferedinput.hpp"
+#include "file_utils.hpp"
+#include "paired_external_sort.hpp"
+
+using std::string;
+
+/*
+Deterministic split of input between independent runs (--shard i/N option).
+A record (pair) goes to the shard chosen by a hash of the first PREFIX_LEN bases of its sequence(s),
+so exact duplicates, as well as reads that differ only after the prefix, always meet in the same shard.
+Outputs of all shards are then assembled by the merge step (--merge-shards option).
+*/
+namespace Shard
+{
+    const ssize_t PREFIX_LEN = 16;
+
+    // FNV-1a hash of sequence prefix (without trailing newline)
+    inline uint64_t prefix_hash(uint64_t hash, const char* seq, ssize_t seq_len)
+    {
+        ssize_t len = std::min(seq_len - 1, PREFIX_LEN);
+        for (ssize_t i = 0; i < len; ++i)
+        {
+            hash ^= static_cast<unsigned char>(seq[i]);
+            hash *= 1099511628211ul;
+        }
+        return hash;
+    }
+
+    // final mix spreads prefix hashes evenly across any number of shards
+    inline uint shard_of(uint64_t hash, uint count)
+    {
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdul;
+        hash ^= hash >> 33;
+        return hash % count;
+    }
+
+    template<class T>
+    inline uint shard_of(const T& obj, uint count)
+    {
+        return shard_of(prefix_hash(14695981039346656037ul, obj.seq(), obj.seq_len()), count);
+    }
+
+    template<class T>
+    inline uint shard_of(const RecordPair<T>& pair, uint count)
+    {
+        uint64_t hash = prefix_hash(14695981039346656037ul, pair.left.seq(), pair.left.seq_len());
+        return shard_of(prefix_hash(hash, pair.right.seq(), pair.right.seq_len()), count);
+    }
+
+    // Copies records of shard index (0-based) out of count shards, returns numbers of selected and all records
+    template<class T>
+    std::pair<size_t, size_t> extract(const string& infile, const string& outfile,
+                                      uint index, uint count, ssize_t memlimit)
+    {
+        BufferedInput<T> buffer(memlimit);
+        buffer.set_file(infile.c_str());
+        FileUtils::UniversalOutputFile output_file{outfile.c_str()};
+        size_t selected = 0ul, total = 0ul;
+        while (!buffer.eof())
+        {
+            while (!buffer.block_end())
+            {
+                T obj = buffer.next();
+                total++;
+                if (shard_of(obj, count) != index)
+                    continue;
+                output_file.write(obj.start(), obj.size());
+                selected++;
+            }
+            buffer.refresh();
+        }
+        return {selected, total};
+    }
+
+    template<class T>
+    std::pair<size_t, size_t> extract(const string& infile1, const string& infile2,
+                                      const string& outfile1, const string& outfile2,
+                                      uint index, uint count, ssize_t memlimit)
+    {
+        PairedBufferedInput<T> buffer(memlimit / 2);
+        buffer.set_files(infile1.c_str(), infile2.c_str());
+        FileUtils::PairedOutputFile outputs{outfile1.c_str(), outfile2.c_str()};
+        FileUtils::UniversalOutputFile& output_file1 = outputs.left();
+        FileUtils::UniversalOutputFile& output_file2 = outputs.right();
+        size_t selected = 0ul, total = 0ul;
+        while (!buffer.eof())
+        {
+            while (!buffer.block_end())
+            {
+                RecordPair<T> pair = buffer.next();
+                total++;
+                if (shard_of(pair, count) != index)
+                    continue;
+                output_file1.write(pair.left.start(), pair.left.size());
+                output_file2.write(pair.right.start(), pair.right.size());
+                selected++;
+            }
+            buffer.refresh();
+        }
+        return {selected, total};
+    }
+
+    // Appends cluster files of all shard outputs to the cluster file of merged output
+    inline void merge_clusters(const std::vector<string>& infiles, const string& outfile)
+    {
+        string outname = outfile + ".clusters";
+        std::ofstream output(outname, std::ios_base::binary);
+        check_fstream_ok<std::ofstream>(output, outname.c_str());
+        for (auto& infile: infiles)
+        {
+            string inname = infile + ".clusters";
+            std::ifstream input(inname, std::ios_base::binary);
+            check_fstream_ok<std::ifstream>(input, inname.c_str());
+            output << input.rdbuf();
+        }
+        if (!output)
+            throw std::runtime_error("Could not write merged clusters file!");
+    }
+
+    /*
+    Assembles outputs of all shards into a single output.
+    Outputs of sequence-based modes are sorted by sequence and are merged so that the result is ordered
+    the same way as output of a single run; other outputs are concatenated in order of shards.
+    */
+    template<class T>
+    void merge(const std::vector<string>& infiles, const string& outfile,
+               bool sorted, bool clusters, ssize_t memlimit)
+    {
+        {
+            FileUtils::UniversalOutputFile output_file{outfile.c_str()};
+            auto write = [&](size_t, const T& obj) { output_file.write(obj.start(), obj.size()); };
+            std::vector<std::unique_ptr<BufferedInput<T>>> inputs;
+            if (sorted)
+            {
+                for (auto& infile: infiles)
+                {
+                    inputs.push_back(std::make_unique<BufferedInput<T>>(memlimit / infiles.size()));
+                    inputs.back()->set_file(infile.c_str());
+                }
+                mergeSortedInputs(inputs, write);
+            } else {
+                for (size_t i = 0; i < infiles.size(); ++i)
+                {
+                    BufferedInput<T> buffer(memlimit);
+                    buffer.set_file(infiles[i].c_str());
+                    while (!buffer.eof())
+                    {
+                        while (!buffer.block_end())
+                            write(i, buffer.next());
+                        buffer.refresh();
+                    }
+                }
+            }
+        }
+        if (clusters)
+            merge_clusters(infiles, outfile);
+    }
+
+    template<class T>
+    void merge(const std::vector<string>& infiles1, const std::vector<string>& infiles2,
+               const string& outfile1, const string& outfile2,
+               bool sorted, bool clusters, ssize_t memlimit)
+    {
+        {
+            FileUtils::PairedOutputFile outputs{outfile1.c_str(), outfile2.c_str()};
+            FileUtils::UniversalOutputFile& output_file1 = outputs.left();
+            FileUtils::UniversalOutputFile& output_file2 = outputs.right();
+            auto write = [&](size_t, const RecordPair<T>& pair)
+            {
+                output_file1.write(pair.left.start(), pair.left.size());
+                output_file2.write(pair.right.start(), pair.right.size());
+            };
+            std::vector<std::unique_ptr<PairedBufferedInput<T>>> inputs;
+            if (sorted)
+            {
+                for (size_t i = 0; i < infiles1.size(); ++i)
+                {
+                    inputs.push_back(std::make_unique<PairedBufferedInput<T>>(memlimit / infiles1.size() / 2));
+                    inputs.back()->set_files(infiles1[i].c_str(), infiles2[i].c_str());
+                }
+                mergeSortedInputs(inputs, write);
+            } else {
+                for (size_t i = 0; i < infiles1.size(); ++i)
+                {
+                    PairedBufferedInput<T> buffer(memlimit / 2);
+                    buffer.set_files(infiles1[i].c_str(), infiles2[i].c_str());
+                    while (!buffer.eof())
+                    {
+                        while (!buffer.block_end())
+                            write(i, buffer.next());
+                        buffer.refresh();
+                    }
+                }
+            }
+        }
+        if (clusters)
+        {
+            merge_clusters(infiles1, outfile1);
+            merge_clusters(infiles2, outfile2);
+        }
+    }
+}
@@ -0,0 +1,86 @@
+#include "sketch.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+#include <stdexcept>
+
+HyperLogLog::HyperLogLog(uint precision)
+    : m_precision(precision), m_registers(1ul << precision, 0)
+{
+    if ((precision < 4) || (precision > 18))
+        throw std::runtime_error("Unsupported HyperLogLog precision!");
+}
+
+void HyperLogLog::add(uint64_t hash)
+{
+    hash = Sketch::mix(hash);
+    // leading bits select a register, the rest give the rank of the first set bit
+    size_t idx = hash >> (64 - m_precision);
+    uint64_t rest = (hash << m_precision) | (1ul << (m_precision - 1));
+    uint8_t rank = __builtin_clzl(rest) + 1;
+    if (rank > m_registers[idx])
+        m_registers[idx] = rank;
+}
+
+void HyperLogLog::merge(const HyperLogLog& other)
+{
+    if (other.m_precision != m_precision)
+        throw std::runtime_error("HyperLogLog sketches of different precision can not be merged!");
+    for (size_t i = 0; i < m_registers.size(); ++i)
+        m_registers[i] = std::max(m_registers[i], other.m_registers[i]);
+}
+
+double HyperLogLog::estimate() const
+{
+    double m = m_registers.size();
+    double sum = 0.0;
+    size_t zeros = 0;
+    for (uint8_t reg: m_registers)
+    {
+        sum += std::ldexp(1.0, -reg);
+        zeros += (reg == 0);
+    }
+    double alpha = 0.7213 / (1.0 + 1.079 / m);
+    double result = alpha * m * m / sum;
+    // linear counting is more accurate for small cardinalities
+    if ((result <= 2.5 * m) && (zeros > 0))
+        result = m * std::log(m / zeros);
+    return result;
+}
+
+double HyperLogLog::error() const
+{
+    return 1.04 / std::sqrt(static_cast<double>(m_registers.size()));
+}
+
+void KMinValues::add(uint64_t hash)
+{
+    hash = Sketch::mix(hash);
+    if ((m_values.size() == m_k) && (hash > m_values.rbegin()->first))
+        return;
+    if ((++m_values[hash] == 1) && (m_values.size() > m_k))
+        m_values.erase(std::prev(m_values.end()));
+}
+
+double KMinValues::estimate() const
+{
+    if (this->exact())
+        return m_values.size();
+    // k-th smallest of uniformly distributed hashes, normalized to (0, 1]
+    double max_value = std::ldexp(static_cast<double>(m_values.rbegin()->first) + 1.0, -64);
+    return (m_k - 1) / max_value;
+}
+
+double KMinValues::error() const
+{
+    return this->exact() ? 0.0 : 1.0 / std::sqrt(static_cast<double>(m_k - 2));
+}
+
+std::map<uint64_t, size_t> KMinValues::histogram() const
+{
+    std::map<uint64_t, size_t> result;
+    for (auto& item: m_values)
+        result[item.second]++;
+    return result;
+}
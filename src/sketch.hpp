@@ -0,0 +1,58 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <sys/types.h>
+#include <vector>
+
+/*
+HyperLogLog sketch of the number of distinct items, given by their 64-bit hashes.
+Memory is 2^precision bytes, relative standard error is about 1.04 / sqrt(2^precision)
+(0.8% for the default precision of 14).
+*/
+class HyperLogLog
+{
+public:
+    explicit HyperLogLog(uint precision = 14);
+    void add(uint64_t hash);
+    void merge(const HyperLogLog&);
+    double estimate() const;
+    // relative standard error of estimates
+    double error() const;
+private:
+    uint m_precision;
+    std::vector<uint8_t> m_registers;
+};
+
+/*
+K minimum values sketch with multiplicities: the k smallest hashes of distinct items are kept along with numbers
+of their occurrences. Kept items are a uniform sample of distinct items, so their multiplicities follow the
+distribution of cluster sizes. Number of distinct items is estimated with relative standard error of 1 / sqrt(k - 2).
+*/
+class KMinValues
+{
+public:
+    explicit KMinValues(size_t k = 16384) : m_k(k) {}
+    void add(uint64_t hash);
+    double estimate() const;
+    double error() const;
+    // the sketch holds all distinct items, so its values are exact
+    inline bool exact()             const   { return m_values.size() < m_k; }
+    // numbers of sampled distinct items by their multiplicities
+    std::map<uint64_t, size_t> histogram() const;
+    inline size_t size()            const   { return m_values.size(); }
+private:
+    size_t m_k;
+    std::map<uint64_t, uint64_t> m_values;
+};
+
+namespace Sketch
+{
+    // Finalizer of splitmix64: spreads weak hashes (e.g. combined ones) over all bits
+    inline uint64_t mix(uint64_t value)
+    {
+        value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ul;
+        value = (value ^ (value >> 27)) * 0x94d049bb133111ebul;
+        return value ^ (value >> 31);
+    }
+}
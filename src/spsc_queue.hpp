@@ -0,0 +1,126 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+// Occupancy counters of a queue: if a queue is mostly full, its consumer is the bottleneck,
+// if it is mostly empty, its producer is.
+struct QueueStats
+{
+    size_t capacity = 0ul;
+    size_t pushes = 0ul, full_waits = 0ul;   // producer side
+    size_t pops = 0ul, empty_waits = 0ul;    // consumer side
+    size_t occupancy_sum = 0ul;              // number of items in queue, sampled on each push
+
+    double mean_occupancy() const { return pushes ? static_cast<double>(occupancy_sum) / pushes : 0.0; }
+    double full_ratio()     const { return pushes ? static_cast<double>(full_waits) / pushes : 0.0; }
+    double empty_ratio()    const { return pops ? static_cast<double>(empty_waits) / pops : 0.0; }
+};
+
+/*
+Bounded lock-free queue for a single producer thread and a single consumer thread.
+push() and pop() wait while queue is full or empty respectively and return false once queue is closed.
+Consumer still receives all items pushed before close().
+*/
+template<class T>
+class SpscQueue
+{
+public:
+    SpscQueue(size_t capacity) : m_slots(capacity + 1) { m_stats.capacity = capacity; }
+    bool push(T&& item);
+    bool pop(T& item);
+    bool try_push(T&& item);
+    bool try_pop(T& item);
+    void close()                    { m_closed.store(true, std::memory_order_release); }
+    QueueStats stats() const        { return m_stats; }
+private:
+    inline size_t next(size_t idx) const    { return (idx + 1 == m_slots.size()) ? 0 : idx + 1; }
+    static void wait(uint& spins);
+private:
+    std::vector<T> m_slots;
+    // indices are modified by different threads -> keep them on separate cache lines
+    alignas(64) std::atomic<size_t> m_head = 0;  // next item to pop, owned by consumer
+    alignas(64) std::atomic<size_t> m_tail = 0;  // next free slot, owned by producer
+    alignas(64) std::atomic<bool> m_closed = false;
+    QueueStats m_stats;
+};
+
+template<class T>
+void SpscQueue<T>::wait(uint& spins)
+{   // spin shortly, then back off so that idle stages do not eat up cpu
+    if (++spins < 64)
+        std::this_thread::yield();
+    else
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+}
+
+template<class T>
+bool SpscQueue<T>::push(T&& item)
+{
+    size_t tail = m_tail.load(std::memory_order_relaxed);
+    size_t head = m_head.load(std::memory_order_acquire);
+    if (next(tail) == head)
+    {
+        m_stats.full_waits++;
+        for (uint spins = 0; next(tail) == head; head = m_head.load(std::memory_order_acquire))
+        {
+            if (m_closed.load(std::memory_order_acquire))
+                return false;
+            wait(spins);
+        }
+    }
+    if (m_closed.load(std::memory_order_acquire))
+        return false;
+    m_slots[tail] = std::move(item);
+    m_tail.store(next(tail), std::memory_order_release);
+    m_stats.pushes++;
+    m_stats.occupancy_sum += (tail >= head) ? (tail - head + 1) : (tail + m_slots.size() - head + 1);
+    return true;
+}
+
+template<class T>
+bool SpscQueue<T>::pop(T& item)
+{
+    size_t head = m_head.load(std::memory_order_relaxed);
+    if (head == m_tail.load(std::memory_order_acquire))
+    {
+        m_stats.empty_waits++;
+        for (uint spins = 0; head == m_tail.load(std::memory_order_acquire); )
+        {
+            if (m_closed.load(std::memory_order_acquire))
+            {   // producer may have pushed the last item right before closing
+                if (head == m_tail.load(std::memory_order_acquire))
+                    return false;
+                break;
+            }
+            wait(spins);
+        }
+    }
+    item = std::move(m_slots[head]);
+    m_head.store(next(head), std::memory_order_release);
+    m_stats.pops++;
+    return true;
+}
+
+template<class T>
+bool SpscQueue<T>::try_push(T&& item)
+{
+    size_t tail = m_tail.load(std::memory_order_relaxed);
+    if (next(tail) == m_head.load(std::memory_order_acquire))
+        return false;
+    m_slots[tail] = std::move(item);
+    m_tail.store(next(tail), std::memory_order_release);
+    return true;
+}
+
+template<class T>
+bool SpscQueue<T>::try_pop(T& item)
+{
+    size_t head = m_head.load(std::memory_order_relaxed);
+    if (head == m_tail.load(std::memory_order_acquire))
+        return false;
+    item = std::move(m_slots[head]);
+    m_head.store(next(head), std::memory_order_release);
+    return true;
+}
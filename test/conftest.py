@@ -1,4 +1,5 @@
 from pathlib import Path
+import random
 
 import pytest
 
@@ -9,3 +10,17 @@ def exe_path():
 @pytest.fixture(scope="session")
 def tests_path():
     return Path(__file__).parent.resolve()
+
+# Writes FASTA file of random reads of the same length, a quarter of them duplicate others;
+# inputs of several kilobytes are split into many sort chunks and parse blocks with --block-size
+@pytest.fixture
+def random_reads(tmp_path):
+    def make(name, count=400, length=30, seed=1, alphabet="ACGT"):
+        rng = random.Random(seed)
+        seqs = ["".join(rng.choice(alphabet) for _ in range(length)) for _ in range(count * 3 // 4)]
+        seqs += [rng.choice(seqs) for _ in range(count - len(seqs))]
+        rng.shuffle(seqs)
+        path = tmp_path / name
+        path.write_text("".join(f">read_{i}\n{seq}\n" for i, seq in enumerate(seqs)))
+        return path
+    return make
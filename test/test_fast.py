@@ -1,10 +1,17 @@
 import subprocess
 import filecmp
+import gzip
+import json
+import os
+import select
+import shutil
+import time
 
 import pytest
 
 
-def test_single_fast(tmp_path, exe_path, tests_path):
+@pytest.mark.parametrize("cli_args", [[], ["--threads", "4"]])
+def test_single_fast(tmp_path, exe_path, tests_path, cli_args):
     if not exe_path.exists():
         pytest.fail("fastq-dupaway binary not found in current directory!")
     
@@ -13,7 +20,7 @@ def test_single_fast(tmp_path, exe_path, tests_path):
     output_file = tmp_path / "single_fast.fa"
 
     result = subprocess.run(
-        [str(exe_path), "-i", str(input_file), "-o", str(output_file), "--format", "fasta", "--fast"],
+        [str(exe_path), "-i", str(input_file), "-o", str(output_file), "--format", "fasta", "--fast", *cli_args],
         capture_output=True,
         text=True
     )
@@ -26,6 +33,37 @@ def test_single_fast(tmp_path, exe_path, tests_path):
     assert files_match, f"Output file {output_file} does not match expected {expected_output}"
 
 
+@pytest.mark.parametrize("cli_args", [["--fast"], ["--fast", "--threads", "4"], ["--threads", "4"]])
+def test_parallel_blocks(tmp_path, exe_path, random_reads, cli_args):
+    if not exe_path.exists():
+        pytest.fail("fastq-dupaway binary not found in current directory!")
+
+    # small blocks make records cross block boundaries and split points of parsing threads
+    input_file = random_reads("reads.fa", count=2000)
+    output_file = tmp_path / "output.fa"
+
+    result = subprocess.run(
+        [str(exe_path), "-i", str(input_file), "-o", str(output_file), "--format", "fasta", "--block-size", "1000", *cli_args],
+        capture_output=True,
+        text=True
+    )
+
+    assert result.returncode == 0, f"fastq-dupaway failed: {result.stderr}"
+
+    lines = input_file.read_text().splitlines()
+    output = output_file.read_text().splitlines()
+    if "--fast" in cli_args:
+        # the first read of every sequence is kept in input order
+        seen, expected = set(), []
+        for header, seq in zip(lines[::2], lines[1::2]):
+            if seq not in seen:
+                seen.add(seq)
+                expected += [header, seq]
+        assert output == expected
+    else:
+        assert output[1::2] == sorted(set(lines[1::2]))
+
+
 def test_paired_fast(tmp_path, exe_path, tests_path):
     if not exe_path.exists():
         pytest.fail("fastq-dupaway binary not found in current directory!")
@@ -55,3 +93,223 @@ def test_paired_fast(tmp_path, exe_path, tests_path):
         assert output.exists(), f"Output file {output} was not created!"
         files_match = filecmp.cmp(output, expected, shallow=False)
         assert files_match, f"Output file {output} does not match expected {expected}"
+
+
+def test_record_index(tmp_path, exe_path, tests_path):
+    if not exe_path.exists():
+        pytest.fail("fastq-dupaway binary not found in current directory!")
+
+    # index is saved next to input, so work on a copy of it
+    input_file = tmp_path / "single_fast.fa"
+    input_file.write_bytes((tests_path / "inputs" / "single_fast.fa").read_bytes())
+    expected_output = tests_path / "expected" / "single_fast.fa"
+    index_file = tmp_path / "single_fast.fa.fqi"
+
+    for expected_message in ("Built index", "Using index"):
+        output_file = tmp_path / "output.fa"
+        result = subprocess.run(
+            [str(exe_path), "-i", str(input_file), "-o", str(output_file), "--format", "fasta", "--fast",
+             "--fqi", "--verbose"],
+            capture_output=True,
+            text=True
+        )
+
+        assert result.returncode == 0, f"fastq-dupaway failed: {result.stderr}"
+        assert expected_message in result.stdout, f"Unexpected output: {result.stdout}"
+        assert index_file.exists(), "Index file was not created."
+
+        files_match = filecmp.cmp(output_file, expected_output, shallow=False)
+        assert files_match, f"Output file {output_file} does not match expected {expected_output}"
+
+    # index is built by the run itself, rather than by an extra pass over input
+    index_file.unlink()
+    result = subprocess.run(
+        [str(exe_path), "-i", str(input_file), "-o", str(tmp_path / "output.fa"), "--format", "fasta", "--fast",
+         "--fqi", "--stats-json", str(tmp_path / "stats.json")],
+        capture_output=True,
+        text=True
+    )
+    assert result.returncode == 0, f"fastq-dupaway failed: {result.stderr}"
+    assert index_file.exists(), "Index file was not created."
+    stats = json.loads((tmp_path / "stats.json").read_text())
+    assert stats["bytes"]["input_read"] == input_file.stat().st_size, "Input was read more than once"
+
+
+@pytest.mark.parametrize("compress", [False, True])
+def test_single_stream(tmp_path, exe_path, tests_path, compress):
+    if not exe_path.exists():
+        pytest.fail("fastq-dupaway binary not found in current directory!")
+
+    input_data = (tests_path / "inputs" / "single_fast.fa").read_bytes()
+    expected_output = (tests_path / "expected" / "single_fast.fa").read_bytes()
+    if compress:
+        input_data = gzip.compress(input_data)
+
+    # reads are piped through standard input and output
+    result = subprocess.run(
+        [str(exe_path), "-i", "-", "-o", "-", "--format", "fasta", "--stream", "--verbose"],
+        input=input_data,
+        capture_output=True
+    )
+
+    assert result.returncode == 0, f"fastq-dupaway failed: {result.stderr}"
+    assert result.stdout == expected_output, "Streamed output does not match expected output"
+
+
+def test_stream_latency(exe_path):
+    if not exe_path.exists():
+        pytest.fail("fastq-dupaway binary not found in current directory!")
+
+    # standard input is fed slowly and kept open: every read has to be written out as soon as it arrives
+    process = subprocess.Popen(
+        [str(exe_path), "-i", "-", "-o", "-", "--format", "fasta", "--stream"],
+        stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=subprocess.PIPE
+    )
+
+    def read_output(expected):
+        output = b""
+        deadline = time.monotonic() + 10
+        while len(output) < len(expected):
+            ready, _, _ = select.select([process.stdout], [], [], max(0, deadline - time.monotonic()))
+            if not ready:
+                break
+            chunk = os.read(process.stdout.fileno(), 4096)
+            if not chunk:
+                break
+            output += chunk
+        return output
+
+    try:
+        for record, expected in [(b">r1\nACGT\n", b">r1\nACGT\n"),
+                                 (b">r2\nACGT\n", b""),
+                                 (b">r3\nGGCC", None),
+                                 (b"\n", b">r3\nGGCC\n")]:
+            process.stdin.write(record)
+            process.stdin.flush()
+            if expected:
+                assert read_output(expected) == expected, "Read was not written out before more input arrived"
+        process.stdin.close()
+        assert process.stdout.read() == b"", "Duplicate read was written out"
+        assert process.wait(timeout=10) == 0, f"fastq-dupaway failed: {process.stderr.read()}"
+    finally:
+        process.kill()
+        process.wait()
+
+
+@pytest.mark.skipif(shutil.which("zstd") is None, reason="zstd program is not available")
+@pytest.mark.parametrize("stdin", [False, True])
+@pytest.mark.parametrize("threads", ["1", "4"])
+def test_zstd(tmp_path, exe_path, tests_path, stdin, threads):
+    if not exe_path.exists():
+        pytest.fail("fastq-dupaway binary not found in current directory!")
+
+    input_file = tmp_path / "single_fast.fa.zst"
+    output_file = tmp_path / "output.fa.zst"
+    expected_output = tests_path / "expected" / "single_fast.fa"
+    subprocess.run(["zstd", "-q", str(tests_path / "inputs" / "single_fast.fa"), "-o", str(input_file)], check=True)
+
+    # zstd input is recognized by its contents, output is compressed by its extension (with worker threads if several)
+    result = subprocess.run(
+        [str(exe_path), "-i", "-" if stdin else str(input_file), "-o", str(output_file), "--format", "fasta", "--fast",
+         "--threads", threads],
+        input=input_file.read_bytes() if stdin else None,
+        capture_output=True
+    )
+
+    assert result.returncode == 0, f"fastq-dupaway failed: {result.stderr}"
+    output = subprocess.run(["zstd", "-dc", str(output_file)], capture_output=True, check=True).stdout
+    assert output == expected_output.read_bytes(), "Decompressed output does not match expected output"
+
+
+@pytest.mark.parametrize("mem_limit", ["500", "20480", "auto"])
+def test_memory_budget(tmp_path, exe_path, tests_path, mem_limit):
+    if not exe_path.exists():
+        pytest.fail("fastq-dupaway binary not found in current directory!")
+
+    input_file = tests_path / "inputs" / "single_fast.fa"
+    expected_output = tests_path / "expected" / "single_fast.fa"
+    output_file = tmp_path / "single_fast.fa"
+    stats_file = tmp_path / "stats.json"
+
+    result = subprocess.run(
+        [str(exe_path), "-i", str(input_file), "-o", str(output_file), "--format", "fasta", "--fast",
+         "--mem-limit", mem_limit, "--stats-json", str(stats_file)],
+        capture_output=True,
+        text=True
+    )
+
+    assert result.returncode == 0, f"fastq-dupaway failed: {result.stderr}"
+    assert filecmp.cmp(output_file, expected_output, shallow=False)
+
+    # buffers and hash table are drawn from the memory budget
+    budget = json.loads(stats_file.read_text())["memory_budget"]
+    if mem_limit == "auto":
+        assert budget["limit_bytes"] >= 500 * 1024 * 1024
+    else:
+        assert budget["limit_bytes"] == int(mem_limit) * 1024 * 1024
+    assert 0 < budget["peak_bytes"] <= budget["limit_bytes"]
+
+
+@pytest.mark.parametrize("mem_limit", ["499", "0", "2G", "-5"])
+def test_invalid_mem_limit(tmp_path, exe_path, tests_path, mem_limit):
+    if not exe_path.exists():
+        pytest.fail("fastq-dupaway binary not found in current directory!")
+
+    result = subprocess.run(
+        [str(exe_path), "-i", str(tests_path / "inputs" / "single_fast.fa"), "-o", str(tmp_path / "output.fa"),
+         "--format", "fasta", "--fast", "--mem-limit", mem_limit],
+        capture_output=True,
+        text=True
+    )
+
+    assert result.returncode != 0
+    assert "--mem-limit" in result.stderr
+
+
+@pytest.mark.parametrize("filename,cli_args,expected_mode", [
+    ("single_fast.fa", [], "fast"),
+    ("single_loose.fa", ["--compare-seq", "loose"], "sequence"),
+])
+def test_mode_auto(tmp_path, exe_path, tests_path, filename, cli_args, expected_mode):
+    if not exe_path.exists():
+        pytest.fail("fastq-dupaway binary not found in current directory!")
+
+    input_file = tests_path / "inputs" / filename
+    expected_output = tests_path / "expected" / filename
+    output_file = tmp_path / filename
+
+    result = subprocess.run(
+        [str(exe_path), "-i", str(input_file), "-o", str(output_file), "--format", "fasta",
+         "--mode", "auto", "--verbose"] + cli_args,
+        capture_output=True,
+        text=True
+    )
+
+    assert result.returncode == 0, f"fastq-dupaway failed: {result.stderr}"
+    assert f"'{expected_mode}' mode is used" in result.stdout, f"Unexpected output: {result.stdout}"
+    assert filecmp.cmp(output_file, expected_output, shallow=False)
+
+
+@pytest.mark.parametrize("filenames,expected", [
+    (["single_fast.fa"], ["10 reads (whole input)", "Unique reads: 6 ", "Duplicate fraction: 40.00%"]),
+    (["paired_fast_r1.fa", "paired_fast_r2.fa"], ["10 read pairs (whole input)", "Unique read pairs: 7 ", "Duplicate fraction: 30.00%"]),
+])
+def test_estimate_only(tmp_path, exe_path, tests_path, filenames, expected):
+    if not exe_path.exists():
+        pytest.fail("fastq-dupaway binary not found in current directory!")
+
+    cli_args = ["-i", str(tests_path / "inputs" / filenames[0])]
+    if len(filenames) == 2:
+        cli_args += ["-u", str(tests_path / "inputs" / filenames[1])]
+    result = subprocess.run(
+        [str(exe_path), "--format", "fasta", "--estimate-only"] + cli_args,
+        capture_output=True,
+        text=True,
+        cwd=tmp_path
+    )
+
+    assert result.returncode == 0, f"fastq-dupaway failed: {result.stderr}"
+    for line in expected:
+        assert line in result.stdout, f"Unexpected output: {result.stdout}"
+    assert "exact" in result.stdout
+    assert list(tmp_path.iterdir()) == [], "No files should be written"
@@ -1,5 +1,8 @@
 import subprocess
 import filecmp
+import json
+import struct
+import zlib
 
 import pytest
 
@@ -10,6 +13,9 @@ import pytest
         ("single_tight.fa", ["--format", "fasta"]),
         ("single_loose.fa", ["--format", "fasta", "--compare-seq", "loose"]),
         ("single_hamming.fa", ["--format", "fasta", "--compare-seq", "tail-hamming", "--distance", "1"]),
+        ("single_tight.fa", ["--format", "fasta", "--key-sort"]),
+        ("single_loose.fa", ["--format", "fasta", "--compare-seq", "loose", "--key-sort"]),
+        ("single_loose.fa", ["--format", "fasta", "--compare-seq", "loose", "--threads", "4"]),
     ],
 )
 def test_single_fasta(tmp_path, exe_path, tests_path, filename, cli_args):
@@ -42,6 +48,7 @@ def test_single_fasta(tmp_path, exe_path, tests_path, filename, cli_args):
     "filename, cli_args",
     [
         ("paired_tight", ["--format", "fasta"]),
+        ("paired_tight", ["--format", "fasta", "--key-sort"]),
     ],
 )
 def test_paired_fasta(tmp_path, exe_path, tests_path, filename, cli_args):
@@ -75,6 +82,63 @@ def test_paired_fasta(tmp_path, exe_path, tests_path, filename, cli_args):
         assert files_match, f"Output file {output} does not match expected {expected}"
 
 
+def interleave(path_1, path_2):
+    """Returns records of two fasta files one after another."""
+    def records(path):
+        text = path.read_text()
+        return [">" + record for record in text.split(">")[1:]]
+    return "".join(left + right for left, right in zip(records(path_1), records(path_2)))
+
+
+@pytest.mark.parametrize(
+    "filename, cli_args",
+    [
+        ("paired_tight", []),
+        ("paired_fast", ["--fast"]),
+        ("paired_fast", ["--mode", "fast", "--stream"]),
+    ],
+)
+@pytest.mark.parametrize("split_output", [False, True])
+@pytest.mark.parametrize("stdin", [False, True])
+def test_interleaved(tmp_path, exe_path, tests_path, filename, cli_args, split_output, stdin):
+    if not exe_path.exists():
+        pytest.fail("fastq-dupaway binary not found in current directory!")
+
+    expected_output_1 = tests_path / "expected" / f"{filename}_r1.fa"
+    expected_output_2 = tests_path / "expected" / f"{filename}_r2.fa"
+    input_text = interleave(tests_path / "inputs" / f"{filename}_r1.fa", tests_path / "inputs" / f"{filename}_r2.fa")
+    input_file = tmp_path / f"{filename}_interleaved.fa"
+    input_file.write_text(input_text)
+
+    output_file_1 = tmp_path / f"{filename}_r1.fa"
+    output_file_2 = tmp_path / f"{filename}_r2.fa"
+    outputs = ["-o", str(output_file_1)] + (["-p", str(output_file_2)] if split_output else [])
+
+    result = subprocess.run(
+        [str(exe_path), "--interleaved", "-i", "-" if stdin else str(input_file), *outputs, "--format", "fasta", *cli_args],
+        input=input_text if stdin else None,
+        capture_output=True,
+        text=True
+    )
+
+    assert result.returncode == 0, f"fastq-dupaway failed: {result.stderr}"
+    if split_output:
+        assert filecmp.cmp(output_file_1, expected_output_1, shallow=False)
+        assert filecmp.cmp(output_file_2, expected_output_2, shallow=False)
+    else:
+        assert output_file_1.read_text() == interleave(expected_output_1, expected_output_2)
+
+    # the last record of an odd interleaved input has no mate
+    input_file.write_text(input_text + ">" + input_text.split(">")[1])
+    result = subprocess.run(
+        [str(exe_path), "--interleaved", "-i", str(input_file), "-o", str(output_file_1), "--format", "fasta", *cli_args],
+        capture_output=True,
+        text=True
+    )
+    assert result.returncode != 0
+    assert "odd number of records" in result.stderr
+
+
 def test_nonmatching_outputs(tmp_path, exe_path, tests_path):
     if not exe_path.exists():
         pytest.fail("fastq-dupaway binary not found in current directory!")
@@ -95,3 +159,351 @@ def test_nonmatching_outputs(tmp_path, exe_path, tests_path):
 
     files_match = filecmp.cmp(output_file, expected_output, shallow=False)
     assert not files_match, f"Output file {output_file} was expected to not match {expected_output}"
+
+
+def test_multiple_tmpdirs(tmp_path, exe_path, random_reads):
+    if not exe_path.exists():
+        pytest.fail("fastq-dupaway binary not found in current directory!")
+
+    # small blocks split input into many sorted runs, which are striped across directories
+    input_file = random_reads("reads.fa")
+    output_file = tmp_path / "output.fa"
+    stats_file = tmp_path / "stats.json"
+    tmpdirs = [tmp_path / "scratch_1", tmp_path / "scratch_2"]
+    for tmpdir in tmpdirs:
+        tmpdir.mkdir()
+
+    result = subprocess.run(
+        [str(exe_path), "-i", str(input_file), "-o", str(output_file), "--format", "fasta",
+         "--block-size", "512", "--stats-json", str(stats_file),
+         "--tmpdir", *(str(tmpdir) for tmpdir in tmpdirs)],
+        capture_output=True,
+        text=True
+    )
+
+    assert result.returncode == 0, f"fastq-dupaway failed: {result.stderr}"
+
+    stats = json.loads(stats_file.read_text())
+    phases = {phase["name"]: phase for phase in stats["phases"]}
+    assert phases["sort: run generation"]["runs"] > len(tmpdirs)
+    assert stats["bytes"]["temp_written"] > input_file.stat().st_size
+
+    # output keeps one read of every sequence, in sorted order
+    input_seqs = input_file.read_text().splitlines()[1::2]
+    assert output_file.read_text().splitlines()[1::2] == sorted(set(input_seqs))
+
+    for tmpdir in tmpdirs:
+        assert not any(tmpdir.iterdir()), f"Temporary files were left in {tmpdir}"
+
+
+def test_pipeline(tmp_path, exe_path, random_reads):
+    if not exe_path.exists():
+        pytest.fail("fastq-dupaway binary not found in current directory!")
+
+    # small blocks force sorted runs on disk, so that the pipelined pass reads them in many blocks
+    # and records are split between blocks; output and clusters must not depend on the number of threads
+    input_file = random_reads("reads.fa", count=2000)
+    outputs = []
+    for threads in ("1", "4"):
+        output_file = tmp_path / f"output_{threads}.fa"
+        result = subprocess.run(
+            [str(exe_path), "-i", str(input_file), "-o", str(output_file), "--format", "fasta", "--write-clusters",
+             "--block-size", "1000", "--threads", threads, "--verbose"],
+            capture_output=True,
+            text=True
+        )
+        assert result.returncode == 0, f"fastq-dupaway failed: {result.stderr}"
+        outputs.append(output_file)
+
+    assert "Pipeline queues" in result.stdout, "Pipelined deduplication was not used"
+    assert filecmp.cmp(outputs[0], outputs[1], shallow=False), "Pipelined deduplication changed output"
+    assert filecmp.cmp(f"{outputs[0]}.clusters", f"{outputs[1]}.clusters", shallow=False), \
+        "Pipelined deduplication changed clusters"
+
+
+# Writes data as BGZF (as bgzip does): gzip members of at most 64 Kb, which store their compressed sizes
+def write_bgzf(path, data):
+    with open(path, "wb") as output:
+        for start in range(0, len(data), 65280):
+            block = data[start:start + 65280]
+            compressor = zlib.compressobj(6, zlib.DEFLATED, -15)
+            deflated = compressor.compress(block) + compressor.flush()
+            output.write(b"\x1f\x8b\x08\x04\0\0\0\0\0\xff" + struct.pack("<H2sHH", 6, b"BC", 2, len(deflated) + 25))
+            output.write(deflated + struct.pack("<II", zlib.crc32(block), len(block)))
+
+
+@pytest.mark.parametrize("compression", ["none", "bgzf"])
+def test_record_index(tmp_path, exe_path, random_reads, compression):
+    if not exe_path.exists():
+        pytest.fail("fastq-dupaway binary not found in current directory!")
+
+    # input of several index strides, small blocks keep it from fitting into a single chunk;
+    # the first run builds index, the second one sorts ranges of input in parallel
+    input_file = random_reads("reads.fa", count=140000, length=20)
+    if compression == "bgzf":
+        write_bgzf(tmp_path / "reads.fa.gz", input_file.read_bytes())
+        input_file = tmp_path / "reads.fa.gz"
+    args = ["--format", "fasta", "--block-size", "500000", "--threads", "4", "--verbose"]
+    expected_output = tmp_path / "expected.fa"
+    result = subprocess.run([str(exe_path), "-i", str(input_file), "-o", str(expected_output), *args],
+                            capture_output=True, text=True)
+    assert result.returncode == 0, f"fastq-dupaway failed: {result.stderr}"
+
+    for expected_message in ("Built index", "can be read in parallel"):
+        output_file = tmp_path / "output.fa"
+        result = subprocess.run([str(exe_path), "-i", str(input_file), "-o", str(output_file), "--fqi", *args],
+                                capture_output=True, text=True)
+        assert result.returncode == 0, f"fastq-dupaway failed: {result.stderr}"
+        assert expected_message in result.stdout, f"Unexpected output: {result.stdout}"
+        # which one of equal reads is kept depends on how input is split into runs, as it does on memory limit
+        assert output_file.read_text().splitlines()[1::2] == expected_output.read_text().splitlines()[1::2], \
+            "Output sequences do not match output without index"
+
+
+@pytest.mark.parametrize("cli_args", [[], ["--key-sort"]])
+def test_presorted(tmp_path, exe_path, random_reads, cli_args):
+    if not exe_path.exists():
+        pytest.fail("fastq-dupaway binary not found in current directory!")
+
+    # deduplicated output is sorted, so sorting is skipped when it is deduplicated again;
+    # small blocks keep input from fitting into a single in-memory chunk
+    sorted_file = tmp_path / "sorted.fa"
+    output_file = tmp_path / "output.fa"
+    args = ["--format", "fasta", "--block-size", "512", "--verbose", *cli_args]
+    for input_file, output in ((random_reads("reads.fa"), sorted_file), (sorted_file, output_file)):
+        result = subprocess.run(
+            [str(exe_path), "-i", str(input_file), "-o", str(output), *args],
+            capture_output=True,
+            text=True
+        )
+        assert result.returncode == 0, f"fastq-dupaway failed: {result.stderr}"
+
+    assert "Input is already sorted, sorting step was skipped." in result.stdout
+    assert filecmp.cmp(output_file, sorted_file, shallow=False), "Deduplication of sorted input changed it"
+
+
+@pytest.mark.parametrize("compare_seq", ["tight", "loose"])
+def test_key_sort_alphabet(tmp_path, exe_path, random_reads, compare_seq):
+    if not exe_path.exists():
+        pytest.fail("fastq-dupaway binary not found in current directory!")
+
+    # IUPAC codes and lowercase bases are escaped in packed keys, the order of reads must not change;
+    # shorter reads are prefixes of longer ones for loose comparison
+    input_file = tmp_path / "reads.fa"
+    input_file.write_text(random_reads("short.fa", length=2, alphabet="ACGNTRYacgt-").read_text() +
+                          random_reads("long.fa", length=3, alphabet="ACGNTRYacgt-", seed=2).read_text())
+    index_file = tmp_path / "library.idx"
+    outputs = []
+    for name, args in (("plain.fa", []),
+                       ("keys.fa", ["--key-sort"]),
+                       ("indexed.fa", ["--index-out", str(index_file)]),
+                       ("reindexed.fa", ["--index-in", str(index_file)])):
+        output_file = tmp_path / name
+        result = subprocess.run(
+            [str(exe_path), "-i", str(input_file), "-o", str(output_file), "--format", "fasta",
+             "--compare-seq", compare_seq, "--block-size", "512", *args],
+            capture_output=True,
+            text=True
+        )
+        assert result.returncode == 0, f"fastq-dupaway failed: {result.stderr}"
+        outputs.append(output_file)
+
+    # representatives of duplicates may differ between sort chunks, so only compare sequences (in order)
+    def read_seqs(path):
+        return [line for line in path.read_text().splitlines() if not line.startswith(">")]
+
+    assert read_seqs(outputs[1]) == read_seqs(outputs[0]), "Key sort changed deduplication result"
+    assert read_seqs(outputs[2]) == read_seqs(outputs[0]), "Saving index changed deduplication result"
+    assert outputs[3].read_text() == "", "Reads stored in index were not recognized as duplicates"
+
+
+def test_length_buckets(tmp_path, exe_path, tests_path):
+    if not exe_path.exists():
+        pytest.fail("fastq-dupaway binary not found in current directory!")
+
+    input_file = tests_path / "inputs" / "single_tight.fa"
+    expected_output = tests_path / "expected" / "single_tight.fa"
+    output_file = tmp_path / "single_tight.fa"
+
+    result = subprocess.run(
+        [str(exe_path), "-i", str(input_file), "-o", str(output_file), "--format", "fasta",
+         "--length-buckets", "--threads", "2"],
+        capture_output=True,
+        text=True
+    )
+
+    assert result.returncode == 0, f"fastq-dupaway failed: {result.stderr}"
+
+    # reads are grouped by sequence length, so only compare sets of sequences
+    def read_seqs(path):
+        return sorted(line for line in path.read_text().splitlines() if not line.startswith(">"))
+
+    assert read_seqs(output_file) == read_seqs(expected_output), \
+        f"Sequences in {output_file} do not match expected {expected_output}"
+
+
+def test_persistent_index(tmp_path, exe_path, tests_path):
+    if not exe_path.exists():
+        pytest.fail("fastq-dupaway binary not found in current directory!")
+
+    # split input into two "lanes", second one is deduplicated against index of the first one
+    lines = (tests_path / "inputs" / "single_tight.fa").read_text().splitlines(keepends=True)
+    half = len(lines) // 4 * 2
+    lanes = [tmp_path / "lane_1.fa", tmp_path / "lane_2.fa"]
+    lanes[0].write_text("".join(lines[:half]))
+    lanes[1].write_text("".join(lines[half:]))
+    index_file = tmp_path / "library.idx"
+
+    outputs = []
+    for lane, index_args in zip(lanes, (["--index-out", str(index_file)],
+                                        ["--index-in", str(index_file), "--index-out", str(index_file)])):
+        output_file = tmp_path / f"dedup_{lane.name}"
+        result = subprocess.run(
+            [str(exe_path), "-i", str(lane), "-o", str(output_file), "--format", "fasta", *index_args],
+            capture_output=True,
+            text=True
+        )
+        assert result.returncode == 0, f"fastq-dupaway failed: {result.stderr}"
+        outputs.append(output_file)
+
+    def read_seqs(path):
+        return [line for line in path.read_text().splitlines() if not line.startswith(">")]
+
+    expected_output = tests_path / "expected" / "single_tight.fa"
+    assert sorted(read_seqs(outputs[0]) + read_seqs(outputs[1])) == sorted(read_seqs(expected_output)), \
+        "Deduplication against index does not match deduplication of joint input"
+
+
+@pytest.mark.parametrize("cli_args", [[], ["--temp-compression", "zstd"]])
+def test_joint_lanes(tmp_path, exe_path, tests_path, cli_args):
+    if not exe_path.exists():
+        pytest.fail("fastq-dupaway binary not found in current directory!")
+
+    # split input into three "lanes" deduplicated jointly, each one with its own output
+    lines = (tests_path / "inputs" / "single_tight.fa").read_text().splitlines(keepends=True)
+    third = len(lines) // 6 * 2
+    lanes = [tmp_path / f"lane_{i}.fa" for i in range(3)]
+    lanes[0].write_text("".join(lines[:third]))
+    lanes[1].write_text("".join(lines[third:2 * third]))
+    lanes[2].write_text("".join(lines[2 * third:]))
+    outputs = [tmp_path / f"dedup_{lane.name}" for lane in lanes]
+
+    result = subprocess.run(
+        [str(exe_path), "-i", *(str(lane) for lane in lanes), "-o", *(str(output) for output in outputs),
+         "--format", "fasta", "--threads", "2", *cli_args],
+        capture_output=True,
+        text=True
+    )
+    assert result.returncode == 0, f"fastq-dupaway failed: {result.stderr}"
+
+    def read_lines(path, ids):
+        return [line for line in path.read_text().splitlines() if line.startswith(">") == ids]
+
+    # reads go back to their own lanes
+    for lane, output in zip(lanes, outputs):
+        assert set(read_lines(output, True)) <= set(read_lines(lane, True)), f"Output {output} has reads of other lanes"
+
+    expected_output = tests_path / "expected" / "single_tight.fa"
+    joint_seqs = sum((read_lines(output, False) for output in outputs), [])
+    assert sorted(joint_seqs) == sorted(read_lines(expected_output, False)), \
+        "Joint deduplication of lanes does not match deduplication of concatenated input"
+
+
+def test_manifest(tmp_path, exe_path, tests_path):
+    if not exe_path.exists():
+        pytest.fail("fastq-dupaway binary not found in current directory!")
+
+    inputs = tests_path / "inputs"
+    expected = tests_path / "expected"
+    samples = [
+        ([inputs / "single_tight.fa"], [tmp_path / "single_tight.fa"], [expected / "single_tight.fa"]),
+        ([inputs / "paired_tight_r1.fa", inputs / "paired_tight_r2.fa"],
+         [tmp_path / "paired_tight_r1.fa", tmp_path / "paired_tight_r2.fa"],
+         [expected / "paired_tight_r1.fa", expected / "paired_tight_r2.fa"]),
+    ]
+    manifest = tmp_path / "manifest.tsv"
+    manifest.write_text("# inputs and outputs\n" + "".join(
+        "\t".join(str(path) for path in sample_inputs + sample_outputs) + "\n"
+        for sample_inputs, sample_outputs, _ in samples
+    ))
+
+    result = subprocess.run(
+        [str(exe_path), "--manifest", str(manifest), "--format", "fasta", "--threads", "2"],
+        capture_output=True,
+        text=True
+    )
+    assert result.returncode == 0, f"fastq-dupaway failed: {result.stderr}"
+
+    for _, sample_outputs, sample_expected in samples:
+        for output, expected_output in zip(sample_outputs, sample_expected):
+            assert output.exists(), f"Output file {output} was not created!"
+            files_match = filecmp.cmp(output, expected_output, shallow=False)
+            assert files_match, f"Output file {output} does not match expected {expected_output}"
+
+
+def test_shards(tmp_path, exe_path, tests_path):
+    if not exe_path.exists():
+        pytest.fail("fastq-dupaway binary not found in current directory!")
+
+    input_file = tests_path / "inputs" / "single_tight.fa"
+    expected_output = tests_path / "expected" / "single_tight.fa"
+    num_shards = 3
+
+    # shards are deduplicated by independent processes
+    shard_outputs = [tmp_path / f"shard_{i}.fa" for i in range(1, num_shards + 1)]
+    processes = [
+        subprocess.Popen(
+            [str(exe_path), "-i", str(input_file), "-o", str(output), "--format", "fasta",
+             "--shard", f"{i}/{num_shards}"],
+            stdout=subprocess.PIPE, stderr=subprocess.PIPE, text=True
+        )
+        for i, output in enumerate(shard_outputs, start=1)
+    ]
+    for process in processes:
+        _, stderr = process.communicate()
+        assert process.returncode == 0, f"fastq-dupaway failed: {stderr}"
+
+    output_file = tmp_path / "merged.fa"
+    result = subprocess.run(
+        [str(exe_path), "--merge-shards", "-i", *(str(output) for output in reversed(shard_outputs)),
+         "-o", str(output_file), "--format", "fasta"],
+        capture_output=True,
+        text=True
+    )
+    assert result.returncode == 0, f"fastq-dupaway failed: {result.stderr}"
+
+    # the same duplicate of a sequence may not be kept, but sequences and their order should match
+    def read_seqs(path):
+        return [line for line in path.read_text().splitlines() if not line.startswith(">")]
+
+    assert read_seqs(output_file) == read_seqs(expected_output), \
+        f"Merged shards {output_file} do not match expected {expected_output}"
+
+
+def test_stats_json(tmp_path, exe_path, tests_path):
+    if not exe_path.exists():
+        pytest.fail("fastq-dupaway binary not found in current directory!")
+
+    input_file = tests_path / "inputs" / "single_tight.fa"
+    expected_output = tests_path / "expected" / "single_tight.fa"
+    output_file = tmp_path / "single_tight.fa"
+    stats_file = tmp_path / "stats.json"
+
+    result = subprocess.run(
+        [str(exe_path), "-i", str(input_file), "-o", str(output_file), "--format", "fasta",
+         "--stats-json", str(stats_file)],
+        capture_output=True,
+        text=True
+    )
+
+    assert result.returncode == 0, f"fastq-dupaway failed: {result.stderr}"
+    assert filecmp.cmp(output_file, expected_output, shallow=False)
+
+    stats = json.loads(stats_file.read_text())
+    assert stats["bytes"]["input_read"] == input_file.stat().st_size
+    assert stats["bytes"]["output_written"] == expected_output.stat().st_size
+    assert stats["peak_rss_bytes"] > 0
+    phases = {phase["name"]: phase for phase in stats["phases"]}
+    assert phases["sort: run generation"]["runs"] == 1
+    assert phases["dedup"]["records"] == len(input_file.read_text().splitlines()) // 2
+    assert 0 < phases["dedup"]["peak_rss_so_far_bytes"] <= stats["peak_rss_bytes"]
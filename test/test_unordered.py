@@ -46,3 +46,50 @@ def test_unordered(tmp_path, exe_path, tests_path, filename):
         assert output.exists(), f"Output file {output} was not created!"
         files_match = filecmp.cmp(output, expected, shallow=False)
         assert files_match, f"Output file {output} does not match expected {expected}"
+
+
+def read_fasta_records(path):
+    lines = path.read_text().splitlines()
+    return sorted(zip(lines[::2], lines[1::2]))
+
+
+@pytest.mark.parametrize(
+    "filename",
+    [
+        "shuffled",
+        "skewed",
+        "deletion",
+        "interleaved",
+        "not_overlapped"
+    ],
+)
+def test_unordered_hash_join(tmp_path, exe_path, tests_path, filename):
+    if not exe_path.exists():
+        pytest.fail("fastq-dupaway binary not found in current directory!")
+
+    input_file_1 = tests_path / "inputs" / f"unordered_{filename}_r1.fa"
+    input_file_2 = tests_path / "inputs" / f"unordered_{filename}_r2.fa"
+
+    output_file_1 = tmp_path / f"unordered_{filename}_r1.fa"
+    output_file_2 = tmp_path / f"unordered_{filename}_r2.fa"
+
+    expected_output_1 = tests_path / "expected" / f"unordered_{filename}_r1.fa"
+    expected_output_2 = tests_path / "expected" / f"unordered_{filename}_r2.fa"
+
+    result = subprocess.run(
+        [str(exe_path), "-i", str(input_file_1), "-u", str(input_file_2),
+         "-o", str(output_file_1), "-p", str(output_file_2), *ARGS, "--hash-join"],
+        capture_output=True,
+        text=True
+    )
+
+    assert result.returncode == 0, f"fastq-dupaway failed: {result.stderr}"
+
+    # pairs follow the order of the second input, so only sets of records are compared
+    for output, expected in zip(
+        (output_file_1, output_file_2),
+        (expected_output_1, expected_output_2)
+    ):
+        assert output.exists(), f"Output file {output} was not created!"
+        assert read_fasta_records(output) == read_fasta_records(expected), \
+            f"Records of {output} do not match expected {expected}"